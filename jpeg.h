@@ -0,0 +1,768 @@
+/** \file
+ * Baseline JPEG decoder for MJPEG cameras.
+ *
+ * Only what webcams send: 8-bit sequential Huffman (SOF0/SOF1), one
+ * interleaved scan of 1 or 3 components, any sampling factors and restart
+ * intervals.  Most MJPEG frames leave out the Huffman tables (DHT) so the
+ * standard tables from Annex K are used when a frame doesn't have its own.
+ *
+ * jpeg_decode_luma only dequantizes and transforms the luma blocks of the
+ * MCUs covering a rectangle.  Every block up to the last MCU of the
+ * rectangle still has to be Huffman decoded for the DC prediction, unless
+ * the frame has restart markers.  Then decoding starts at the restart
+ * interval holding the first MCU, found by scanning for the markers, so
+ * everything above the rectangle is skipped.
+ *
+ * jpeg_decode_frame decodes everything to a luma plane and YUYV.
+ *
+ * Usage: jpeg_init once, then jpeg_parse and one of the decodes per frame.
+ */
+#ifndef _jpeg_h_
+#define _jpeg_h_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+// codes this long or shorter are decoded with one table lookup
+#define JPEG_FAST_BITS 9
+
+typedef struct {
+    // (length << 8) | symbol for every code of JPEG_FAST_BITS or less
+    // followed by any bits, 0 for longer codes
+    uint16_t fast[1 << JPEG_FAST_BITS];
+    // canonical code ranges for each length, maxcode is -1 for none
+    int32_t maxcode[17];
+    int32_t mincode[17];
+    int32_t valptr[17];
+    uint8_t values[256];
+} jpeg_huffman;
+
+typedef struct {
+    int id;
+    // sampling factors
+    int h;
+    int v;
+    // quantization and Huffman tables
+    int tq;
+    int td;
+    int ta;
+    int dc_pred;
+} jpeg_component;
+
+typedef struct {
+    int width;
+    int height;
+    int n_components;
+    jpeg_component components[3];
+    int hmax;
+    int vmax;
+    // MCU size in pixels and count
+    int mcu_width;
+    int mcu_height;
+    int mcus_x;
+    int mcus_y;
+    // MCUs between restart markers, 0 for none
+    int restart_interval;
+
+    // zigzag order
+    uint16_t quant[4][64];
+    jpeg_huffman dc[4];
+    jpeg_huffman ac[4];
+    // tables from a DHT instead of the standard ones
+    bool custom_tables;
+
+    // entropy coded data after the SOS
+    const uint8_t *scan;
+    const uint8_t *end;
+} jpeg_decoder;
+
+/* Implementation */
+
+// natural order index of each zigzag position
+static const uint8_t jpeg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Annex K.3 tables, count of codes of each length 1 to 16 then the symbols
+static const uint8_t jpeg_std_dc_luma[16 + 12] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const uint8_t jpeg_std_dc_chroma[16 + 12] = {
+    0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+};
+
+static const uint8_t jpeg_std_ac_luma[16 + 162] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+static const uint8_t jpeg_std_ac_chroma[16 + 162] = {
+    0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+// bits are counts of codes of each length 1 to 16, false if they don't make
+// a valid code
+static bool
+jpeg_build_huffman(jpeg_huffman *h, const uint8_t *bits, const uint8_t *values)
+{
+    int n = 0;
+    for (int len = 0; len < 16; len++) {
+        n += bits[len];
+    }
+    if (n > 256) {
+        return false;
+    }
+
+    memset(h->fast, 0, sizeof(h->fast));
+    memcpy(h->values, values, n);
+
+    int code = 0;
+    int k = 0;
+    for (int len = 1; len <= 16; len++) {
+        h->valptr[len] = k;
+        h->mincode[len] = code;
+        // checked before filling, too many short codes would run off fast
+        if (code + bits[len - 1] > 1 << len) {
+            return false;
+        }
+        for (int i = 0; i < bits[len - 1]; i++, k++, code++) {
+            if (len <= JPEG_FAST_BITS) {
+                int shift = JPEG_FAST_BITS - len;
+                for (int j = 0; j < 1 << shift; j++) {
+                    h->fast[(code << shift) | j] = (len << 8) | values[k];
+                }
+            }
+        }
+        h->maxcode[len] = bits[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    return true;
+}
+
+static void
+jpeg_std_tables(jpeg_decoder *d)
+{
+    jpeg_build_huffman(&d->dc[0], jpeg_std_dc_luma, jpeg_std_dc_luma + 16);
+    jpeg_build_huffman(&d->dc[1], jpeg_std_dc_chroma, jpeg_std_dc_chroma + 16);
+    jpeg_build_huffman(&d->ac[0], jpeg_std_ac_luma, jpeg_std_ac_luma + 16);
+    jpeg_build_huffman(&d->ac[1], jpeg_std_ac_chroma, jpeg_std_ac_chroma + 16);
+    d->custom_tables = false;
+}
+
+void
+jpeg_init(jpeg_decoder *d)
+{
+    memset(d, 0, sizeof(*d));
+    jpeg_std_tables(d);
+}
+
+static int
+jpeg_u16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+/*
+ * Reads the headers up to the start of the scan.  Returns false for
+ * anything this decoder doesn't handle: progressive, 12-bit, arithmetic,
+ * multiple scans.
+ */
+bool
+jpeg_parse(jpeg_decoder *d, const uint8_t *data, size_t size)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    bool have_frame = false;
+    bool have_dht = false;
+
+    if (size < 4 || p[0] != 0xff || p[1] != 0xd8) {
+        return false;
+    }
+    p += 2;
+
+    while (p + 4 <= end) {
+        if (p[0] != 0xff) {
+            return false;
+        }
+        int marker = p[1];
+        if (marker == 0xff) {
+            // fill byte
+            p++;
+            continue;
+        }
+        p += 2;
+
+        if (marker == 0xd9 || (marker >= 0xd0 && marker <= 0xd7)) {
+            return false;
+        }
+
+        int len = jpeg_u16(p);
+        if (len < 2 || p + len > end) {
+            return false;
+        }
+        const uint8_t *seg = p + 2;
+        const uint8_t *seg_end = p + len;
+        p = seg_end;
+
+        if (marker == 0xc0 || marker == 0xc1) {
+            if (len < 8 || seg[0] != 8) {
+                return false;
+            }
+            d->height = jpeg_u16(seg + 1);
+            d->width = jpeg_u16(seg + 3);
+            d->n_components = seg[5];
+            if (d->width == 0 || d->height == 0
+                    || (d->n_components != 1 && d->n_components != 3)
+                    || len < 8 + 3*d->n_components) {
+                return false;
+            }
+
+            d->hmax = 1;
+            d->vmax = 1;
+            for (int i = 0; i < d->n_components; i++) {
+                jpeg_component *c = &d->components[i];
+                c->id = seg[6 + i*3];
+                c->h = seg[7 + i*3] >> 4;
+                c->v = seg[7 + i*3] & 0xf;
+                c->tq = seg[8 + i*3] & 3;
+                if (c->h < 1 || c->h > 2 || c->v < 1 || c->v > 2) {
+                    return false;
+                }
+                if (d->n_components == 1) {
+                    // a single component scan isn't interleaved, the MCU
+                    // is one block whatever the sampling
+                    c->h = 1;
+                    c->v = 1;
+                }
+                d->hmax = c->h > d->hmax ? c->h : d->hmax;
+                d->vmax = c->v > d->vmax ? c->v : d->vmax;
+            }
+
+            d->mcu_width = d->hmax*8;
+            d->mcu_height = d->vmax*8;
+            d->mcus_x = (d->width + d->mcu_width - 1)/d->mcu_width;
+            d->mcus_y = (d->height + d->mcu_height - 1)/d->mcu_height;
+            d->restart_interval = 0;
+            have_frame = true;
+        } else if (marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            // progressive, lossless, arithmetic
+            return false;
+        } else if (marker == 0xc4) {
+            const uint8_t *q = seg;
+            while (q + 17 <= seg_end) {
+                int tc = q[0] >> 4;
+                int th = q[0] & 3;
+                int n = 0;
+                for (int i = 0; i < 16; i++) {
+                    n += q[1 + i];
+                }
+                if (tc > 1 || q + 17 + n > seg_end) {
+                    return false;
+                }
+                if (!jpeg_build_huffman(tc ? &d->ac[th] : &d->dc[th], q + 1, q + 17)) {
+                    return false;
+                }
+                q += 17 + n;
+            }
+            have_dht = true;
+            d->custom_tables = true;
+        } else if (marker == 0xdb) {
+            const uint8_t *q = seg;
+            while (q + 65 <= seg_end) {
+                if (q[0] >> 4) {
+                    // 16-bit tables are only for 12-bit images
+                    return false;
+                }
+                uint16_t *t = d->quant[q[0] & 3];
+                for (int i = 0; i < 64; i++) {
+                    t[i] = q[1 + i];
+                }
+                q += 65;
+            }
+        } else if (marker == 0xdd) {
+            if (len < 4) {
+                return false;
+            }
+            d->restart_interval = jpeg_u16(seg);
+        } else if (marker == 0xda) {
+            if (len < 3) {
+                return false;
+            }
+            int n = seg[0];
+            if (!have_frame || n != d->n_components || len < 6 + 2*n) {
+                return false;
+            }
+            for (int i = 0; i < n; i++) {
+                jpeg_component *c = &d->components[i];
+                if (seg[1 + i*2] != c->id) {
+                    return false;
+                }
+                c->td = seg[2 + i*2] >> 4 & 3;
+                c->ta = seg[2 + i*2] & 3;
+            }
+
+            if (!have_dht && d->custom_tables) {
+                jpeg_std_tables(d);
+            }
+
+            d->scan = seg_end;
+            d->end = end;
+
+            return true;
+        }
+        // APPn, COM and the rest are skipped
+    }
+
+    return false;
+}
+
+/*
+ * Entropy coded data reader.  bits holds n_bits with the next one at the
+ * top.  0xff 0x00 is a 0xff data byte, any other 0xff is a marker and
+ * zeros are fed after it.
+ */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t bits;
+    int n_bits;
+    bool marker;
+} jpeg_bits;
+
+static void
+jpeg_fill(jpeg_bits *b)
+{
+    while (b->n_bits <= 56) {
+        uint64_t c = 0;
+        if (!b->marker && b->p < b->end) {
+            c = *b->p;
+            if (c == 0xff) {
+                if (b->p + 1 < b->end && b->p[1] == 0x00) {
+                    b->p += 2;
+                } else {
+                    b->marker = true;
+                    c = 0;
+                }
+            } else {
+                b->p++;
+            }
+        }
+        b->bits |= c << (56 - b->n_bits);
+        b->n_bits += 8;
+    }
+}
+
+static inline void
+jpeg_skip_bits(jpeg_bits *b, int n)
+{
+    b->bits <<= n;
+    b->n_bits -= n;
+}
+
+// next Huffman symbol, -1 for a bad code.  Leaves at least 16 bits for the
+// value after it.
+static inline int
+jpeg_huffman_decode(jpeg_bits *b, const jpeg_huffman *h)
+{
+    if (b->n_bits < 32) {
+        jpeg_fill(b);
+    }
+
+    int f = h->fast[b->bits >> (64 - JPEG_FAST_BITS)];
+    if (f) {
+        jpeg_skip_bits(b, f >> 8);
+        return f & 0xff;
+    }
+
+    for (int len = JPEG_FAST_BITS + 1; len <= 16; len++) {
+        int32_t code = b->bits >> (64 - len);
+        if (code <= h->maxcode[len]) {
+            jpeg_skip_bits(b, len);
+            return h->values[h->valptr[len] + code - h->mincode[len]];
+        }
+    }
+
+    return -1;
+}
+
+// s bit signed value
+static inline int
+jpeg_receive_extend(jpeg_bits *b, int s)
+{
+    int v = b->bits >> (64 - s);
+    jpeg_skip_bits(b, s);
+
+    return v < 1 << (s - 1) ? v - (1 << s) + 1 : v;
+}
+
+/*
+ * Decodes one block in natural order into coef, or only reads past it if
+ * coef is NULL.  Returns -1 for bad data, otherwise 1 if there are non-zero
+ * AC coefficients.
+ */
+static int
+jpeg_decode_block(jpeg_bits *b, const jpeg_huffman *dc, const jpeg_huffman *ac, const uint16_t *q,
+        int *dc_pred, int32_t *coef)
+{
+    int t = jpeg_huffman_decode(b, dc);
+    if (t < 0 || t > 11) {
+        return -1;
+    }
+    if (t) {
+        *dc_pred += jpeg_receive_extend(b, t);
+    }
+
+    int has_ac = 0;
+    if (coef) {
+        memset(coef, 0, 64*sizeof(coef[0]));
+        coef[0] = *dc_pred*q[0];
+    }
+
+    for (int k = 1; k < 64; ) {
+        int rs = jpeg_huffman_decode(b, ac);
+        if (rs < 0) {
+            return -1;
+        }
+
+        int r = rs >> 4;
+        int s = rs & 15;
+        if (s == 0) {
+            if (r != 15) {
+                // end of block
+                break;
+            }
+            k += 16;
+            continue;
+        }
+
+        k += r;
+        if (k > 63) {
+            return -1;
+        }
+        if (coef) {
+            coef[jpeg_zigzag[k]] = jpeg_receive_extend(b, s)*q[k];
+            has_ac = 1;
+        } else {
+            jpeg_skip_bits(b, s);
+        }
+        k++;
+    }
+
+    return has_ac;
+}
+
+static inline uint8_t
+jpeg_clamp(int x)
+{
+    return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+// integer 1-D IDCT from the IJG islow method with 12 bits of fraction
+#define JPEG_FIX(x) ((int32_t)((x)*4096 + 0.5))
+
+static inline void
+jpeg_idct_1d(const int32_t *s, int step, int32_t *x, int32_t *t)
+{
+    int32_t p1, p2, p3, p4, p5;
+
+    p2 = s[2*step];
+    p3 = s[6*step];
+    p1 = (p2 + p3)*JPEG_FIX(0.5411961);
+    int32_t t2 = p1 + p3*JPEG_FIX(-1.847759065);
+    int32_t t3 = p1 + p2*JPEG_FIX(0.765366865);
+    int32_t t0 = (s[0] + s[4*step])*4096;
+    int32_t t1 = (s[0] - s[4*step])*4096;
+    x[0] = t0 + t3;
+    x[3] = t0 - t3;
+    x[1] = t1 + t2;
+    x[2] = t1 - t2;
+
+    t0 = s[7*step];
+    t1 = s[5*step];
+    t2 = s[3*step];
+    t3 = s[1*step];
+    p3 = t0 + t2;
+    p4 = t1 + t3;
+    p1 = t0 + t3;
+    p2 = t1 + t2;
+    p5 = (p3 + p4)*JPEG_FIX(1.175875602);
+    t0 = t0*JPEG_FIX(0.298631336);
+    t1 = t1*JPEG_FIX(2.053119869);
+    t2 = t2*JPEG_FIX(3.072711026);
+    t3 = t3*JPEG_FIX(1.501321110);
+    p1 = p5 + p1*JPEG_FIX(-0.899976223);
+    p2 = p5 + p2*JPEG_FIX(-2.562915447);
+    p3 = p3*JPEG_FIX(-1.961570560);
+    p4 = p4*JPEG_FIX(-0.390180644);
+    t[3] = t3 + p1 + p4;
+    t[2] = t2 + p2 + p3;
+    t[1] = t1 + p2 + p4;
+    t[0] = t0 + p1 + p3;
+}
+
+// 8x8 pixels from dequantized coefficients in natural order
+static void
+jpeg_idct(const int32_t *coef, bool has_ac, uint8_t *out, int stride)
+{
+    if (!has_ac) {
+        uint8_t v = jpeg_clamp(((coef[0] + 4) >> 3) + 128);
+        for (int y = 0; y < 8; y++) {
+            memset(out + y*stride, v, 8);
+        }
+        return;
+    }
+
+    int32_t tmp[64];
+    int32_t x[4];
+    int32_t t[4];
+
+    // columns, keeping 2 extra bits
+    for (int i = 0; i < 8; i++) {
+        const int32_t *c = coef + i;
+        int32_t *v = tmp + i;
+        if (!c[8] && !c[16] && !c[24] && !c[32] && !c[40] && !c[48] && !c[56]) {
+            int32_t dc = c[0]*4;
+            for (int k = 0; k < 8; k++) {
+                v[k*8] = dc;
+            }
+            continue;
+        }
+
+        jpeg_idct_1d(c, 8, x, t);
+        for (int k = 0; k < 4; k++) {
+            x[k] += 512;
+        }
+        v[0] = (x[0] + t[3]) >> 10;
+        v[56] = (x[0] - t[3]) >> 10;
+        v[8] = (x[1] + t[2]) >> 10;
+        v[48] = (x[1] - t[2]) >> 10;
+        v[16] = (x[2] + t[1]) >> 10;
+        v[40] = (x[2] - t[1]) >> 10;
+        v[24] = (x[3] + t[0]) >> 10;
+        v[32] = (x[3] - t[0]) >> 10;
+    }
+
+    // rows, removing the 12 + 2 + 3 bits of scale with rounding and the
+    // level shift
+    for (int i = 0; i < 8; i++) {
+        const int32_t *v = tmp + i*8;
+        uint8_t *o = out + i*stride;
+
+        jpeg_idct_1d(v, 1, x, t);
+        for (int k = 0; k < 4; k++) {
+            x[k] += 65536 + (128 << 17);
+        }
+        o[0] = jpeg_clamp((x[0] + t[3]) >> 17);
+        o[7] = jpeg_clamp((x[0] - t[3]) >> 17);
+        o[1] = jpeg_clamp((x[1] + t[2]) >> 17);
+        o[6] = jpeg_clamp((x[1] - t[2]) >> 17);
+        o[2] = jpeg_clamp((x[2] + t[1]) >> 17);
+        o[5] = jpeg_clamp((x[2] - t[1]) >> 17);
+        o[3] = jpeg_clamp((x[3] + t[0]) >> 17);
+        o[4] = jpeg_clamp((x[3] - t[0]) >> 17);
+    }
+}
+
+// moves past the next RSTn marker, false if there isn't one
+static bool
+jpeg_restart(jpeg_decoder *d, jpeg_bits *b)
+{
+    const uint8_t *p = b->p;
+    while (p + 1 < d->end) {
+        p = memchr(p, 0xff, d->end - p - 1);
+        if (!p) {
+            return false;
+        }
+        if (p[1] >= 0xd0 && p[1] <= 0xd7) {
+            b->p = p + 2;
+            b->bits = 0;
+            b->n_bits = 0;
+            b->marker = false;
+            for (int i = 0; i < d->n_components; i++) {
+                d->components[i].dc_pred = 0;
+            }
+            return true;
+        }
+        p++;
+    }
+
+    return false;
+}
+
+/*
+ * Decodes the MCUs covering the rectangle x, y, width, height.  luma gets
+ * the luma of the rectangle, yuyv (optional) the color.  Only the blocks
+ * that are written are transformed.
+ */
+static bool
+jpeg_decode_rect(jpeg_decoder *d, int x, int y, int width, int height,
+        uint8_t *luma, int luma_stride, uint8_t *yuyv, int yuyv_stride)
+{
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > d->width || y + height > d->height) {
+        return false;
+    }
+
+    const int mx0 = x/d->mcu_width;
+    const int mx1 = (x + width - 1)/d->mcu_width;
+    const int my0 = y/d->mcu_height;
+    const int my1 = (y + height - 1)/d->mcu_height;
+    const int first = my0*d->mcus_x + mx0;
+    const int last = my1*d->mcus_x + mx1;
+
+    jpeg_bits b = { .p = d->scan, .end = d->end };
+    for (int i = 0; i < d->n_components; i++) {
+        d->components[i].dc_pred = 0;
+    }
+
+    // skip whole restart intervals before the first MCU
+    int start = 0;
+    if (d->restart_interval) {
+        int skip = first/d->restart_interval;
+        for (int i = 0; i < skip; i++) {
+            if (!jpeg_restart(d, &b)) {
+                return false;
+            }
+        }
+        start = skip*d->restart_interval;
+    }
+
+    // one MCU of each component, at most 16x16
+    uint8_t pixels[3][256];
+    int32_t coef[64];
+
+    for (int mcu = start; mcu <= last; mcu++) {
+        if (d->restart_interval && mcu > start && mcu % d->restart_interval == 0 && !jpeg_restart(d, &b)) {
+            return false;
+        }
+
+        const int mx = mcu % d->mcus_x;
+        const int my = mcu/d->mcus_x;
+        const bool inside = mx >= mx0 && mx <= mx1 && my >= my0 && my <= my1;
+
+        for (int ci = 0; ci < d->n_components; ci++) {
+            jpeg_component *c = &d->components[ci];
+            const bool transform = inside && (ci == 0 || yuyv);
+            const int stride = c->h*8;
+
+            for (int by = 0; by < c->v; by++) {
+                for (int bx = 0; bx < c->h; bx++) {
+                    int has_ac = jpeg_decode_block(&b, &d->dc[c->td], &d->ac[c->ta], d->quant[c->tq],
+                            &c->dc_pred, transform ? coef : NULL);
+                    if (has_ac < 0) {
+                        return false;
+                    }
+                    if (transform) {
+                        jpeg_idct(coef, has_ac, pixels[ci] + by*8*stride + bx*8, stride);
+                    }
+                }
+            }
+        }
+
+        if (!inside) {
+            continue;
+        }
+
+        // the part of this MCU inside the rectangle
+        const int px = mx*d->mcu_width;
+        const int py = my*d->mcu_height;
+        const int x0 = px > x ? px : x;
+        const int y0 = py > y ? py : y;
+        const int x1 = px + d->mcu_width < x + width ? px + d->mcu_width : x + width;
+        const int y1 = py + d->mcu_height < y + height ? py + d->mcu_height : y + height;
+
+        const jpeg_component *lc = &d->components[0];
+        for (int row = y0; row < y1; row++) {
+            const int ly = (row - py)*lc->v/d->vmax;
+            const uint8_t *src = pixels[0] + ly*lc->h*8;
+            uint8_t *dst = luma + (row - y)*luma_stride - x;
+            if (lc->h == d->hmax) {
+                memcpy(dst + x0, src + x0 - px, x1 - x0);
+            } else {
+                for (int col = x0; col < x1; col++) {
+                    dst[col] = src[(col - px)*lc->h/d->hmax];
+                }
+            }
+        }
+
+        if (!yuyv) {
+            continue;
+        }
+
+        // chroma sample for each column and row of the MCU, U for even
+        // columns and V for odd, both sampled at the even column
+        uint8_t cols[16];
+        const uint8_t *rows[2];
+        for (int i = 0; i < d->mcu_width; i++) {
+            const jpeg_component *c = &d->components[(i & 1) + 1];
+            cols[i] = (i & ~1)*c->h/d->hmax;
+        }
+
+        for (int row = y0; row < y1; row++) {
+            uint8_t *dst = yuyv + (row - y)*yuyv_stride - x*2;
+            const uint8_t *ysrc = luma + (row - y)*luma_stride - x;
+            if (d->n_components == 3) {
+                for (int ci = 1; ci < 3; ci++) {
+                    const jpeg_component *c = &d->components[ci];
+                    rows[ci - 1] = pixels[ci] + (row - py)*c->v/d->vmax*c->h*8;
+                }
+                for (int col = x0; col < x1; col++) {
+                    dst[col*2] = ysrc[col];
+                    dst[col*2 + 1] = rows[col & 1][cols[col - px]];
+                }
+            } else {
+                for (int col = x0; col < x1; col++) {
+                    dst[col*2] = ysrc[col];
+                    dst[col*2 + 1] = 0x80;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// luma of the rectangle x, y, width, height to out
+bool
+jpeg_decode_luma(jpeg_decoder *d, uint8_t *out, int stride, int x, int y, int width, int height)
+{
+    return jpeg_decode_rect(d, x, y, width, height, out, stride, NULL, 0);
+}
+
+// the whole frame to a luma plane and YUYV, yuyv can be NULL
+bool
+jpeg_decode_frame(jpeg_decoder *d, uint8_t *luma, int luma_stride, uint8_t *yuyv, int yuyv_stride)
+{
+    return jpeg_decode_rect(d, 0, 0, d->width, d->height, luma, luma_stride, yuyv, yuyv_stride);
+}
+
+#endif
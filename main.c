@@ -11,8 +11,10 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 #include <time.h>
+#include <math.h>
 
 // NOTE(jason): have to use termios2 and ioctl in order to set line speed to
 // non-standard values
@@ -20,10 +22,22 @@
 //#include <asm/termbits.h>
 
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include <linux/videodev2.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "SDL.h"
 #include "asteroids_font.h"
+#include "median_net.h"
+#include "jpeg.h"
 
 #include "fu.h"
 
@@ -38,7 +52,8 @@ static int
 sdl_filter(void *userdata, SDL_Event *event)
 {
     (void)userdata;
-    return event->type == SDL_QUIT || event->type == SDL_KEYDOWN;
+    // user events are new frames from the capture threads
+    return event->type == SDL_QUIT || event->type == SDL_KEYDOWN || event->type >= SDL_USEREVENT;
 }
 
 // currently used for v4l2
@@ -47,7 +62,7 @@ struct buffer {
     size_t length;
 };
 
-inline
+static inline
 int clamp(int n, int min, int max)
 {
     if (n < min) {
@@ -60,12 +75,54 @@ int clamp(int n, int min, int max)
 }
 
 // clamp a value to 0 to 255
-inline
+static inline
 int clamp255(int n)
 {
     return clamp(n, 0, 255);
 }
 
+/*
+ * Rects drawn on an image since it was last uploaded, so only they have to
+ * be cleared and uploaded again.  all once there are too many to keep.
+ */
+#define DAMAGE_MAX_RECTS 64
+
+struct damage {
+    bool all;
+    int n_rects;
+    SDL_Rect rects[DAMAGE_MAX_RECTS];
+};
+
+// adds r unless it's inside one already there
+void
+damage_add(struct damage *d, SDL_Rect r)
+{
+    if (d->all || r.w <= 0 || r.h <= 0) {
+        return;
+    }
+    for (int i = 0; i < d->n_rects; i++) {
+        const SDL_Rect *o = &d->rects[i];
+        if (r.x >= o->x && r.y >= o->y && r.x + r.w <= o->x + o->w && r.y + r.h <= o->y + o->h) {
+            return;
+        }
+    }
+    if (d->n_rects == DAMAGE_MAX_RECTS) {
+        d->all = true;
+        return;
+    }
+    d->rects[d->n_rects++] = r;
+}
+
+// every rect of from in d
+void
+damage_merge(struct damage *d, const struct damage *from)
+{
+    d->all = d->all || from->all;
+    for (int i = 0; i < from->n_rects; i++) {
+        damage_add(d, from->rects[i]);
+    }
+}
+
 typedef struct {
     int width;
     int height;
@@ -73,11 +130,14 @@ typedef struct {
     int stride;
     int n_pixels;
     u8 *data;
+    // where the drawing functions drew, NULL when it isn't tracked
+    struct damage *damage;
 } image;
 
 image * new_image(int width, int height, int channels)
 {
     image *img = malloc(sizeof(*img));
+    img->damage = NULL;
     img->n_pixels = height*width;
     img->height = height;
     img->width = width;
@@ -89,23 +149,6 @@ image * new_image(int width, int height, int channels)
     return img;
 }
 
-// YV12 is the MS recommended video YUV420 video format.
-image *
-new_yv12_image(int width, int height)
-{
-    image *img = malloc(sizeof(*img));
-    img->n_pixels = width*height;
-    img->height = height;
-    img->width = width;
-    img->channels = 1;
-    img->stride = img->width;
-    img->data = calloc(img->n_pixels + img->n_pixels/2, sizeof(img->data[0]));
-
-    memset(img->data, 0x80, img->n_pixels + img->n_pixels/2);
-
-    return img;
-}
-
 image * new_image_like(image *img) {
     return new_image(img->width, img->height, img->channels);
 }
@@ -123,6 +166,38 @@ void clear_image(image *img)
     memset(img->data, 0, img->n_pixels*img->channels);
 }
 
+// records x, y, width, height clipped to img as drawn on
+static inline
+void image_damage(image *img, int x, int y, int width, int height)
+{
+    if (!img->damage) {
+        return;
+    }
+    int x1 = clamp(x + width, 0, img->width);
+    int y1 = clamp(y + height, 0, img->height);
+    x = clamp(x, 0, img->width);
+    y = clamp(y, 0, img->height);
+    damage_add(img->damage, (SDL_Rect){ x, y, x1 - x, y1 - y });
+}
+
+// copies the damaged rects of from onto img, the same size
+void
+copy_damage(image *img, const image *from, const struct damage *d)
+{
+    assert(img->n_pixels == from->n_pixels && img->channels == from->channels);
+    if (d->all) {
+        memcpy(img->data, from->data, img->n_pixels*img->channels);
+        return;
+    }
+    for (int i = 0; i < d->n_rects; i++) {
+        const SDL_Rect *r = &d->rects[i];
+        for (int row = r->y; row < r->y + r->h; row++) {
+            size_t offset = (size_t)row*img->stride + r->x*img->channels;
+            memcpy(img->data + offset, from->data + offset, r->w*img->channels);
+        }
+    }
+}
+
 void
 checkerboard_yv12(image *img, int size)
 {
@@ -275,32 +350,66 @@ const color YELLOW = {
     .alpha = 255
 };
 
+/*
+ * Count of pixels where a and b differ by more than threshold.  If mask isn't
+ * NULL it gets the pixel from a where changed, otherwise 0.
+ *
+ * This is the reference for the SIMD versions.
+ */
 int
-percent_diff_images(const image *a, const image *b, image *c, int threshold)
+diff_count_scalar(const u8 *a, const u8 *b, u8 *mask, const int n, const int threshold)
 {
-    assert(a->n_pixels == b->n_pixels);
-    assert(a->channels == b->channels);
-    assert(a->channels == 1);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int changed = abs(a[i] - b[i]) > threshold;
+        count += changed;
+        if (mask) {
+            mask[i] = changed ? a[i] : 0;
+        }
+    }
 
-    u32 total = 0;
-    u32 diff = 0;
+    return count;
+}
 
-    int max = a->n_pixels * a->channels;
-    for (int i = 0; i < max; i++) {
-        total++;
-        //if (abs(a->data[i] - b->data[i]) > 0) {
-            //debugf("diff: a: %d, b: %d", a->data[i], b->data[i]);
-        //}
-
-        if (abs(a->data[i] - b->data[i]) > threshold) {
-            c->data[i] = a->data[i];
-            diff += 100;
-        } else {
-            c->data[i] = 0;
+/*
+ * Fused motion count and selective background update.  bg is 8.8 fixed point,
+ * bg8 is the rounded 8 bit version for display.  Pixels of a within
+ * threshold of the background are blended in with a weight of 1/2^shift,
+ * changed pixels leave the background alone so a car crossing doesn't get
+ * mixed in.  Returns the changed count like diff_count.  columns, when not
+ * NULL, gets 1 added for each changed pixel.
+ *
+ * new = bg - bg/2^shift + a*256/2^shift can't overflow 16 bits and settles
+ * within 2^shift of a*256.
+ */
+static inline u8
+bg_round(u16 bg)
+{
+    return (bg + 128) >> 8;
+}
+
+int
+diff_update_bg_scalar(const u8 *a, u16 *bg, u8 *bg8, u8 *mask, u16 *columns, const int n, const int threshold,
+        const int shift)
+{
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        int changed = abs(a[i] - bg_round(bg[i])) > threshold;
+        count += changed;
+        if (mask) {
+            mask[i] = changed ? a[i] : 0;
+        }
+        if (columns) {
+            columns[i] += changed;
         }
+
+        if (!changed) {
+            bg[i] = bg[i] - (bg[i] >> shift) + (a[i] << (8 - shift));
+        }
+        bg8[i] = bg_round(bg[i]);
     }
 
-    return diff/total;
+    return count;
 }
 
 // https://en.wikipedia.org/wiki/Insertion_sort
@@ -338,8 +447,6 @@ median_channel(image *a, image *b, const int r, const int channel)
     assert(a->n_pixels == b->n_pixels);
     assert(a->channels == b->channels);
 
-    //u64 start = SDL_GetPerformanceCounter();
-
     //const int r = 1;
     const int n = (2*r + 1)*(2*r + 1);
     //const int pad = n/2;
@@ -366,10 +473,231 @@ median_channel(image *a, image *b, const int r, const int channel)
 
         b->data[i] = win[median];
     }
-    //debugf("median_channel: %ld", (SDL_GetPerformanceCounter() - start)/1000);
 }
 
-inline
+/*
+ * Constant time median filter for single channel images.  Per-pixel cost
+ * doesn't depend on r.  Use median_image() which picks a sorting network for
+ * the small radii.
+ *
+ * Perreault and Hebert, "Median Filtering in Constant Time", 2007.
+ * https://nomis80.org/ctmf.pdf
+ *
+ * Keeps a histogram for each column covering 2r+1 rows.  Moving down a row
+ * adds one pixel to and removes one pixel from each column.  Moving right the
+ * kernel histogram adds one column and removes one column.  The histograms
+ * are two level, 16 coarse bins for the high nibble and 256 fine bins.  The
+ * kernel's fine bins are only brought up to date for the coarse bin that
+ * contains the median.
+ *
+ * Pixels past the edge are the nearest edge pixel.
+ */
+
+#define MEDIAN_COARSE 16
+#define MEDIAN_FINE 256
+
+// one coarse histogram or one segment of a fine histogram.  gcc vector
+// extension so the adds are SIMD on any target
+typedef u16 hist16 __attribute__((vector_size(32)));
+
+struct median_state {
+    int width;
+    int height;
+    int r;
+
+    // per column, coarse[x] and fine[x*16 + segment]
+    hist16 *coarse;
+    hist16 *fine;
+
+    // kernel
+    hist16 kcoarse;
+    hist16 kfine[MEDIAN_COARSE];
+    // column the fine segment was last updated for
+    int last[MEDIAN_COARSE];
+};
+
+static inline int
+median_clamp_col(const struct median_state *m, int x)
+{
+    return clamp(x, 0, m->width - 1);
+}
+
+static inline void
+median_col_add(struct median_state *m, int x, u8 v, int n)
+{
+    m->coarse[x][v >> 4] += n;
+    m->fine[x*MEDIAN_COARSE + (v >> 4)][v & 0xf] += n;
+}
+
+static inline void
+median_col_sub(struct median_state *m, int x, u8 v)
+{
+    m->coarse[x][v >> 4]--;
+    m->fine[x*MEDIAN_COARSE + (v >> 4)][v & 0xf]--;
+}
+
+// recompute fine segment s of the kernel centered at column x
+static void
+median_fine_reset(struct median_state *m, int s, int x)
+{
+    hist16 kf = {};
+    for (int k = -m->r; k <= m->r; k++) {
+        kf += m->fine[median_clamp_col(m, x + k)*MEDIAN_COARSE + s];
+    }
+
+    m->kfine[s] = kf;
+    m->last[s] = x;
+}
+
+// bring fine segment s of the kernel up to date for column x
+static void
+median_fine_update(struct median_state *m, int s, int x)
+{
+    if (x - m->last[s] > 2*m->r + 1) {
+        median_fine_reset(m, s, x);
+        return;
+    }
+
+    hist16 kf = m->kfine[s];
+    for (int t = m->last[s] + 1; t <= x; t++) {
+        kf += m->fine[median_clamp_col(m, t + m->r)*MEDIAN_COARSE + s];
+        kf -= m->fine[median_clamp_col(m, t - m->r - 1)*MEDIAN_COARSE + s];
+    }
+
+    m->kfine[s] = kf;
+    m->last[s] = x;
+}
+
+// index of the first bin where the running total passes rank.  below is set to
+// the total of the bins before it.  Never returns more than 15.
+static inline int
+hist16_rank(const hist16 *h, int rank, int *below)
+{
+#ifdef __SSE2__
+    // prefix sum of each half with byte shifts, then carry the low half's
+    // total into the high half.  Counts fit in 15 bits so the signed compare
+    // works.  Avoids a scan loop that mispredicts about once per pixel.
+    __m128i lo = _mm_loadu_si128((const __m128i *)h);
+    __m128i hi = _mm_loadu_si128((const __m128i *)h + 1);
+
+    lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 2));
+    hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 2));
+    lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 4));
+    hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 4));
+    lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 8));
+    __m128i carry = _mm_shufflehi_epi16(lo, 0xff);
+    hi = _mm_add_epi16(hi, _mm_unpackhi_epi64(carry, carry));
+
+    const __m128i r = _mm_set1_epi16(rank);
+    u32 mask = (u32)_mm_movemask_epi8(_mm_cmpgt_epi16(lo, r))
+        | (u32)_mm_movemask_epi8(_mm_cmpgt_epi16(hi, r)) << 16;
+
+    // 2 mask bits per bin
+    int index = mask ? __builtin_ctz(mask)/2 : 15;
+    if (index > 15) index = 15;
+
+    u16 prefix[16];
+    _mm_storeu_si128((__m128i *)prefix, lo);
+    _mm_storeu_si128((__m128i *)prefix + 1, hi);
+    *below = index ? prefix[index - 1] : 0;
+
+    return index;
+#else
+    int sum = 0;
+    int index = 0;
+    for (; index < 15; index++) {
+        if (sum + (*h)[index] > rank) {
+            break;
+        }
+        sum += (*h)[index];
+    }
+
+    *below = sum;
+    return index;
+#endif
+}
+
+static u8
+median_find(struct median_state *m, int x, int rank)
+{
+    int below;
+    int s = hist16_rank(&m->kcoarse, rank, &below);
+
+    median_fine_update(m, s, x);
+
+    int i = hist16_rank(&m->kfine[s], rank - below, &below);
+
+    return s*16 + i;
+}
+
+void
+median_image_hist(const image *a, image *b, const int r)
+{
+    assert(a->channels == 1);
+    assert(a->channels == b->channels);
+    assert(a->width == b->width && a->height == b->height);
+    // hist16_rank compares the counts signed, r is at most 90
+    assert(r > 0 && (2*r + 1)*(2*r + 1) < 0x8000);
+
+    const int width = a->width;
+    const int height = a->height;
+    const int rank = (2*r + 1)*(2*r + 1)/2;
+
+    struct median_state m = {
+        .width = width,
+        .height = height,
+        .r = r
+    };
+    m.coarse = aligned_alloc(sizeof(hist16), width*sizeof(hist16));
+    m.fine = aligned_alloc(sizeof(hist16), width*MEDIAN_COARSE*sizeof(hist16));
+    memset(m.coarse, 0, width*sizeof(hist16));
+    memset(m.fine, 0, width*MEDIAN_COARSE*sizeof(hist16));
+
+    // columns for row 0, rows above the image are row 0
+    for (int x = 0; x < width; x++) {
+        median_col_add(&m, x, a->data[x], r + 1);
+        for (int y = 1; y <= r; y++) {
+            median_col_add(&m, x, a->data[clamp(y, 0, height - 1)*a->stride + x], 1);
+        }
+    }
+
+    for (int y = 0; y < height; y++) {
+        if (y > 0) {
+            const u8 *add = a->data + clamp(y + r, 0, height - 1)*a->stride;
+            const u8 *sub = a->data + clamp(y - r - 1, 0, height - 1)*a->stride;
+            for (int x = 0; x < width; x++) {
+                median_col_sub(&m, x, sub[x]);
+                median_col_add(&m, x, add[x], 1);
+            }
+        }
+
+        m.kcoarse = (hist16){};
+        for (int k = -r; k <= r; k++) {
+            m.kcoarse += m.coarse[median_clamp_col(&m, k)];
+        }
+
+        // force a reset of all the fine segments
+        for (int s = 0; s < MEDIAN_COARSE; s++) {
+            m.last[s] = -2*r - 2;
+        }
+
+        u8 *out = b->data + y*b->stride;
+        for (int x = 0; x < width; x++) {
+            if (x > 0) {
+                m.kcoarse += m.coarse[median_clamp_col(&m, x + r)];
+                m.kcoarse -= m.coarse[median_clamp_col(&m, x - r - 1)];
+            }
+
+            out[x] = median_find(&m, x, rank);
+        }
+    }
+
+    free(m.coarse);
+    free(m.fine);
+}
+
+static inline
 void set_pixel(image *img, int x, int y, const color *fg)
 {
     assert(x < img->width);
@@ -397,6 +725,7 @@ void fill_rect(image *img, int x, int y, int width, int height, const color *fg)
 
     int max_col = clamp(x + width, 0, img->width - 1);
     int max_row = clamp(y + height, 0, img->height - 1);
+    image_damage(img, x, y, max_col - x, max_row - y);
 
     for (int row = y; row < max_row; row++) {
         for (int col = x; col < max_col; col++) {
@@ -457,6 +786,7 @@ void draw_line_high(image *img, int x0, int y0, int x1, int y1, const color *fg)
 // https://en.wikipedia.org/wiki/Bresenham%27s_line_algorithm
 void draw_line(image *img, int x0, int y0, int x1, int y1, const color *fg)
 {
+    image_damage(img, x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1);
     if (abs(y1 - y0) < abs(x1 - x0)) {
         if (x0 > x1) {
             draw_line_low(img, x1, y1, x0, y0, fg);
@@ -492,6 +822,7 @@ void draw_square_center(image *img, int x, int y, int size, const color *fg)
 
     x = clamp(x, 0, img->width - 1);
     y = clamp(y, 0, img->height - 1);
+    image_damage(img, x, y, width, height);
 
     for (int row = 0; row < height; row++) {
         if (row == 0 || row == height - 1) {
@@ -508,6 +839,12 @@ void draw_square_center(image *img, int x, int y, int size, const color *fg)
     }
 }
 
+// height of a line of text plus padding
+int text_line_height(int size)
+{
+    return (12 + 4)*size;
+}
+
 /*
  * draw a line of text.  8x12 character max of 8 points times the size.
  * returns the height of the line plus padding where the next line should be
@@ -518,6 +855,8 @@ int draw_text(image *img, int x, int y, int size, const color *fg, const char *t
     const int max_points = 8;
     const int max_height = 12;
     int char_width = 10*size;
+    // once for the line, not each stroke
+    image_damage(img, x, y, strlen(text)*char_width, max_height*size + 1);
 
     const char *p = text;
     while (*p) {
@@ -560,7 +899,7 @@ int draw_text(image *img, int x, int y, int size, const color *fg, const char *t
         x += char_width;
     }
 
-    return (max_height + 4) * size;
+    return text_line_height(size);
 }
 
 /*
@@ -594,367 +933,6649 @@ int draw_int(image *img, int x, int y, int size, const color *fg, int n)
 // Integer operation of ITU-R standard for YCbCr(8 bits per channel) to RGB888
 // https://en.wikipedia.org/wiki/YUV#Converting_between_Y%E2%80%B2UV_and_RGB
 // The Y - 16 was necessary to make it look similar to yv12 texture
-void yuyv2rgba(const u8 *yuyv, u8 *rgba, const int n_pixels)
+//
+// converts 2 pixels, 4 bytes of YUYV to 8 bytes of BGRA
+static inline void
+yuyv2bgra_2(const u8 *yuyv, u8 *rgba)
 {
-    //u32 start_ms = SDL_GetTicks();
+    // YUYV: Y0 U0 Y1 V0  Y2 U1 Y3 V1
+    int Y0 = yuyv[0] - 16;
+    int U = yuyv[1] - 128;
+    int Y1 = yuyv[2] - 16;
+    int V = yuyv[3] - 128;
+
+    int vp = V + (V >> 2) + (V >> 3) + (V >> 5);
+    int uvp = -((U >> 2) + (U >> 4) + (U >> 5)) - ((V >> 1) + (V >> 3) + (V >> 4) + (V >> 5));
+    int up = U + (U >> 1) + (U >> 2) + (U >> 6);
+
+    // bgra
+    rgba[0] = clamp255(Y0 + up);
+    rgba[1] = clamp255(Y0 + uvp);
+    rgba[2] = clamp255(Y0 + vp);
+    rgba[3] = 255;
+
+    // bgra
+    rgba[4] = clamp255(Y1 + up);
+    rgba[5] = clamp255(Y1 + uvp);
+    rgba[6] = clamp255(Y1 + vp);
+    rgba[7] = 255;
+}
 
+// This is the reference implementation.  The SIMD versions below must produce
+// identical output, see test_yuyv2rgba()
+void yuyv2rgba_scalar(const u8 *yuyv, u8 *rgba, const int n_pixels)
+{
     int yuyv_max = n_pixels*2;
     int rgb_max = n_pixels*4;
 
     for (int i = 0, j = 0; i < yuyv_max && j < rgb_max; i += 4, j += 8) {
-        // YUYV: Y0 U0 Y1 V0  Y2 U1 Y3 V1
-        int Y0 = yuyv[i] - 16;
-        int U = yuyv[i + 1] - 128;
-        int Y1 = yuyv[i + 2] - 16;
-        int V = yuyv[i + 3] - 128;
-
-        int vp = V + (V >> 2) + (V >> 3) + (V >> 5);
-        int uvp = -((U >> 2) + (U >> 4) + (U >> 5)) - ((V >> 1) + (V >> 3) + (V >> 4) + (V >> 5));
-        int up = U + (U >> 1) + (U >> 2) + (U >> 6);
-
-        // bgra
-        rgba[j] = clamp255(Y0 + up);
-        rgba[j + 1] = clamp255(Y0 + uvp);
-        rgba[j + 2] = clamp255(Y0 + vp);
-        rgba[j + 3] = 255;
-
-        // bgra
-        rgba[j + 4] = clamp255(Y1 + up);
-        rgba[j + 5] = clamp255(Y1 + uvp);
-        rgba[j + 6] = clamp255(Y1 + vp);
-        rgba[j + 7] = 255;
+        yuyv2bgra_2(yuyv + i, rgba + j);
     }
-
-    //debugf("yuyv2rgba2: %d", SDL_GetTicks() - start_ms);
 }
 
-// copy only the luminance values
-void
-yuyv2y(const u8 *yuyv, u8 *out, const int n_pixels)
+// yuyv2y and yuyv2rgba in one pass
+void yuyv2y_rgba_scalar(const u8 *yuyv, u8 *y, u8 *rgba, const int n_pixels)
 {
-    const int yuyv_max = n_pixels*2;
-    for (int i = 0, j = 0; i < yuyv_max; i += 2, j++) {
-        out[j] = yuyv[i];
+    for (int i = 0; i < n_pixels; i += 2) {
+        y[i] = yuyv[i*2];
+        y[i + 1] = yuyv[i*2 + 2];
+        yuyv2bgra_2(yuyv + i*2, rgba + i*4);
     }
 }
 
-int print_display_info()
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD 1
+
+// The SIMD kernels are compiled with target attributes instead of -march so
+// one binary runs everywhere.  cpu_init() picks the best one at startup.
+//
+// All of the intermediate values fit in 16 bits (Y - 16 + up is at most
+// 239 + 226) so the arithmetic is done on 8 signed 16-bit lanes.
+// _mm_srai_epi16 matches gcc's >> on negative ints and packus does the clamp.
+
+// 16 bytes of YUYV (8 pixels) to 32 bytes of BGRA and optionally 8 bytes of
+// luma.  y is a constant NULL or not at every call site so the branch is
+// compiled out.
+__attribute__((target("sse2")))
+static inline void
+yuyv2bgra_8_sse2(const u8 *yuyv, u8 *y, u8 *rgba)
 {
-    int display_in_use = 0; /* Only using first display */
+    const __m128i mask_lo = _mm_set1_epi32(0x0000ffff);
+    const __m128i y_offset = _mm_set1_epi16(16);
+    const __m128i uv_offset = _mm_set1_epi16(128);
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
 
-    int i, display_mode_count;
-    SDL_DisplayMode mode;
-    Uint32 f;
+    __m128i in = _mm_loadu_si128((const __m128i *)yuyv);
 
-    SDL_Log("SDL_GetNumVideoDisplays(): %i", SDL_GetNumVideoDisplays());
+    // each 16-bit word is Y | C << 8
+    __m128i Yraw = _mm_and_si128(in, _mm_set1_epi16(0x00ff));
+    __m128i Y = _mm_sub_epi16(Yraw, y_offset);
+    __m128i C = _mm_srli_epi16(in, 8);
 
-    display_mode_count = SDL_GetNumDisplayModes(display_in_use);
-    if (display_mode_count < 1) {
-        SDL_Log("SDL_GetNumDisplayModes failed: %s", SDL_GetError());
-        return 1;
+    if (y) {
+        _mm_storel_epi64((__m128i *)y, _mm_packus_epi16(Yraw, Yraw));
     }
-    SDL_Log("SDL_GetNumDisplayModes: %i", display_mode_count);
 
-    for (i = 0; i < display_mode_count; ++i) {
-        if (SDL_GetDisplayMode(display_in_use, i, &mode) != 0) {
-            SDL_Log("SDL_GetDisplayMode failed: %s", SDL_GetError());
-            return 1;
-        }
-        f = mode.format;
+    // C as 32-bit lanes is U | V << 16, duplicate each into both halves so
+    // they line up with Y0 and Y1
+    __m128i U = _mm_and_si128(C, mask_lo);
+    U = _mm_or_si128(U, _mm_slli_epi32(U, 16));
+    __m128i V = _mm_srli_epi32(C, 16);
+    V = _mm_or_si128(V, _mm_slli_epi32(V, 16));
+    U = _mm_sub_epi16(U, uv_offset);
+    V = _mm_sub_epi16(V, uv_offset);
+
+    __m128i vp = _mm_add_epi16(_mm_add_epi16(V, _mm_srai_epi16(V, 2)),
+            _mm_add_epi16(_mm_srai_epi16(V, 3), _mm_srai_epi16(V, 5)));
+    __m128i uvp = _mm_sub_epi16(_mm_setzero_si128(),
+            _mm_add_epi16(_mm_add_epi16(_mm_srai_epi16(U, 2), _mm_srai_epi16(U, 4)), _mm_srai_epi16(U, 5)));
+    uvp = _mm_sub_epi16(uvp,
+            _mm_add_epi16(_mm_add_epi16(_mm_srai_epi16(V, 1), _mm_srai_epi16(V, 3)),
+                _mm_add_epi16(_mm_srai_epi16(V, 4), _mm_srai_epi16(V, 5))));
+    __m128i up = _mm_add_epi16(_mm_add_epi16(U, _mm_srai_epi16(U, 1)),
+            _mm_add_epi16(_mm_srai_epi16(U, 2), _mm_srai_epi16(U, 6)));
+
+    __m128i b = _mm_add_epi16(Y, up);
+    __m128i g = _mm_add_epi16(Y, uvp);
+    __m128i r = _mm_add_epi16(Y, vp);
+
+    __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+    __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), alpha);
+
+    _mm_storeu_si128((__m128i *)rgba, _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *)(rgba + 16), _mm_unpackhi_epi16(bg, ra));
+}
 
-        SDL_Log("Mode %i\tbpp %i\t%s\t%i x %i", i,
-                SDL_BITSPERPIXEL(f), SDL_GetPixelFormatName(f), mode.w, mode.h);
+__attribute__((target("sse2")))
+void yuyv2rgba_sse2(const u8 *yuyv, u8 *rgba, const int n_pixels)
+{
+    int i = 0;
+    for (; i + 8 <= n_pixels; i += 8) {
+        yuyv2bgra_8_sse2(yuyv + i*2, NULL, rgba + i*4);
     }
 
-    SDL_GetCurrentDisplayMode(display_in_use, &mode);
-    SDL_Log("Current Mode\tbpp %i\t%s\t%i x %i",
-            SDL_BITSPERPIXEL(f), SDL_GetPixelFormatName(f), mode.w, mode.h);
-
-    return 0;
+    yuyv2rgba_scalar(yuyv + i*2, rgba + i*4, n_pixels - i);
 }
 
-int
-get_refresh_rate(SDL_Window *window)
+__attribute__((target("sse2")))
+void yuyv2y_rgba_sse2(const u8 *yuyv, u8 *y, u8 *rgba, const int n_pixels)
 {
-    SDL_DisplayMode mode;
-    int index = SDL_GetWindowDisplayIndex(window);
-    // If we can't find the refresh rate, we'll return this:
-    int default_rate = 60;
-    if (SDL_GetDesktopDisplayMode(index, &mode) != 0) {
-        return default_rate;
-    }
-
-    if (mode.refresh_rate == 0) {
-        return default_rate;
+    int i = 0;
+    for (; i + 8 <= n_pixels; i += 8) {
+        yuyv2bgra_8_sse2(yuyv + i*2, y + i, rgba + i*4);
     }
 
-    return mode.refresh_rate;
+    yuyv2y_rgba_scalar(yuyv + i*2, y + i, rgba + i*4, n_pixels - i);
 }
 
-struct capture_data {
-    bool running;
-    int fd;
-    bool reset_race;
+// same as the sse2 version, but each 128-bit lane is 8 pixels so the
+// unpacked halves have to be put back in order with permute2x128
+__attribute__((target("avx2")))
+static inline void
+yuyv2bgra_16_avx2(const u8 *yuyv, u8 *y, u8 *rgba)
+{
+    const __m256i mask_lo = _mm256_set1_epi32(0x0000ffff);
+    const __m256i y_offset = _mm256_set1_epi16(16);
+    const __m256i uv_offset = _mm256_set1_epi16(128);
+    const __m256i alpha = _mm256_set1_epi8((char)0xff);
 
-    u32 width;
-    u32 height;
+    __m256i in = _mm256_loadu_si256((const __m256i *)yuyv);
 
-    // when v4l2 setup is in the thread this won't need to be here
-    struct buffer *buffers;
-    bool valid_image;
-    image *image1[2];
-    image *image2[2];
-    int rindex;
-    SDL_mutex *mutex;
+    __m256i Yraw = _mm256_and_si256(in, _mm256_set1_epi16(0x00ff));
+    __m256i Y = _mm256_sub_epi16(Yraw, y_offset);
+    __m256i C = _mm256_srli_epi16(in, 8);
 
-    u64 laps[4];
-    int n_laps;
-};
+    if (y) {
+        // per lane pack leaves Y0-7 in qword 0 and Y8-15 in qword 2
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(Yraw, Yraw), 0x08);
+        _mm_storeu_si128((__m128i *)y, _mm256_castsi256_si128(packed));
+    }
 
-int
-run_capture(void *data)
-{
-    struct capture_data *cd = data;
+    __m256i U = _mm256_and_si256(C, mask_lo);
+    U = _mm256_or_si256(U, _mm256_slli_epi32(U, 16));
+    __m256i V = _mm256_srli_epi32(C, 16);
+    V = _mm256_or_si256(V, _mm256_slli_epi32(V, 16));
+    U = _mm256_sub_epi16(U, uv_offset);
+    V = _mm256_sub_epi16(V, uv_offset);
+
+    __m256i vp = _mm256_add_epi16(_mm256_add_epi16(V, _mm256_srai_epi16(V, 2)),
+            _mm256_add_epi16(_mm256_srai_epi16(V, 3), _mm256_srai_epi16(V, 5)));
+    __m256i uvp = _mm256_sub_epi16(_mm256_setzero_si256(),
+            _mm256_add_epi16(_mm256_add_epi16(_mm256_srai_epi16(U, 2), _mm256_srai_epi16(U, 4)), _mm256_srai_epi16(U, 5)));
+    uvp = _mm256_sub_epi16(uvp,
+            _mm256_add_epi16(_mm256_add_epi16(_mm256_srai_epi16(V, 1), _mm256_srai_epi16(V, 3)),
+                _mm256_add_epi16(_mm256_srai_epi16(V, 4), _mm256_srai_epi16(V, 5))));
+    __m256i up = _mm256_add_epi16(_mm256_add_epi16(U, _mm256_srai_epi16(U, 1)),
+            _mm256_add_epi16(_mm256_srai_epi16(U, 2), _mm256_srai_epi16(U, 6)));
+
+    __m256i b = _mm256_add_epi16(Y, up);
+    __m256i g = _mm256_add_epi16(Y, uvp);
+    __m256i r = _mm256_add_epi16(Y, vp);
+
+    __m256i bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_packus_epi16(g, g));
+    __m256i ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), alpha);
+
+    __m256i lo = _mm256_unpacklo_epi16(bg, ra);
+    __m256i hi = _mm256_unpackhi_epi16(bg, ra);
+
+    _mm256_storeu_si256((__m256i *)rgba, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(rgba + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
 
-    struct v4l2_streamparm vparm = {};
-    vparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(cd->fd, VIDIOC_G_PARM, &vparm) == -1) {
-        debugf("VIDIOC_G_PARM: %s", strerror(errno));
+__attribute__((target("avx2")))
+void yuyv2rgba_avx2(const u8 *yuyv, u8 *rgba, const int n_pixels)
+{
+    int i = 0;
+    for (; i + 16 <= n_pixels; i += 16) {
+        yuyv2bgra_16_avx2(yuyv + i*2, NULL, rgba + i*4);
     }
 
-    if (vparm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
-        vparm.parm.capture.timeperframe.numerator = 1;
-        vparm.parm.capture.timeperframe.denominator = 20;
-        if (ioctl(cd->fd, VIDIOC_S_PARM, &vparm) == -1) {
-            debugf("VIDIOC_S_PARM: %s", strerror(errno));
-        }
+    yuyv2rgba_scalar(yuyv + i*2, rgba + i*4, n_pixels - i);
+}
 
-        if (ioctl(cd->fd, VIDIOC_G_PARM, &vparm) == -1) {
-            debugf("VIDIOC_G_PARM: %s", strerror(errno));
-        }
+__attribute__((target("avx2")))
+void yuyv2y_rgba_avx2(const u8 *yuyv, u8 *y, u8 *rgba, const int n_pixels)
+{
+    int i = 0;
+    for (; i + 16 <= n_pixels; i += 16) {
+        yuyv2bgra_16_avx2(yuyv + i*2, y + i, rgba + i*4);
     }
 
-    debugf("capture timeperframe: %u/%u", vparm.parm.capture.timeperframe.numerator, vparm.parm.capture.timeperframe.denominator);
+    yuyv2y_rgba_scalar(yuyv + i*2, y + i, rgba + i*4, n_pixels - i);
+}
 
-    enum v4l2_buf_type vtype;
-    vtype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(cd->fd, VIDIOC_STREAMON, &vtype) == -1) {
-        errno_exit("VIDIOC_STREAMON");
+// |a - b| > threshold is (|a - b| saturating minus threshold) != 0.  Changed
+// lanes are 0xff so the count is the sum of (cmp & 1), done with sad.
+__attribute__((target("sse2")))
+int diff_count_sse2(const u8 *a, const u8 *b, u8 *mask, const int n, const int threshold)
+{
+    const __m128i t = _mm_set1_epi8((char)clamp255(threshold));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i sum = zero;
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        // 0xff where not changed
+        __m128i same = _mm_cmpeq_epi8(_mm_subs_epu8(d, t), zero);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_andnot_si128(same, one), zero));
+        if (mask) {
+            _mm_storeu_si128((__m128i *)(mask + i), _mm_andnot_si128(same, va));
+        }
     }
 
-    struct v4l2_buffer vbuf;
-    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vbuf.memory = V4L2_MEMORY_MMAP;
+    int count = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
 
-    // TODO(jason): maybe read these from cam fd with VIDIOC_G_FMT
-    // probably should be setting camera settings
-    u32 cam_width = cd->width;
-    u32 cam_height = cd->height;
+    return count + diff_count_scalar(a + i, b + i, mask ? mask + i : NULL, n - i, threshold);
+}
 
-    const int n_laps = 3;
-    //const u64 min_lap_count = 2*SDL_GetPerformanceFrequency();
-    const double min_lap_time = 2.0;
-    double lap_times[n_laps];
-    u64 race_start = 0;
-    u64 lap_start = 0;
-    int fastest_lap = 0;
-    int lap = 0;
-    bool race_logged = false;
+__attribute__((target("avx2")))
+int diff_count_avx2(const u8 *a, const u8 *b, u8 *mask, const int n, const int threshold)
+{
+    const __m256i t = _mm256_set1_epi8((char)clamp255(threshold));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i sum = zero;
+
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i same = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, t), zero);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_andnot_si256(same, one), zero));
+        if (mask) {
+            _mm256_storeu_si256((__m256i *)(mask + i), _mm256_andnot_si256(same, va));
+        }
+    }
 
-    cd->image1[0] = new_yv12_image(cd->width, cd->height);
-    cd->image1[1] = new_yv12_image(cd->width, cd->height);
-    cd->image2[0] = new_image(cd->width, cd->height, 4);
-    cd->image2[1] = new_image(cd->width, cd->height, 4);
-    cd->rindex = 0;
+    __m128i sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    int count = _mm_cvtsi128_si32(sum128) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum128, sum128));
 
-    image *finish_line = new_image(64, 256, 1);
-    image *bg_finish_line = new_image_like(finish_line);
-    image *tmp_finish_line = new_image_like(finish_line);
-    int finish_line_x = cam_width/2 - finish_line->width/2;
-    int finish_line_y = cam_height - finish_line->height - 32;
-    bool finish_line_active = false;
-    // if the background has been mixed enough and the finish line should be
-    // checked
-    bool finish_line_valid = false;
-    int motion_threshold = 8;
+    return count + diff_count_scalar(a + i, b + i, mask ? mask + i : NULL, n - i, threshold);
+}
 
-    cd->running = true;
+// same as diff_count_sse2 for the count, then a blend of the unchanged pixels
+// on 16 bit lanes
+__attribute__((target("sse2")))
+int diff_update_bg_sse2(const u8 *a, u16 *bg, u8 *bg8, u8 *mask, u16 *columns, const int n, const int threshold,
+        const int shift)
+{
+    const __m128i t = _mm_set1_epi8((char)clamp255(threshold));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    const __m128i as = _mm_cvtsi32_si128(8 - shift);
+    __m128i sum = zero;
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(bg + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(bg + i + 8));
+        __m128i vb = _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(b0, round), 8),
+                _mm_srli_epi16(_mm_add_epi16(b1, round), 8));
+
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i same = _mm_cmpeq_epi8(_mm_subs_epu8(d, t), zero);
+        __m128i changed = _mm_andnot_si128(same, one);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(changed, zero));
+        if (mask) {
+            _mm_storeu_si128((__m128i *)(mask + i), _mm_andnot_si128(same, va));
+        }
+        if (columns) {
+            __m128i c0 = _mm_loadu_si128((const __m128i *)(columns + i));
+            __m128i c1 = _mm_loadu_si128((const __m128i *)(columns + i + 8));
+            _mm_storeu_si128((__m128i *)(columns + i), _mm_add_epi16(c0, _mm_unpacklo_epi8(changed, zero)));
+            _mm_storeu_si128((__m128i *)(columns + i + 8), _mm_add_epi16(c1, _mm_unpackhi_epi8(changed, zero)));
+        }
 
-    const int require_bg_frames = 60;
-    const int n_usable_frames  = require_bg_frames - require_bg_frames/3;
-    int need_bg_frames = require_bg_frames;
+        __m128i u0 = _mm_add_epi16(_mm_sub_epi16(b0, _mm_srl_epi16(b0, s)),
+                _mm_sll_epi16(_mm_unpacklo_epi8(va, zero), as));
+        __m128i u1 = _mm_add_epi16(_mm_sub_epi16(b1, _mm_srl_epi16(b1, s)),
+                _mm_sll_epi16(_mm_unpackhi_epi8(va, zero), as));
+        __m128i same0 = _mm_unpacklo_epi8(same, same);
+        __m128i same1 = _mm_unpackhi_epi8(same, same);
+        b0 = _mm_or_si128(_mm_and_si128(same0, u0), _mm_andnot_si128(same0, b0));
+        b1 = _mm_or_si128(_mm_and_si128(same1, u1), _mm_andnot_si128(same1, b1));
+
+        _mm_storeu_si128((__m128i *)(bg + i), b0);
+        _mm_storeu_si128((__m128i *)(bg + i + 8), b1);
+        _mm_storeu_si128((__m128i *)(bg8 + i), _mm_packus_epi16(_mm_srli_epi16(_mm_add_epi16(b0, round), 8),
+                    _mm_srli_epi16(_mm_add_epi16(b1, round), 8)));
+    }
 
-    u64 last_bg_mix = 0;
-    u64 bg_mix_count = 60 * SDL_GetPerformanceFrequency();
+    int count = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
 
-    while (cd->running) {
-        //s64 start = SDL_GetPerformanceCounter();
-        //debugf("got frame: %d, elapsed: %ld", vbuf.index, (start - last_frame_count)/1000);
-        //last_frame_count = start;
+    return count + diff_update_bg_scalar(a + i, bg + i, bg8 + i, mask ? mask + i : NULL,
+            columns ? columns + i : NULL, n - i, threshold, shift);
+}
 
-        if (cd->reset_race) {
-            lap = 0;
-            race_logged = false;
-            race_start = 0;
-            lap_start = 0;
-            fastest_lap = 0;
-            cd->reset_race = false;
-            //need_bg_frames = require_bg_frames;
+// 32 pixels at a time.  The 16 bit halves are unpacked per 128-bit lane and
+// packus puts them back the same way so no permutes are needed.
+__attribute__((target("avx2")))
+int diff_update_bg_avx2(const u8 *a, u16 *bg, u8 *bg8, u8 *mask, u16 *columns, const int n, const int threshold,
+        const int shift)
+{
+    const __m256i t = _mm256_set1_epi8((char)clamp255(threshold));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i round = _mm256_set1_epi16(128);
+    const __m128i s = _mm_cvtsi32_si128(shift);
+    const __m128i as = _mm_cvtsi32_si128(8 - shift);
+    __m256i sum = zero;
+
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        // bg in the same order unpack uses: lane 0 is pixels 0-7 and 16-23
+        __m256i l0 = _mm256_loadu_si256((const __m256i *)(bg + i));
+        __m256i l1 = _mm256_loadu_si256((const __m256i *)(bg + i + 16));
+        __m256i b0 = _mm256_permute2x128_si256(l0, l1, 0x20);
+        __m256i b1 = _mm256_permute2x128_si256(l0, l1, 0x31);
+        __m256i vb = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_add_epi16(b0, round), 8),
+                _mm256_srli_epi16(_mm256_add_epi16(b1, round), 8));
+
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+        __m256i same = _mm256_cmpeq_epi8(_mm256_subs_epu8(d, t), zero);
+        __m256i changed = _mm256_andnot_si256(same, one);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(changed, zero));
+        if (mask) {
+            _mm256_storeu_si256((__m256i *)(mask + i), _mm256_andnot_si256(same, va));
         }
-
-        if (ioctl(cd->fd, VIDIOC_DQBUF, &vbuf) == -1) {
-            // TODO(jason): just close fd and get EBADF force exit?
-            debugf("thread no camera image %d: %s", errno, strerror(errno));
-            break;
+        if (columns) {
+            // same lane order as bg
+            __m256i k0 = _mm256_loadu_si256((const __m256i *)(columns + i));
+            __m256i k1 = _mm256_loadu_si256((const __m256i *)(columns + i + 16));
+            __m256i c0 = _mm256_add_epi16(_mm256_permute2x128_si256(k0, k1, 0x20), _mm256_unpacklo_epi8(changed, zero));
+            __m256i c1 = _mm256_add_epi16(_mm256_permute2x128_si256(k0, k1, 0x31), _mm256_unpackhi_epi8(changed, zero));
+            _mm256_storeu_si256((__m256i *)(columns + i), _mm256_permute2x128_si256(c0, c1, 0x20));
+            _mm256_storeu_si256((__m256i *)(columns + i + 16), _mm256_permute2x128_si256(c0, c1, 0x31));
         }
-        //debugf("VIDIOC_DQBUF: %ld", (SDL_GetPerformanceCounter() - start)/1000);
 
-        image *write1_image = cd->image1[!cd->rindex];
-        image *write2_image = cd->image2[!cd->rindex];
+        __m256i u0 = _mm256_add_epi16(_mm256_sub_epi16(b0, _mm256_srl_epi16(b0, s)),
+                _mm256_sll_epi16(_mm256_unpacklo_epi8(va, zero), as));
+        __m256i u1 = _mm256_add_epi16(_mm256_sub_epi16(b1, _mm256_srl_epi16(b1, s)),
+                _mm256_sll_epi16(_mm256_unpackhi_epi8(va, zero), as));
+        __m256i same0 = _mm256_unpacklo_epi8(same, same);
+        __m256i same1 = _mm256_unpackhi_epi8(same, same);
+        b0 = _mm256_blendv_epi8(b0, u0, same0);
+        b1 = _mm256_blendv_epi8(b1, u1, same1);
+
+        _mm256_storeu_si256((__m256i *)(bg + i), _mm256_permute2x128_si256(b0, b1, 0x20));
+        _mm256_storeu_si256((__m256i *)(bg + i + 16), _mm256_permute2x128_si256(b0, b1, 0x31));
+        _mm256_storeu_si256((__m256i *)(bg8 + i), _mm256_packus_epi16(_mm256_srli_epi16(_mm256_add_epi16(b0, round), 8),
+                    _mm256_srli_epi16(_mm256_add_epi16(b1, round), 8)));
+    }
 
-        yuyv2y(cd->buffers[vbuf.index].start, write1_image->data, write1_image->n_pixels);
-        yuyv2rgba(cd->buffers[vbuf.index].start, write2_image->data, write2_image->n_pixels);
-        if (ioctl(cd->fd, VIDIOC_QBUF, &vbuf) == -1) {
-            debugf("VIDIOC_QBUF: %s", strerror(errno));
-        }
+    __m128i sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    int count = _mm_cvtsi128_si32(sum128) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum128, sum128));
 
+    return count + diff_update_bg_scalar(a + i, bg + i, bg8 + i, mask ? mask + i : NULL,
+            columns ? columns + i : NULL, n - i, threshold, shift);
+}
 
-        copy_rect_image(finish_line->width, finish_line->height, write1_image, finish_line_x, finish_line_y, tmp_finish_line, 0, 0);
-        median_channel(tmp_finish_line, finish_line, 2, 0);
-        //copy_image(tmp_finish_line, finish_line);
+/*
+ * Median filter rows with the selection networks in median_net.h.  Each
+ * window position is a vector so lanes adjacent output pixels are filtered
+ * at once.  rows are the 2r+1 input rows, already padded with r edge pixels
+ * on each side.  width must be at least lanes, the last block overlaps the
+ * one before it.
+ */
+#define MEDIAN_NET_KERNEL(name, isa, r, net, vec, load, store, lanes, CX, MN, MX) \
+__attribute__((target(isa))) \
+void name(const u8 * const *rows, u8 *out, const int width) \
+{ \
+    const int d = 2*r + 1; \
+    for (int x = 0; x < width; x += lanes) { \
+        if (x + lanes > width) { \
+            x = width - lanes; \
+        } \
+        vec v[d*d]; \
+        for (int i = 0; i < d; i++) { \
+            for (int j = 0; j < d; j++) { \
+                v[i*d + j] = load((const void *)(rows[i] + x + j)); \
+            } \
+        } \
+        net(CX, MN, MX) \
+        store((void *)(out + x), v[d*d/2]); \
+    } \
+}
 
-        u64 now = SDL_GetPerformanceCounter();
+#define CX_SSE2(a, b) { __m128i t = _mm_min_epu8(v[a], v[b]); v[b] = _mm_max_epu8(v[a], v[b]); v[a] = t; }
+#define MN_SSE2(a, b) v[a] = _mm_min_epu8(v[a], v[b]);
+#define MX_SSE2(a, b) v[b] = _mm_max_epu8(v[a], v[b]);
+
+#define CX_AVX2(a, b) { __m256i t = _mm256_min_epu8(v[a], v[b]); v[b] = _mm256_max_epu8(v[a], v[b]); v[a] = t; }
+#define MN_AVX2(a, b) v[a] = _mm256_min_epu8(v[a], v[b]);
+#define MX_AVX2(a, b) v[b] = _mm256_max_epu8(v[a], v[b]);
+
+MEDIAN_NET_KERNEL(median_net_r1_sse2, "sse2", 1, MEDIAN_NET_9, __m128i, _mm_loadu_si128, _mm_storeu_si128, 16, CX_SSE2, MN_SSE2, MX_SSE2)
+MEDIAN_NET_KERNEL(median_net_r2_sse2, "sse2", 2, MEDIAN_NET_25, __m128i, _mm_loadu_si128, _mm_storeu_si128, 16, CX_SSE2, MN_SSE2, MX_SSE2)
+MEDIAN_NET_KERNEL(median_net_r3_sse2, "sse2", 3, MEDIAN_NET_49, __m128i, _mm_loadu_si128, _mm_storeu_si128, 16, CX_SSE2, MN_SSE2, MX_SSE2)
+
+MEDIAN_NET_KERNEL(median_net_r1_avx2, "avx2", 1, MEDIAN_NET_9, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, 32, CX_AVX2, MN_AVX2, MX_AVX2)
+MEDIAN_NET_KERNEL(median_net_r2_avx2, "avx2", 2, MEDIAN_NET_25, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, 32, CX_AVX2, MN_AVX2, MX_AVX2)
+MEDIAN_NET_KERNEL(median_net_r3_avx2, "avx2", 3, MEDIAN_NET_49, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, 32, CX_AVX2, MN_AVX2, MX_AVX2)
+#endif
+
+typedef void (*yuyv2rgba_func)(const u8 *yuyv, u8 *rgba, const int n_pixels);
+typedef void (*yuyv2y_rgba_func)(const u8 *yuyv, u8 *y, u8 *rgba, const int n_pixels);
+typedef void (*median_net_func)(const u8 * const *rows, u8 *out, const int width);
+typedef int (*diff_count_func)(const u8 *a, const u8 *b, u8 *mask, const int n, const int threshold);
+typedef int (*diff_update_bg_func)(const u8 *a, u16 *bg, u8 *bg8, u8 *mask, u16 *columns, const int n,
+        const int threshold, const int shift);
+
+#define MEDIAN_NET_MAX_R 3
+
+struct kernel {
+    const char *name;
+    yuyv2rgba_func yuyv2rgba;
+    yuyv2y_rgba_func yuyv2y_rgba;
+    // indexed by radius, NULL uses median_image_hist
+    median_net_func median_net[MEDIAN_NET_MAX_R + 1];
+    // pixels per median_net vector
+    int lanes;
+    diff_count_func diff_count;
+    diff_update_bg_func diff_update_bg;
+};
 
-        if (now - last_bg_mix > bg_mix_count) {
-            need_bg_frames++;
-            debugf("need more bg mix (%d)", need_bg_frames);
-        }
+// ordered from best to worst.  The last one always works.
+const struct kernel kernels[] = {
+#ifdef HAVE_X86_SIMD
+    { "avx2", yuyv2rgba_avx2, yuyv2y_rgba_avx2,
+        { NULL, median_net_r1_avx2, median_net_r2_avx2, median_net_r3_avx2 }, 32,
+        diff_count_avx2, diff_update_bg_avx2 },
+    { "sse2", yuyv2rgba_sse2, yuyv2y_rgba_sse2,
+        { NULL, median_net_r1_sse2, median_net_r2_sse2, median_net_r3_sse2 }, 16,
+        diff_count_sse2, diff_update_bg_sse2 },
+#endif
+    { "scalar", yuyv2rgba_scalar, yuyv2y_rgba_scalar, { NULL }, 1,
+        diff_count_scalar, diff_update_bg_scalar }
+};
+
+const int n_kernels = sizeof(kernels)/sizeof(kernels[0]);
+
+const struct kernel *kernel = &kernels[0];
+
+bool
+cpu_supports(const char *name)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    } else if (strcmp(name, "sse2") == 0) {
+        return __builtin_cpu_supports("sse2");
+    }
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+// select the best kernels for the cpu.  name can force a specific one, NULL
+// for auto.
+void
+cpu_init(const char *name)
+{
+    kernel = &kernels[n_kernels - 1];
+
+    for (int i = n_kernels - 1; i >= 0; i--) {
+        if (!cpu_supports(kernels[i].name)) {
+            continue;
+        }
+
+        if (!name || strcmp(name, kernels[i].name) == 0) {
+            kernel = &kernels[i];
+        }
+    }
+
+    if (name && strcmp(name, kernel->name) != 0) {
+        SDL_Log("kernel %s not supported, using %s", name, kernel->name);
+    }
+
+    debugf("kernel: %s", kernel->name);
+}
+
+void yuyv2rgba(const u8 *yuyv, u8 *rgba, const int n_pixels)
+{
+    kernel->yuyv2rgba(yuyv, rgba, n_pixels);
+}
+
+/*
+ * Count of pixels in a that differ from b by more than threshold.  mask can be
+ * NULL, otherwise it gets the changed pixels from a and 0 elsewhere.  Only ask
+ * for the mask when it's going to be shown, it's a store per pixel.
+ */
+int
+diff_images(const image *a, const image *b, image *mask, int threshold)
+{
+    assert(a->n_pixels == b->n_pixels);
+    assert(a->channels == b->channels);
+    assert(a->channels == 1);
+    assert(!mask || mask->n_pixels == a->n_pixels);
+    assert(threshold >= 0);
+
+    return kernel->diff_count(a->data, b->data, mask ? mask->data : NULL, a->n_pixels, threshold);
+}
+
+/*
+ * Background kept in 8.8 fixed point so small differences still move it.
+ * image is the rounded 8 bit version for diff_images and display.
+ */
+typedef struct {
+    u16 *fixed;
+    image *image;
+} background;
+
+background *
+new_background(int width, int height)
+{
+    background *bg = malloc(sizeof(*bg));
+    bg->image = new_image(width, height, 1);
+    bg->fixed = calloc(bg->image->n_pixels, sizeof(bg->fixed[0]));
+
+    return bg;
+}
+
+void
+free_background(background *bg)
+{
+    if (bg) {
+        free(bg->fixed);
+        free_image(bg->image);
+        free(bg);
+    }
+}
+
+void
+reset_background(background *bg, const image *a)
+{
+    assert(a->n_pixels == bg->image->n_pixels);
+
+    for (int i = 0; i < a->n_pixels; i++) {
+        bg->fixed[i] = a->data[i] << 8;
+    }
+    copy_image((image *)a, bg->image);
+}
+
+/*
+ * Count the pixels in a that changed by more than threshold from the
+ * background and blend the rest into the background with weight 1/2^shift,
+ * in one pass.  threshold 255 blends everything.  mask is optional like
+ * diff_images.  With columns and rows it's done a row at a time and they get
+ * the changed count of each column and row.
+ */
+int
+diff_update_background(const image *a, background *bg, image *mask, u16 *columns, u16 *rows,
+        int threshold, int shift)
+{
+    assert(a->n_pixels == bg->image->n_pixels);
+    assert(a->channels == 1);
+    assert(!mask || mask->n_pixels == a->n_pixels);
+    assert(!columns == !rows);
+    assert(threshold >= 0);
+    assert(shift >= 1 && shift <= 8);
+
+    if (!columns) {
+        return kernel->diff_update_bg(a->data, bg->fixed, bg->image->data,
+                mask ? mask->data : NULL, NULL, a->n_pixels, threshold, shift);
+    }
+
+    memset(columns, 0, a->width*sizeof(columns[0]));
+    int count = 0;
+    for (int y = 0; y < a->height; y++) {
+        const int i = y*a->width;
+        rows[y] = kernel->diff_update_bg(a->data + i, bg->fixed + i, bg->image->data + i,
+                mask ? mask->data + i : NULL, columns, a->width, threshold, shift);
+        count += rows[y];
+    }
+
+    return count;
+}
+
+// integer percent of changed pixels, c gets the mask
+int
+percent_diff_images(const image *a, const image *b, image *c, int threshold)
+{
+    return diff_images(a, b, c, threshold)*100/a->n_pixels;
+}
+
+/*
+ * Median filter a single channel image.  Radius 1-3 use the sorting network
+ * kernels if the cpu has them, otherwise the constant time histogram filter.
+ * Edges replicate the nearest pixel either way.
+ */
+void
+median_image(const image *a, image *b, const int r)
+{
+    assert(a->channels == 1);
+    assert(a->channels == b->channels);
+    assert(a->width == b->width && a->height == b->height);
+
+    median_net_func net = r <= MEDIAN_NET_MAX_R ? kernel->median_net[r] : NULL;
+    if (!net || a->width < kernel->lanes) {
+        median_image_hist(a, b, r);
+        return;
+    }
+
+    // copy with r edge pixels on the left and right so the kernel doesn't
+    // need to check for the edges.  Rows past the top and bottom are handled
+    // with the row pointers.
+    const int pstride = a->width + 2*r;
+    u8 *padded = malloc(pstride*a->height);
+    for (int y = 0; y < a->height; y++) {
+        const u8 *src = a->data + y*a->stride;
+        u8 *dst = padded + y*pstride;
+        memset(dst, src[0], r);
+        memcpy(dst + r, src, a->width);
+        memset(dst + r + a->width, src[a->width - 1], r);
+    }
+
+    const u8 *rows[2*MEDIAN_NET_MAX_R + 1];
+    for (int y = 0; y < a->height; y++) {
+        for (int k = 0; k < 2*r + 1; k++) {
+            rows[k] = padded + clamp(y + k - r, 0, a->height - 1)*pstride;
+        }
+
+        net(rows, b->data + y*b->stride, a->width);
+    }
+
+    free(padded);
+}
+
+// copy only the luminance values
+void
+yuyv2y(const u8 *yuyv, u8 *out, const int n_pixels)
+{
+    const int yuyv_max = n_pixels*2;
+    for (int i = 0, j = 0; i < yuyv_max; i += 2, j++) {
+        out[j] = yuyv[i];
+    }
+}
+
+// luminance values with neutral chroma
+void
+y2yuyv(const u8 *y, u8 *yuyv, const int n_pixels)
+{
+    for (int i = 0; i < n_pixels; i++) {
+        yuyv[i*2] = y[i];
+        yuyv[i*2 + 1] = 0x80;
+    }
+}
+
+/*
+ * Split a YUYV frame into a copy of the raw frame, the luma plane, the BGRA
+ * image and a luma crop (roi) at roi_x, roi_y in a single pass.  Each row of
+ * the camera buffer is read once and the roi rows are copied from the luma
+ * row while it's still in cache.  copy and rgba are optional, NULL to skip
+ * them.  copy, y and rgba must be the same size as the frame, whose rows
+ * are yuyv_stride bytes apart.
+ */
+void
+yuyv_demux(const u8 *yuyv, int yuyv_stride, image *copy, image *y, image *rgba, image *roi, int roi_x, int roi_y)
+{
+    assert(y->channels == 1);
+    assert(!copy || (copy->channels == 2 && y->n_pixels == copy->n_pixels));
+    assert(!rgba || (rgba->channels == 4 && y->n_pixels == rgba->n_pixels));
+    assert(roi->channels == 1);
+    assert(yuyv_stride >= y->width*2);
+    assert(roi_x >= 0 && roi_x + roi->width <= y->width);
+    assert(roi_y >= 0 && roi_y + roi->height <= y->height);
+
+    const int width = y->width;
+    yuyv2y_rgba_func convert = kernel->yuyv2y_rgba;
+
+    for (int row = 0; row < y->height; row++) {
+        const u8 *yuyv_row = yuyv + row*yuyv_stride;
+        u8 *yrow = y->data + row*y->stride;
+        if (copy) {
+            memcpy(copy->data + row*copy->stride, yuyv_row, width*2);
+        }
+        if (rgba) {
+            convert(yuyv_row, yrow, rgba->data + row*rgba->stride, width);
+        } else {
+            yuyv2y(yuyv_row, yrow, width);
+        }
+
+        int roi_row = row - roi_y;
+        if (roi_row >= 0 && roi_row < roi->height) {
+            memcpy(roi->data + roi_row*roi->stride, yrow + roi_x, roi->width);
+        }
+    }
+}
+
+// compare every kernel the cpu supports against the scalar reference on random
+// input.  odd sizes exercise the scalar tail of the SIMD loops.
+int
+test_yuyv2rgba()
+{
+    const int sizes[] = { 2, 6, 14, 16, 18, 30, 34, 640*480 };
+    const int n_sizes = sizeof(sizes)/sizeof(sizes[0]);
+    const int max_pixels = 640*480;
+
+    u8 *yuyv = malloc(max_pixels*2);
+    u8 *expected = malloc(max_pixels*4);
+    u8 *actual = malloc(max_pixels*4);
+    u8 *expected_y = malloc(max_pixels);
+    u8 *actual_y = malloc(max_pixels);
+
+    srand(1);
+    for (int i = 0; i < max_pixels*2; i++) {
+        yuyv[i] = rand() & 0xff;
+    }
+
+    int failed = 0;
+    for (int k = 0; k < n_kernels; k++) {
+        if (!cpu_supports(kernels[k].name)) {
+            printf("yuyv2rgba %s: not supported, skipping\n", kernels[k].name);
+            continue;
+        }
+
+        int kernel_failed = 0;
+        for (int s = 0; s < n_sizes; s++) {
+            int n = sizes[s];
+            memset(expected, 0, n*4);
+            memset(actual, 0xaa, n*4);
+
+            yuyv2rgba_scalar(yuyv, expected, n);
+            kernels[k].yuyv2rgba(yuyv, actual, n);
+
+            if (memcmp(expected, actual, n*4) != 0) {
+                printf("yuyv2rgba %s: FAILED n_pixels: %d\n", kernels[k].name, n);
+                kernel_failed++;
+            }
+
+            memset(actual, 0xaa, n*4);
+            memset(actual_y, 0xaa, n);
+            yuyv2y(yuyv, expected_y, n);
+            kernels[k].yuyv2y_rgba(yuyv, actual_y, actual, n);
+
+            if (memcmp(expected, actual, n*4) != 0 || memcmp(expected_y, actual_y, n) != 0) {
+                printf("yuyv2y_rgba %s: FAILED n_pixels: %d\n", kernels[k].name, n);
+                kernel_failed++;
+            }
+        }
+
+        printf("yuyv2rgba %s: %s\n", kernels[k].name, kernel_failed ? "FAILED" : "ok");
+        failed += kernel_failed;
+    }
+
+    free(yuyv);
+    free(expected);
+    free(actual);
+    free(expected_y);
+    free(actual_y);
+
+    return failed;
+}
+
+// yuyv_demux should match the separate yuyv2y, yuyv2rgba and copy_rect_image
+int
+test_yuyv_demux()
+{
+    const int width = 640;
+    const int height = 480;
+    const int roi_x = width/2 - 32;
+    const int roi_y = height - 256 - 32;
+
+    u8 *yuyv = malloc(width*height*2);
+    for (int i = 0; i < width*height*2; i++) {
+        yuyv[i] = rand() & 0xff;
+    }
+
+    image *y1 = new_image(width, height, 1);
+    image *y2 = new_image_like(y1);
+    image *copy = new_image(width, height, 2);
+    image *rgba1 = new_image(width, height, 4);
+    image *rgba2 = new_image_like(rgba1);
+    image *roi1 = new_image(64, 256, 1);
+    image *roi2 = new_image_like(roi1);
+
+    yuyv2y(yuyv, y1->data, y1->n_pixels);
+    yuyv2rgba_scalar(yuyv, rgba1->data, rgba1->n_pixels);
+    copy_rect_image(roi1->width, roi1->height, y1, roi_x, roi_y, roi1, 0, 0);
+
+    yuyv_demux(yuyv, width*2, copy, y2, rgba2, roi2, roi_x, roi_y);
+
+    int failed = memcmp(y1->data, y2->data, y1->n_pixels) != 0
+        || memcmp(rgba1->data, rgba2->data, rgba1->n_pixels*4) != 0
+        || memcmp(roi1->data, roi2->data, roi1->n_pixels) != 0
+        || memcmp(yuyv, copy->data, width*height*2) != 0;
+
+    // without the color conversion
+    memset(y2->data, 0, y2->n_pixels);
+    memset(roi2->data, 0, roi2->n_pixels);
+    yuyv_demux(yuyv, width*2, NULL, y2, NULL, roi2, roi_x, roi_y);
+    failed += memcmp(y1->data, y2->data, y1->n_pixels) != 0
+        || memcmp(roi1->data, roi2->data, roi1->n_pixels) != 0;
+
+    // rows padded by the driver
+    const int padded_stride = width*2 + 64;
+    u8 *padded = malloc(padded_stride*height);
+    memset(padded, 0xee, padded_stride*height);
+    for (int row = 0; row < height; row++) {
+        memcpy(padded + row*padded_stride, yuyv + row*width*2, width*2);
+    }
+    memset(y2->data, 0, y2->n_pixels);
+    memset(copy->data, 0, copy->n_pixels*2);
+    yuyv_demux(padded, padded_stride, copy, y2, NULL, roi2, roi_x, roi_y);
+    failed += memcmp(y1->data, y2->data, y1->n_pixels) != 0
+        || memcmp(yuyv, copy->data, width*height*2) != 0;
+    free(padded);
+
+    printf("yuyv_demux %s: %s\n", kernel->name, failed ? "FAILED" : "ok");
+
+    free(yuyv);
+    free_image(y1);
+    free_image(y2);
+    free_image(copy);
+    free_image(rgba1);
+    free_image(rgba2);
+    free_image(roi1);
+    free_image(roi2);
+
+    return failed;
+}
+
+int
+test_diff_count()
+{
+    const int n = 64*256 + 13;
+    const int thresholds[] = { 0, 1, 8, 128, 254, 255 };
+
+    u8 *a = malloc(n);
+    u8 *b = malloc(n);
+    u8 *expected = malloc(n);
+    u8 *actual = malloc(n);
+
+    for (int i = 0; i < n; i++) {
+        a[i] = rand() & 0xff;
+        // mostly close to a
+        b[i] = (rand() % 4 == 0) ? rand() & 0xff : clamp255(a[i] + (rand() % 17) - 8);
+    }
+
+    int failed = 0;
+    for (int k = 0; k < n_kernels; k++) {
+        if (!cpu_supports(kernels[k].name)) {
+            continue;
+        }
+
+        int kernel_failed = 0;
+        for (int t = 0; t < (int)(sizeof(thresholds)/sizeof(thresholds[0])); t++) {
+            int e = diff_count_scalar(a, b, expected, n, thresholds[t]);
+            memset(actual, 0xaa, n);
+            int c = kernels[k].diff_count(a, b, actual, n, thresholds[t]);
+            int c_nomask = kernels[k].diff_count(a, b, NULL, n, thresholds[t]);
+
+            if (e != c || e != c_nomask || memcmp(expected, actual, n) != 0) {
+                printf("diff_count %s: FAILED threshold: %d, %d != %d\n", kernels[k].name, thresholds[t], e, c);
+                kernel_failed++;
+            }
+        }
+
+        printf("diff_count %s: %s\n", kernels[k].name, kernel_failed ? "FAILED" : "ok");
+        failed += kernel_failed;
+    }
+
+    free(a);
+    free(b);
+    free(expected);
+    free(actual);
+
+    return failed;
+}
+
+int
+test_diff_update_bg()
+{
+    const int n = 64*256 + 29;
+
+    u8 *a = malloc(n);
+    u16 *bg_expected = malloc(n*sizeof(u16));
+    u16 *bg_actual = malloc(n*sizeof(u16));
+    u8 *bg8_expected = malloc(n);
+    u8 *bg8_actual = malloc(n);
+    u8 *mask_expected = malloc(n);
+    u8 *mask_actual = malloc(n);
+    u16 *columns_expected = malloc(n*sizeof(u16));
+    u16 *columns_actual = malloc(n*sizeof(u16));
+
+    int failed = 0;
+    for (int k = 0; k < n_kernels; k++) {
+        if (!cpu_supports(kernels[k].name)) {
+            continue;
+        }
+
+        int kernel_failed = 0;
+        for (int shift = 1; shift <= 8; shift++) {
+            for (int i = 0; i < n; i++) {
+                a[i] = rand() & 0xff;
+                bg_expected[i] = bg_actual[i] = (rand() % 4 == 0) ? rand() & 0xffff : (a[i] << 8) + (rand() % 4096) - 2048;
+                columns_expected[i] = columns_actual[i] = rand() & 0xff;
+            }
+
+            int e = diff_update_bg_scalar(a, bg_expected, bg8_expected, mask_expected, columns_expected, n, 8, shift);
+            int c = kernels[k].diff_update_bg(a, bg_actual, bg8_actual, mask_actual, columns_actual, n, 8, shift);
+
+            if (e != c || memcmp(bg_expected, bg_actual, n*sizeof(u16)) != 0
+                    || memcmp(bg8_expected, bg8_actual, n) != 0
+                    || memcmp(mask_expected, mask_actual, n) != 0
+                    || memcmp(columns_expected, columns_actual, n*sizeof(u16)) != 0) {
+                printf("diff_update_bg %s: FAILED shift: %d\n", kernels[k].name, shift);
+                kernel_failed++;
+            }
+        }
+
+        printf("diff_update_bg %s: %s\n", kernels[k].name, kernel_failed ? "FAILED" : "ok");
+        failed += kernel_failed;
+    }
+
+    // a constant image should become the background
+    image *img = new_image(64, 256, 1);
+    background *bg = new_background(img->width, img->height);
+    memset(img->data, 10, img->n_pixels);
+    reset_background(bg, img);
+    memset(img->data, 14, img->n_pixels);
+    for (int i = 0; i < 200; i++) {
+        diff_update_background(img, bg, NULL, NULL, NULL, 8, 4);
+    }
+    if (bg->image->data[0] != 14 || diff_images(img, bg->image, NULL, 0) != 0) {
+        printf("diff_update_background: FAILED didn't converge %d\n", bg->image->data[0]);
+        failed++;
+    }
+
+    // a 3x5 block at 10,20 in the column and row profiles, black counts too
+    u16 columns[64];
+    u16 rows[256];
+    for (int y = 20; y < 25; y++) {
+        memset(img->data + y*img->stride + 10, y == 20 ? 0 : 200, 3);
+    }
+    int changed = diff_update_background(img, bg, NULL, columns, rows, 8, 4);
+    for (int i = 0; i < 256; i++) {
+        if ((i < 64 && columns[i] != (i >= 10 && i < 13 ? 5 : 0)) || rows[i] != (i >= 20 && i < 25 ? 3 : 0)) {
+            printf("diff_update_background: FAILED profile at %d\n", i);
+            failed++;
+            break;
+        }
+    }
+    failed += changed != 15;
+    free_image(img);
+    free_background(bg);
+
+    free(a);
+    free(bg_expected);
+    free(bg_actual);
+    free(bg8_expected);
+    free(bg8_actual);
+    free(mask_expected);
+    free(mask_actual);
+    free(columns_expected);
+    free(columns_actual);
+
+    return failed;
+}
+
+// brute force median with the same edge handling as median_image
+void
+median_image_ref(const image *a, image *b, const int r)
+{
+    const int n = (2*r + 1)*(2*r + 1);
+    u8 win[n];
+
+    for (int y = 0; y < a->height; y++) {
+        for (int x = 0; x < a->width; x++) {
+            int j = 0;
+            for (int ky = -r; ky <= r; ky++) {
+                int yy = clamp(y + ky, 0, a->height - 1);
+                for (int kx = -r; kx <= r; kx++) {
+                    int xx = clamp(x + kx, 0, a->width - 1);
+                    win[j++] = a->data[yy*a->stride + xx];
+                }
+            }
+
+            insertion_sort_u8(win, n);
+            b->data[y*b->stride + x] = win[n/2];
+        }
+    }
+}
+
+// every median kernel against the brute force version, then timing for the
+// full frame sizes
+int
+test_median_image()
+{
+    const int sizes[][2] = { { 1, 1 }, { 3, 2 }, { 17, 9 }, { 33, 5 }, { 64, 256 }, { 100, 37 } };
+    const int n_sizes = sizeof(sizes)/sizeof(sizes[0]);
+    const struct kernel *saved = kernel;
+
+    int failed = 0;
+    for (int k = 0; k < n_kernels; k++) {
+        if (!cpu_supports(kernels[k].name)) {
+            continue;
+        }
+        kernel = &kernels[k];
+
+        int kernel_failed = 0;
+        for (int r = 1; r <= 5; r++) {
+            for (int i = 0; i < n_sizes; i++) {
+                image *a = new_image(sizes[i][0], sizes[i][1], 1);
+                image *expected = new_image_like(a);
+                image *actual = new_image_like(a);
+
+                // mostly smooth with some noise so all the histogram bins are used
+                for (int j = 0; j < a->n_pixels; j++) {
+                    a->data[j] = (rand() % 8 == 0) ? rand() & 0xff : (j*7 + (rand() & 0xf)) & 0xff;
+                }
+
+                median_image_ref(a, expected, r);
+                median_image(a, actual, r);
+
+                if (memcmp(expected->data, actual->data, a->n_pixels) != 0) {
+                    printf("median_image %s: FAILED r: %d, %d x %d\n", kernel->name, r, a->width, a->height);
+                    kernel_failed++;
+                }
+
+                free_image(a);
+                free_image(expected);
+                free_image(actual);
+            }
+        }
+
+        const int frames[][2] = { { 640, 480 }, { 1280, 720 } };
+        for (int i = 0; i < 2; i++) {
+            image *a = new_image(frames[i][0], frames[i][1], 1);
+            image *b = new_image_like(a);
+            for (int j = 0; j < a->n_pixels; j++) {
+                a->data[j] = rand() & 0xff;
+            }
+
+            for (int r = 1; r <= 3; r++) {
+                u64 start = SDL_GetPerformanceCounter();
+                median_image(a, b, r);
+                u64 elapsed = SDL_GetPerformanceCounter() - start;
+                printf("median_image %s %d x %d r %d: %.1f ms\n", kernel->name, a->width, a->height,
+                        r, 1000.0*elapsed/SDL_GetPerformanceFrequency());
+            }
+
+            free_image(a);
+            free_image(b);
+        }
+
+        printf("median_image %s: %s\n", kernel->name, kernel_failed ? "FAILED" : "ok");
+        failed += kernel_failed;
+    }
+
+    kernel = saved;
+
+    return failed;
+}
+
+int print_display_info()
+{
+    int display_in_use = 0; /* Only using first display */
+
+    int i, display_mode_count;
+    SDL_DisplayMode mode;
+    Uint32 f;
+
+    SDL_Log("SDL_GetNumVideoDisplays(): %i", SDL_GetNumVideoDisplays());
+
+    display_mode_count = SDL_GetNumDisplayModes(display_in_use);
+    if (display_mode_count < 1) {
+        SDL_Log("SDL_GetNumDisplayModes failed: %s", SDL_GetError());
+        return 1;
+    }
+    SDL_Log("SDL_GetNumDisplayModes: %i", display_mode_count);
+
+    for (i = 0; i < display_mode_count; ++i) {
+        if (SDL_GetDisplayMode(display_in_use, i, &mode) != 0) {
+            SDL_Log("SDL_GetDisplayMode failed: %s", SDL_GetError());
+            return 1;
+        }
+        f = mode.format;
+
+        SDL_Log("Mode %i\tbpp %i\t%s\t%i x %i", i,
+                SDL_BITSPERPIXEL(f), SDL_GetPixelFormatName(f), mode.w, mode.h);
+    }
+
+    SDL_GetCurrentDisplayMode(display_in_use, &mode);
+    SDL_Log("Current Mode\tbpp %i\t%s\t%i x %i",
+            SDL_BITSPERPIXEL(f), SDL_GetPixelFormatName(f), mode.w, mode.h);
+
+    return 0;
+}
+
+int
+get_refresh_rate(SDL_Window *window)
+{
+    SDL_DisplayMode mode;
+    int index = SDL_GetWindowDisplayIndex(window);
+    // If we can't find the refresh rate, we'll return this:
+    int default_rate = 60;
+    if (SDL_GetDesktopDisplayMode(index, &mode) != 0) {
+        return default_rate;
+    }
+
+    if (mode.refresh_rate == 0) {
+        return default_rate;
+    }
+
+    return mode.refresh_rate;
+}
+
+u64
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// sleeps until deadline_ns on the monotonic_ns() clock, returns right away
+// if it's already past
+void
+sleep_until_ns(u64 deadline_ns)
+{
+    struct timespec ts = {
+        .tv_sec = deadline_ns/1000000000,
+        .tv_nsec = deadline_ns%1000000000,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+// the present deadline after one at deadline_ns that started presenting at
+// present_ns.  Keeps the phase unless the display was idle or fell more
+// than a period behind, then it's a period from now.
+u64
+next_deadline_ns(u64 deadline_ns, u64 present_ns, u64 period_ns)
+{
+    deadline_ns += period_ns;
+    return deadline_ns < present_ns ? present_ns + period_ns : deadline_ns;
+}
+
+/*
+ * When the frame was captured in CLOCK_MONOTONIC ns, the same clock as
+ * monotonic_ns().  UVC drivers stamp the buffer when the first data arrives
+ * from the camera.  Returns 0 if the driver doesn't use the monotonic clock.
+ */
+u64
+v4l2_timestamp_ns(const struct v4l2_buffer *vbuf)
+{
+    if ((vbuf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        return 0;
+    }
+
+    return (u64)vbuf->timestamp.tv_sec*1000000000 + (u64)vbuf->timestamp.tv_usec*1000;
+}
+
+/*
+ * Camera buffers handed from one owner to the next.  The driver fills a
+ * buffer, the capture thread owns it while processing and may hand it on to
+ * a display slot, which shows the frame directly instead of a copy.  The
+ * buffer goes back to the driver once its last owner releases it, from any
+ * thread, and the capture thread requeues it.  Recording and the photo
+ * finish copy the frames they keep, holding camera buffers for them would
+ * leave the driver without any.
+ *
+ * Buffers are either the driver's mmap'd buffers or, with USERPTR, our own
+ * page aligned allocations.
+ */
+#define FRAME_POOL_MAX 32
+
+struct frame_pool {
+    enum v4l2_memory memory;
+    struct buffer *buffers;
+    int n_buffers;
+    // bit per buffer released by its owner that hasn't been requeued
+    _Atomic u32 released;
+    // bit per buffer the driver has, capture thread only
+    u32 queued;
+};
+
+// USERPTR buffers from our own pool, false if the driver doesn't support it
+bool
+frame_pool_init_userptr(struct frame_pool *pool, int fd, int n_buffers, size_t size)
+{
+    struct v4l2_requestbuffers req = {};
+    req.count = n_buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+        debugf("VIDIOC_REQBUFS userptr: %s", strerror(errno));
+        return false;
+    }
+
+    // the driver may change the count, give them back for mmap if it's
+    // out of range
+    if (req.count < 2 || req.count > FRAME_POOL_MAX) {
+        debugf("VIDIOC_REQBUFS userptr: %u buffers", req.count);
+        req.count = 0;
+        if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+            debugf("VIDIOC_REQBUFS userptr free: %s", strerror(errno));
+        }
+        return false;
+    }
+
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1)/page*page;
+
+    pool->memory = V4L2_MEMORY_USERPTR;
+    pool->n_buffers = req.count;
+    pool->buffers = calloc(req.count, sizeof(pool->buffers[0]));
+    if (!pool->buffers) {
+        errno_exit("calloc");
+    }
+    for (unsigned int i = 0; i < req.count; i++) {
+        pool->buffers[i].length = size;
+        pool->buffers[i].start = aligned_alloc(page, size);
+        if (!pool->buffers[i].start) {
+            errno_exit("aligned_alloc");
+        }
+    }
+
+    return true;
+}
+
+void
+frame_pool_init_mmap(struct frame_pool *pool, int fd, int n_buffers)
+{
+    struct v4l2_requestbuffers req = {};
+    req.count = n_buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (ioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+        errno_exit("VIDIOC_REQBUFS");
+    }
+
+    if (req.count < 2 || req.count > FRAME_POOL_MAX) {
+        SDL_Log("camera buffers: %u", req.count);
+        errno_exit("VIDIOC_REQBUFS");
+    }
+
+    pool->memory = V4L2_MEMORY_MMAP;
+    pool->n_buffers = req.count;
+    pool->buffers = calloc(req.count, sizeof(pool->buffers[0]));
+    if (!pool->buffers) {
+        errno_exit("calloc");
+    }
+
+    for (unsigned int i = 0; i < req.count; i++) {
+        struct v4l2_buffer vbuf = {};
+        vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        vbuf.memory = V4L2_MEMORY_MMAP;
+        vbuf.index = i;
+
+        if (ioctl(fd, VIDIOC_QUERYBUF, &vbuf) == -1) {
+            errno_exit("VIDIOC_QUERYBUF");
+        }
+
+        pool->buffers[i].length = vbuf.length;
+        pool->buffers[i].start = mmap(NULL, vbuf.length,
+                PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, vbuf.m.offset);
+
+        if (pool->buffers[i].start == MAP_FAILED) {
+            errno_exit("mmap");
+        }
+    }
+}
+
+void
+free_frame_pool(struct frame_pool *pool)
+{
+    for (int i = 0; i < pool->n_buffers; i++) {
+        if (pool->memory == V4L2_MEMORY_MMAP) {
+            if (munmap(pool->buffers[i].start, pool->buffers[i].length) == -1) {
+                perror("munmap");
+            }
+        } else {
+            free(pool->buffers[i].start);
+        }
+    }
+    free(pool->buffers);
+    pool->buffers = NULL;
+    pool->n_buffers = 0;
+}
+
+void
+frame_release(struct frame_pool *pool, int index)
+{
+    atomic_fetch_or_explicit(&pool->released, 1u << index, memory_order_release);
+}
+
+// gives a buffer to the driver, the capture thread owns it when it's
+// dequeued.  One the driver won't take stays released to be tried again.
+void
+frame_pool_queue(struct frame_pool *pool, int fd, int index)
+{
+    struct v4l2_buffer vbuf = {};
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = pool->memory;
+    vbuf.index = index;
+    if (pool->memory == V4L2_MEMORY_USERPTR) {
+        vbuf.m.userptr = (unsigned long)pool->buffers[index].start;
+        vbuf.length = pool->buffers[index].length;
+    }
+
+    if (ioctl(fd, VIDIOC_QBUF, &vbuf) == -1) {
+        debugf("VIDIOC_QBUF: %s", strerror(errno));
+        frame_release(pool, index);
+        return;
+    }
+
+    pool->queued |= 1u << index;
+}
+
+// requeue every released buffer, returns the number the driver has
+int
+frame_pool_requeue(struct frame_pool *pool, int fd)
+{
+    u32 released = atomic_exchange_explicit(&pool->released, 0, memory_order_acquire);
+    while (released) {
+        int index = __builtin_ctz(released);
+        released &= released - 1;
+        frame_pool_queue(pool, fd, index);
+    }
+
+    return __builtin_popcount(pool->queued);
+}
+
+void
+frame_pool_queue_all(struct frame_pool *pool, int fd)
+{
+    for (int i = 0; i < pool->n_buffers; i++) {
+        frame_pool_queue(pool, fd, i);
+    }
+}
+
+// after VIDIOC_STREAMOFF the driver has given back every queued buffer,
+// they're released to be requeued
+void
+frame_pool_streamoff(struct frame_pool *pool)
+{
+    u32 queued = pool->queued;
+    pool->queued = 0;
+    while (queued) {
+        int index = __builtin_ctz(queued);
+        queued &= queued - 1;
+        frame_release(pool, index);
+    }
+}
+
+/*
+ * Capture format negotiation.  Every format, size and frame interval the
+ * camera offers is listed and the fastest that fits the finish line is
+ * used, the frame rate is what limits the timing.  GREY is preferred over
+ * YUYV over MJPEG at the same rate since it's the least work per frame.
+ */
+#define MAX_CAPTURE_MODES 256
+
+struct capture_mode {
+    u32 pixelformat;
+    u32 width;
+    u32 height;
+    struct v4l2_fract interval;
+};
+
+double
+mode_fps(const struct capture_mode *m)
+{
+    return m->interval.numerator ? (double)m->interval.denominator/m->interval.numerator : 0;
+}
+
+// lower is better, -1 for formats run_capture can't handle
+int
+format_rank(u32 pixelformat)
+{
+    switch (pixelformat) {
+        case V4L2_PIX_FMT_GREY: return 0;
+        case V4L2_PIX_FMT_YUYV: return 1;
+        case V4L2_PIX_FMT_MJPEG: return 2;
+        default: return -1;
+    }
+}
+
+// fourcc as a string, buf must have 5 bytes
+const char *
+fourcc_name(u32 fourcc, char *buf)
+{
+    for (int i = 0; i < 4; i++) {
+        buf[i] = fourcc >> i*8 & 0xff;
+    }
+    buf[4] = '\0';
+
+    return buf;
+}
+
+// adds the fastest interval of a size, returns the new count
+int
+add_capture_mode(int fd, struct capture_mode *modes, int n, u32 pixelformat, u32 width, u32 height)
+{
+    if (n >= MAX_CAPTURE_MODES) {
+        return n;
+    }
+
+    struct capture_mode *m = &modes[n];
+    m->pixelformat = pixelformat;
+    m->width = width;
+    m->height = height;
+    m->interval = (struct v4l2_fract){ 0, 0 };
+
+    struct v4l2_frmivalenum ival = {};
+    ival.pixel_format = pixelformat;
+    ival.width = width;
+    ival.height = height;
+    for (ival.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++) {
+        struct v4l2_fract f = ival.type == V4L2_FRMIVAL_TYPE_DISCRETE ? ival.discrete : ival.stepwise.min;
+        // f is shorter than the best so far
+        if (f.denominator && (!m->interval.numerator
+                    || (u64)f.numerator*m->interval.denominator < (u64)m->interval.numerator*f.denominator)) {
+            m->interval = f;
+        }
+        if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+            break;
+        }
+    }
+
+    return n + 1;
+}
+
+// every supported format and size with its fastest frame interval
+int
+enum_capture_modes(int fd, struct capture_mode *modes)
+{
+    int n = 0;
+
+    struct v4l2_fmtdesc desc = {};
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (desc.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++) {
+        char name[5];
+        debugf("camera format: %s %s", fourcc_name(desc.pixelformat, name), desc.description);
+        if (format_rank(desc.pixelformat) < 0) {
+            continue;
+        }
+
+        struct v4l2_frmsizeenum size = {};
+        size.pixel_format = desc.pixelformat;
+        for (size.index = 0; ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++) {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                n = add_capture_mode(fd, modes, n, desc.pixelformat, size.discrete.width, size.discrete.height);
+                continue;
+            }
+
+            // stepwise, the smallest, 640x480 when it's in range and the
+            // largest
+            const struct v4l2_frmsize_stepwise *sw = &size.stepwise;
+            n = add_capture_mode(fd, modes, n, desc.pixelformat, sw->min_width, sw->min_height);
+            if (sw->min_width <= 640 && sw->max_width >= 640 && sw->min_height <= 480 && sw->max_height >= 480) {
+                n = add_capture_mode(fd, modes, n, desc.pixelformat, 640, 480);
+            }
+            n = add_capture_mode(fd, modes, n, desc.pixelformat, sw->max_width, sw->max_height);
+            break;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Picks the mode with the highest frame rate at least min_width x
+ * min_height, then the preferred format, then the size closest to 640x480
+ * which the display is made for.  Fields of want that are non-zero have to
+ * match.  Returns -1 if nothing fits, reason says why the mode won.
+ */
+int
+choose_capture_mode(const struct capture_mode *modes, int n, const struct capture_mode *want,
+        u32 min_width, u32 min_height, const char **reason)
+{
+    int best = -1;
+    double best_fps = 0;
+    int fps_ties = 0;
+    bool format_won = false;
+
+    for (int i = 0; i < n; i++) {
+        const struct capture_mode *m = &modes[i];
+        if (format_rank(m->pixelformat) < 0 || m->width < min_width || m->height < min_height) {
+            continue;
+        }
+        if ((want->pixelformat && m->pixelformat != want->pixelformat)
+                || (want->width && (m->width != want->width || m->height != want->height))
+                || (want->interval.numerator && mode_fps(m) < mode_fps(want) - 0.5)) {
+            continue;
+        }
+
+        double fps = mode_fps(m);
+        if (best < 0 || fps > best_fps + 0.5) {
+            best = i;
+            best_fps = fps;
+            fps_ties = 0;
+            format_won = false;
+            continue;
+        }
+        if (fps < best_fps - 0.5) {
+            continue;
+        }
+
+        fps_ties++;
+        const struct capture_mode *b = &modes[best];
+        int rank = format_rank(m->pixelformat) - format_rank(b->pixelformat);
+        s64 area = labs((s64)m->width*m->height - 640*480) - labs((s64)b->width*b->height - 640*480);
+        if (rank < 0) {
+            best = i;
+            format_won = true;
+        } else if (rank == 0 && area < 0) {
+            best = i;
+        }
+    }
+
+    if (best >= 0) {
+        if (want->pixelformat || want->width || want->interval.numerator) {
+            *reason = "fastest matching -f";
+        } else if (format_won) {
+            *reason = "highest frame rate covering the finish line, preferred format at that rate";
+        } else if (fps_ties) {
+            *reason = "highest frame rate covering the finish line, closest to 640x480 at that rate";
+        } else {
+            *reason = "highest frame rate covering the finish line";
+        }
+    }
+
+    return best;
+}
+
+// "640x480@30:YUYV", each part optional
+bool
+parse_capture_mode(const char *s, struct capture_mode *m)
+{
+    memset(m, 0, sizeof(*m));
+
+    const char *p = s;
+    if (*p >= '0' && *p <= '9') {
+        char *end;
+        m->width = strtoul(p, &end, 10);
+        if (*end != 'x') {
+            return false;
+        }
+        m->height = strtoul(end + 1, &end, 10);
+        if (!m->width || !m->height) {
+            return false;
+        }
+        p = end;
+    }
+    if (*p == '@') {
+        char *end;
+        m->interval.numerator = 1;
+        m->interval.denominator = strtoul(p + 1, &end, 10);
+        if (!m->interval.denominator) {
+            return false;
+        }
+        p = end;
+    }
+    if (*p == ':') {
+        p++;
+        if (strlen(p) != 4) {
+            return false;
+        }
+        m->pixelformat = v4l2_fourcc(p[0], p[1], p[2], p[3]);
+        p += 4;
+    }
+
+    return *p == '\0';
+}
+
+// a video capture device that can stream, not a metadata node
+bool
+is_capture_device(int fd)
+{
+    struct v4l2_capability cap = {};
+    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
+        return false;
+    }
+
+    u32 caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+    debugf("%s %s caps: %08x", cap.card, cap.bus_info, caps);
+
+    return (caps & V4L2_CAP_VIDEO_CAPTURE) && (caps & V4L2_CAP_STREAMING);
+}
+
+/*
+ * Sub-frame crossing time.  The motion check only says which frame a car was
+ * first seen in, 50ms at 20fps.  Instead the leading edge of the car is found
+ * in the column profile of the changed pixels for the frames around the
+ * trigger.  A line fit through edge position vs frame time gives when the
+ * edge passed line_x.  Cars are assumed to move along x through the finish
+ * line.
+ *
+ * The estimate needs the frame after the trigger so the lap time is
+ * corrected one frame later.
+ */
+
+#define CROSSING_HISTORY 4
+
+struct crossing_sample {
+    u64 ns;
+    // first and last columns with motion, lo > hi if none
+    int lo;
+    int hi;
+};
+
+struct crossing {
+    struct crossing_sample samples[CROSSING_HISTORY];
+    // total added, the newest is at (n_samples - 1) % CROSSING_HISTORY
+    int n_samples;
+
+    // the trigger frame is waiting for the next frame to estimate
+    bool pending;
+    u64 trigger_ns;
+};
+
+/*
+ * Webcams have rolling shutters, the rows are exposed one after the other
+ * over readout_ns so the bottom of the frame is later than the top.  Frame
+ * timestamps are taken as the time of row 0.
+ */
+struct rolling_shutter {
+    u64 readout_ns;
+    int height;
+};
+
+u64
+row_time(const struct rolling_shutter *rs, u64 frame_ns, double y)
+{
+    return frame_ns + (u64)(rs->readout_ns*y/rs->height);
+}
+
+// weighted center of the changed rows, first and last rows with at least
+// min_count changes.  Returns false if no row has min_count.
+bool
+changed_rows(const u16 *rows, int height, int min_count, double *center, int *first, int *last)
+{
+    double sum = 0;
+    double weighted = 0;
+    *first = -1;
+    *last = -1;
+
+    for (int y = 0; y < height; y++) {
+        if (rows[y] >= min_count) {
+            if (*first < 0) {
+                *first = y;
+            }
+            *last = y;
+        }
+        sum += rows[y];
+        weighted += (double)rows[y]*y;
+    }
+
+    *center = sum > 0 ? weighted/sum : height/2.0;
+
+    return *first >= 0;
+}
+
+// columns with at least min_rows changed pixels are part of the car
+void
+crossing_add(struct crossing *c, u64 ns, const u16 *profile, int width, int min_rows)
+{
+    struct crossing_sample s = { .ns = ns, .lo = width, .hi = -1 };
+    for (int x = 0; x < width; x++) {
+        if (profile[x] >= min_rows) {
+            if (s.lo == width) {
+                s.lo = x;
+            }
+            s.hi = x;
+        }
+    }
+
+    c->samples[c->n_samples % CROSSING_HISTORY] = s;
+    c->n_samples++;
+}
+
+static const struct crossing_sample *
+crossing_sample(const struct crossing *c, int age)
+{
+    if (age >= c->n_samples || age >= CROSSING_HISTORY) {
+        return NULL;
+    }
+
+    return &c->samples[(c->n_samples - 1 - age) % CROSSING_HISTORY];
+}
+
+/*
+ * Estimate when the leading edge passed line_x.  Call with the frame after
+ * the trigger as the newest sample.  Returns 0 if there's not enough to go
+ * on, like a car that was only seen in one frame.
+ */
+u64
+crossing_estimate(const struct crossing *c, int width, int line_x)
+{
+    const struct crossing_sample *trigger = crossing_sample(c, 1);
+    const struct crossing_sample *next = crossing_sample(c, 0);
+    if (!trigger || !next || trigger->lo > trigger->hi) {
+        return 0;
+    }
+
+    // direction from the side the car came in, or the way it moved
+    int dir = 0;
+    for (int age = 0; age < CROSSING_HISTORY && !dir; age++) {
+        const struct crossing_sample *s = crossing_sample(c, age);
+        if (!s || s->lo > s->hi) {
+            continue;
+        }
+
+        if (s->lo == 0 && s->hi < width - 1) {
+            dir = 1;
+        } else if (s->hi == width - 1 && s->lo > 0) {
+            dir = -1;
+        }
+    }
+
+    if (!dir && next->lo <= next->hi) {
+        int moved = (next->lo + next->hi) - (trigger->lo + trigger->hi);
+        dir = (moved > 0) - (moved < 0);
+    }
+
+    if (dir == 0) {
+        return 0;
+    }
+
+    // work in how far the edge has come into the finish line, columns
+    // covered up to their center
+    const double line = dir > 0 ? line_x : width - line_x;
+
+    // least squares fit of progress = m*t + b, t in ms from the trigger.
+    // Frames where the car covers the whole width are past the finish line
+    // area so aren't used.
+    double st = 0, sp = 0, stt = 0, stp = 0;
+    int n = 0;
+    int used_age = 0;
+    for (int age = 0; age < CROSSING_HISTORY; age++) {
+        const struct crossing_sample *s = crossing_sample(c, age);
+        if (!s || s->lo > s->hi) {
+            continue;
+        }
+
+        double p = dir > 0 ? s->hi + 1 : width - s->lo;
+        if (p >= width) {
+            continue;
+        }
+
+        double t = ((s64)(s->ns - trigger->ns))/1e6;
+        st += t;
+        sp += p;
+        stt += t*t;
+        stp += t*p;
+        n++;
+        used_age = age;
+    }
+
+    double t;
+    if (n >= 2) {
+        double denom = n*stt - st*st;
+        if (denom <= 0) {
+            return 0;
+        }
+
+        double m = (n*stp - st*sp)/denom;
+        double b = (sp - m*st)/n;
+        if (m <= 0) {
+            return 0;
+        }
+
+        t = (line - b)/m;
+    } else if (n == 1) {
+        // fast car only seen in one frame.  If nothing was there the frame
+        // before it came at least p columns since then, and if it covered the
+        // whole width the frame after it went at least the rest.  The larger
+        // of those is the best guess of the speed.
+        const struct crossing_sample *before = crossing_sample(c, used_age + 1);
+        const struct crossing_sample *after = used_age > 0 ? crossing_sample(c, used_age - 1) : NULL;
+        const struct crossing_sample *s = crossing_sample(c, used_age);
+        double p = sp;
+        double v = 0;
+
+        if (before && before->lo > before->hi) {
+            v = p/((s->ns - before->ns)/1e6);
+        }
+
+        if (after && after->lo == 0 && after->hi == width - 1) {
+            double v_after = (width - p)/((after->ns - s->ns)/1e6);
+            v = v_after > v ? v_after : v;
+        }
+
+        if (v <= 0) {
+            return 0;
+        }
+
+        t = st + (line - p)/v;
+    } else {
+        return 0;
+    }
+
+    // the edge passed between the frame before the trigger and the one after
+    const struct crossing_sample *prev = crossing_sample(c, 2);
+    u64 min_ns = prev ? prev->ns : trigger->ns;
+    u64 ns = trigger->ns + (s64)(t*1e6);
+    if ((s64)(ns - min_ns) < 0) {
+        ns = min_ns;
+    } else if ((s64)(ns - next->ns) > 0) {
+        ns = next->ns;
+    }
+
+    return ns;
+}
+
+/*
+ * Lock-free triple buffer of slot indexes between one producer and one
+ * consumer.  The producer fills back and swaps it with middle, the consumer
+ * swaps front with middle only when it has a new frame.  Neither side ever
+ * waits and the consumer always gets the newest complete frame.
+ */
+#define TRIPLE_BUFFER_NEW 4
+
+struct triple_buffer {
+    // slot index | TRIPLE_BUFFER_NEW when published and not yet taken
+    _Atomic u32 middle;
+    // producer only
+    u32 back;
+    // consumer only
+    u32 front;
+    // frames published over one the consumer never took
+    _Atomic u64 overwritten;
+};
+
+void
+init_triple_buffer(struct triple_buffer *tb)
+{
+    tb->front = 0;
+    atomic_init(&tb->middle, 1);
+    tb->back = 2;
+    atomic_init(&tb->overwritten, 0);
+}
+
+// makes the back slot available to the consumer and returns the new back slot
+u32
+triple_buffer_publish(struct triple_buffer *tb)
+{
+    u32 prev = atomic_exchange_explicit(&tb->middle, tb->back | TRIPLE_BUFFER_NEW, memory_order_acq_rel);
+    if (prev & TRIPLE_BUFFER_NEW) {
+        atomic_fetch_add_explicit(&tb->overwritten, 1, memory_order_relaxed);
+    }
+    tb->back = prev & ~TRIPLE_BUFFER_NEW;
+
+    return tb->back;
+}
+
+// true if the consumer has taken the last published frame
+bool
+triple_buffer_taken(struct triple_buffer *tb)
+{
+    return !(atomic_load_explicit(&tb->middle, memory_order_relaxed) & TRIPLE_BUFFER_NEW);
+}
+
+// true if front was replaced with a newer frame
+bool
+triple_buffer_acquire(struct triple_buffer *tb)
+{
+    if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & TRIPLE_BUFFER_NEW)) {
+        return false;
+    }
+
+    u32 prev = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+    tb->front = prev & ~TRIPLE_BUFFER_NEW;
+
+    return true;
+}
+
+/*
+ * Per-stage latency.  Each thread records when every stage of a frame
+ * finished into its own ring, a single writer so there are no locks.  The
+ * latency of a stage is from the frame's base time, when the camera
+ * captured it (or was dequeued for recordings), so the stages add up from
+ * photon to screen.  The display summarizes the newest events and the
+ * whole trace is written as Chrome trace JSON (chrome://tracing,
+ * ui.perfetto.dev) with -T.
+ */
+enum stage {
+    STAGE_CAPTURE,
+    STAGE_DQBUF,
+    STAGE_CONVERT,
+    STAGE_DETECT,
+    STAGE_PUBLISH,
+    STAGE_UPLOAD,
+    STAGE_PRESENT,
+    N_STAGES,
+};
+
+static const char *stage_names[N_STAGES] = {
+    "capture", "dqbuf", "convert", "detect", "publish", "upload", "present",
+};
+
+#define TRACE_RING_SIZE (1 << 14)
+#define TRACE_MAX_RINGS 8
+// readers only look at the newest half so the writer can't lap them
+#define TRACE_SUMMARY_EVENTS (TRACE_RING_SIZE/2)
+
+struct trace_event {
+    // the stage ran from begin to end
+    u64 begin_ns;
+    u64 end_ns;
+    // frame capture time latencies are from
+    u64 base_ns;
+    u32 sequence;
+    u8 stage;
+    u8 camera;
+};
+
+struct trace_ring {
+    char name[32];
+    // events written, the newest is at (head - 1) % TRACE_RING_SIZE
+    _Atomic u64 head;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+// every ring for the summary and the trace file
+static struct {
+    _Atomic int n_rings;
+    struct trace_ring *rings[TRACE_MAX_RINGS];
+} traces;
+
+// a ring for one thread, NULL when there are too many
+struct trace_ring *
+new_trace_ring(const char *name)
+{
+    int i = atomic_fetch_add(&traces.n_rings, 1);
+    if (i >= TRACE_MAX_RINGS) {
+        atomic_fetch_sub(&traces.n_rings, 1);
+        return NULL;
+    }
+
+    struct trace_ring *ring = calloc(1, sizeof(*ring));
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    traces.rings[i] = ring;
+
+    return ring;
+}
+
+void
+free_trace_rings()
+{
+    int n = atomic_exchange(&traces.n_rings, 0);
+    for (int i = 0; i < n; i++) {
+        free(traces.rings[i]);
+        traces.rings[i] = NULL;
+    }
+}
+
+// writer thread only, ring may be NULL
+static inline void
+trace_stage(struct trace_ring *ring, enum stage stage, int camera, u32 sequence, u64 base_ns, u64 begin_ns, u64 end_ns)
+{
+    if (!ring) {
+        return;
+    }
+
+    u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->events[head % TRACE_RING_SIZE] = (struct trace_event){
+        .begin_ns = begin_ns, .end_ns = end_ns, .base_ns = base_ns,
+        .sequence = sequence, .stage = stage, .camera = camera,
+    };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a;
+    u64 y = *(const u64 *)b;
+    return (x > y) - (x < y);
+}
+
+struct stage_stats {
+    int n;
+    // latency from the frame base, ns
+    u64 p50;
+    u64 p99;
+    u64 max;
+};
+
+/*
+ * Latency percentiles of each stage over the newest events in every ring.
+ * Safe to call from any thread while the rings are written.
+ */
+void
+trace_summary(struct stage_stats stats[N_STAGES])
+{
+    static u64 latencies[N_STAGES][TRACE_MAX_RINGS*TRACE_SUMMARY_EVENTS];
+    int counts[N_STAGES] = {};
+
+    int n_rings = atomic_load(&traces.n_rings);
+    for (int r = 0; r < n_rings && r < TRACE_MAX_RINGS; r++) {
+        const struct trace_ring *ring = traces.rings[r];
+        u64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        u64 first = head > TRACE_SUMMARY_EVENTS ? head - TRACE_SUMMARY_EVENTS : 0;
+        for (u64 i = first; i < head; i++) {
+            const struct trace_event *e = &ring->events[i % TRACE_RING_SIZE];
+            if (e->stage < N_STAGES && e->end_ns >= e->base_ns) {
+                latencies[e->stage][counts[e->stage]++] = e->end_ns - e->base_ns;
+            }
+        }
+    }
+
+    for (int s = 0; s < N_STAGES; s++) {
+        stats[s] = (struct stage_stats){ .n = counts[s] };
+        if (counts[s]) {
+            qsort(latencies[s], counts[s], sizeof(u64), compare_u64);
+            stats[s].p50 = latencies[s][counts[s]/2];
+            stats[s].p99 = latencies[s][(counts[s] - 1)*99/100];
+            stats[s].max = latencies[s][counts[s] - 1];
+        }
+    }
+}
+
+// every event still in the rings as Chrome trace JSON, false on failure
+bool
+write_trace(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        return false;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    int n_rings = atomic_load(&traces.n_rings);
+    for (int r = 0; r < n_rings && r < TRACE_MAX_RINGS; r++) {
+        const struct trace_ring *ring = traces.rings[r];
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", r, ring->name);
+        first = false;
+
+        u64 head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        u64 start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (u64 i = start; i < head; i++) {
+            const struct trace_event *e = &ring->events[i % TRACE_RING_SIZE];
+            // microseconds
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"camera%d\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u,\"latency_ms\":%.3f}}",
+                    stage_names[e->stage], e->camera, r, e->begin_ns/1e3, (e->end_ns - e->begin_ns)/1e3,
+                    e->sequence, (e->end_ns - e->base_ns)/1e6);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    return fclose(f) == 0;
+}
+
+// the same as text
+void
+print_trace_summary(FILE *f)
+{
+    struct stage_stats stats[N_STAGES];
+    trace_summary(stats);
+
+    fprintf(f, "latency ms    p50    p99    max\n");
+    for (int s = 0; s < N_STAGES; s++) {
+        if (stats[s].n) {
+            fprintf(f, "%-11s %6.1f %6.1f %6.1f\n", stage_names[s], stats[s].p50/1e6, stats[s].p99/1e6, stats[s].max/1e6);
+        }
+    }
+}
+
+// latency percentiles per stage in ms, the frames the display loop ran
+// over and presents without a new frame, 30 characters wide
+void
+draw_trace_summary(image *img, int x, int y, const color *fg, u64 over_frame_time,
+        u64 redundant_presents)
+{
+    struct stage_stats stats[N_STAGES];
+    trace_summary(stats);
+
+    char text[64];
+    y += draw_text(img, x, y, 1, fg, "latency    p50    p99    max");
+    for (int s = 0; s < N_STAGES; s++) {
+        if (stats[s].n) {
+            snprintf(text, 64, "%-8s %6.1f %6.1f %6.1f", stage_names[s],
+                    stats[s].p50/1e6, stats[s].p99/1e6, stats[s].max/1e6);
+            y += draw_text(img, x, y, 1, fg, text);
+        }
+    }
+    snprintf(text, 64, "over frame time %lu", over_frame_time);
+    y += draw_text(img, x, y, 1, fg, text);
+    snprintf(text, 64, "redundant presents %lu", redundant_presents);
+    draw_text(img, x, y, 1, fg, text);
+}
+
+/*
+ * Text and the finish line rectangle drawn over the camera views.  The
+ * capture thread fills one per frame and the display draws it on the window
+ * layer so the frames can be uploaded as they came from the camera.
+ */
+#define OVERLAY_MAX_TEXTS 12
+
+enum overlay_view {
+    OVERLAY_GRAY,
+    OVERLAY_COLOR,
+};
+
+struct overlay_text {
+    enum overlay_view view;
+    int x;
+    int y;
+    const color *fg;
+    char text[64];
+};
+
+struct overlay {
+    // finish line on both views, NULL color for none
+    const color *rect_color;
+    int rect_x;
+    int rect_y;
+    int rect_width;
+    int rect_height;
+
+    int n_texts;
+    struct overlay_text texts[OVERLAY_MAX_TEXTS];
+};
+
+// adds a line of text at x, y in frame coordinates.  returns the line height
+// like draw_shadow_text
+int
+overlay_text(struct overlay *o, enum overlay_view view, int x, int y, const color *fg, const char *text)
+{
+    if (o->n_texts < OVERLAY_MAX_TEXTS) {
+        struct overlay_text *t = &o->texts[o->n_texts++];
+        t->view = view;
+        t->x = x;
+        t->y = y;
+        t->fg = fg;
+        snprintf(t->text, sizeof(t->text), "%s", text);
+    }
+
+    return text_line_height(1);
+}
+
+// views are where the gray and color frames of frame_width x frame_height are
+// shown on img
+void
+draw_overlay(image *img, const struct overlay *o, const SDL_Rect views[2], int frame_width, int frame_height)
+{
+    for (int v = 0; v < 2; v++) {
+        if (o->rect_color) {
+            draw_rect(img, views[v].x + o->rect_x*views[v].w/frame_width,
+                    views[v].y + o->rect_y*views[v].h/frame_height,
+                    o->rect_width*views[v].w/frame_width, o->rect_height*views[v].h/frame_height,
+                    o->rect_color);
+        }
+    }
+
+    for (int i = 0; i < o->n_texts; i++) {
+        const struct overlay_text *t = &o->texts[i];
+        const SDL_Rect *view = &views[t->view];
+        draw_shadow_text(img, view->x + t->x*view->w/frame_width, view->y + t->y*view->h/frame_height,
+                1, t->fg, t->text);
+    }
+}
+
+// finish line size and distance from the bottom of the frame
+#define FINISH_LINE_WIDTH 64
+#define FINISH_LINE_HEIGHT 256
+#define FINISH_LINE_MARGIN 32
+// the finish line, background and mask thumbnails side by side with 2 pixel
+// gaps across the top of the gray view
+#define FINISH_LINE_MIN_WIDTH (FINISH_LINE_WIDTH*3 + 4)
+
+/*
+ * Where frames come from.  The capture thread only sees frames through a
+ * frame_source: a live V4L2 camera or a recording replayed from a file.
+ * next() hands out one frame at a time, release() gives it back once
+ * whoever ended up with it, the capture thread or the display, is done.
+ */
+enum frame_status {
+    FRAME_READY,
+    // nothing yet, the timeout or a wakeup
+    FRAME_NONE,
+    // the end of a recording
+    FRAME_END,
+};
+
+// how a recording is replayed.  Lap times only depend on the recorded
+// timestamps so they're the same in every mode.
+enum replay_mode {
+    // at the recorded frame times
+    REPLAY_REALTIME,
+    // as fast as the frames can be processed
+    REPLAY_FAST,
+    // a frame each time the source is stepped
+    REPLAY_STEP,
+};
+
+struct frame {
+    const u8 *data;
+    u32 bytesused;
+    u32 sequence;
+    // when the frame was captured in CLOCK_MONOTONIC ns, 0 if unknown
+    u64 timestamp_ns;
+    // the source's buffer, for release
+    int index;
+};
+
+struct frame_source {
+    // GREY, YUYV or MJPEG
+    u32 pixelformat;
+    u32 width;
+    u32 height;
+    // bytes per row of a GREY or YUYV frame, drivers may pad them.  0 when
+    // the rows are packed.
+    u32 bytesperline;
+    // the driver's biggest frame, 0 for files
+    u32 sizeimage;
+    struct v4l2_fract interval;
+    // timestamps are from when a recording was made, not comparable with
+    // monotonic_ns() now
+    bool recorded;
+    // times a live camera had less than 2 buffers
+    u64 starved_frames;
+
+    void (*start)(struct frame_source *src);
+    // waits up to timeout_ms for the next frame, less if wake_fd is written
+    enum frame_status (*next)(struct frame_source *src, int wake_fd, int timeout_ms, struct frame *f);
+    void (*release)(struct frame_source *src, const struct frame *f);
+    // restarts a stalled stream, NULL for sources that can't stall
+    void (*restart)(struct frame_source *src);
+    // lets a single stepped replay go on a frame, NULL if it isn't stepped
+    void (*step)(struct frame_source *src);
+    void (*stop)(struct frame_source *src);
+    // frees everything, the source can't be used after
+    void (*close)(struct frame_source *src);
+};
+
+// bytes per row of the source's GREY or YUYV frames
+static inline
+u32 source_stride(const struct frame_source *src)
+{
+    const u32 packed = src->width*(src->pixelformat == V4L2_PIX_FMT_GREY ? 1 : 2);
+    return src->bytesperline > packed ? src->bytesperline : packed;
+}
+
+// wakes whatever thread is waiting on the eventfd, the capture thread,
+// photo finish, shot writer or recorder
+void
+wake_eventfd(int fd)
+{
+    u64 one = 1;
+    if (write(fd, &one, sizeof(one)) == -1) {
+        debugf("eventfd write: %s", strerror(errno));
+    }
+}
+
+/*
+ * Waits up to timeout_ms for a frame on the camera fd or a wakeup on
+ * wake_fd.  Returns true if a frame is ready to dequeue.  fd -1 only waits
+ * for a wakeup.  A camera that isn't streaming or was unplugged polls as an
+ * error, then it only waits for a wakeup so the watchdog gets to run
+ * instead of spinning.
+ */
+bool
+wait_frame(int fd, int wake_fd, int timeout_ms)
+{
+    struct pollfd fds[2] = {
+        { .fd = wake_fd, .events = POLLIN },
+        { .fd = fd, .events = POLLIN },
+    };
+
+    int n = poll(fds, 2, timeout_ms);
+    if (n == -1) {
+        if (errno != EINTR) {
+            debugf("poll: %s", strerror(errno));
+        }
+        return false;
+    }
+
+    if (fds[1].revents & (POLLERR | POLLHUP) && !(fds[1].revents & POLLIN)) {
+        fds[1].fd = -1;
+        poll(fds, 2, timeout_ms < 10 ? timeout_ms : 10);
+    }
+
+    if (fds[0].revents & POLLIN) {
+        u64 count;
+        if (read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            debugf("eventfd read: %s", strerror(errno));
+        }
+    }
+
+    return fds[1].revents & POLLIN;
+}
+
+// a V4L2 camera opened O_NONBLOCK with its buffers
+struct v4l2_source {
+    struct frame_source source;
+    int fd;
+    struct frame_pool pool;
+};
+
+static void
+v4l2_source_start(struct frame_source *src)
+{
+    struct v4l2_source *v = (struct v4l2_source *)src;
+
+    enum v4l2_buf_type vtype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(v->fd, VIDIOC_STREAMON, &vtype) == -1) {
+        errno_exit("VIDIOC_STREAMON");
+    }
+}
+
+static enum frame_status
+v4l2_source_next(struct frame_source *src, int wake_fd, int timeout_ms, struct frame *f)
+{
+    struct v4l2_source *v = (struct v4l2_source *)src;
+
+    // buffers still held by the display aren't available to the driver.
+    // With less than 2 it drops frames while we process.
+    int n_queued = frame_pool_requeue(&v->pool, v->fd);
+    if (n_queued < 2) {
+        if (!src->starved_frames) {
+            debugf("camera driver starved, %d of %d buffers queued", n_queued, v->pool.n_buffers);
+        }
+        src->starved_frames++;
+        if (n_queued == 0) {
+            wait_frame(-1, wake_fd, 1);
+            return FRAME_NONE;
+        }
+    }
+
+    if (!wait_frame(v->fd, wake_fd, timeout_ms)) {
+        return FRAME_NONE;
+    }
+
+    struct v4l2_buffer vbuf = {};
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = v->pool.memory;
+    if (ioctl(v->fd, VIDIOC_DQBUF, &vbuf) == -1) {
+        // EIO is a frame lost by the driver, anything that doesn't go away
+        // ends up restarted by the watchdog
+        if (errno != EAGAIN) {
+            debugf("thread no camera image %d: %s", errno, strerror(errno));
+        }
+        return FRAME_NONE;
+    }
+    v->pool.queued &= ~(1u << vbuf.index);
+
+    f->data = v->pool.buffers[vbuf.index].start;
+    f->bytesused = vbuf.bytesused;
+    f->sequence = vbuf.sequence;
+    f->timestamp_ns = v4l2_timestamp_ns(&vbuf);
+    f->index = vbuf.index;
+
+    return FRAME_READY;
+}
+
+static void
+v4l2_source_release(struct frame_source *src, const struct frame *f)
+{
+    struct v4l2_source *v = (struct v4l2_source *)src;
+
+    frame_release(&v->pool, f->index);
+}
+
+// STREAMOFF gives back the buffers the driver has
+static void
+v4l2_source_restart(struct frame_source *src)
+{
+    struct v4l2_source *v = (struct v4l2_source *)src;
+
+    enum v4l2_buf_type vtype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(v->fd, VIDIOC_STREAMOFF, &vtype) == -1) {
+        debugf("VIDIOC_STREAMOFF: %s", strerror(errno));
+    }
+
+    frame_pool_streamoff(&v->pool);
+    frame_pool_requeue(&v->pool, v->fd);
+
+    if (ioctl(v->fd, VIDIOC_STREAMON, &vtype) == -1) {
+        debugf("VIDIOC_STREAMON: %s", strerror(errno));
+    }
+}
+
+static void
+v4l2_source_stop(struct frame_source *src)
+{
+    struct v4l2_source *v = (struct v4l2_source *)src;
+
+    enum v4l2_buf_type vtype = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(v->fd, VIDIOC_STREAMOFF, &vtype) == -1) {
+        errno_exit("VIDIOC_STREAMOFF");
+    }
+}
+
+static void
+v4l2_source_close(struct frame_source *src)
+{
+    struct v4l2_source *v = (struct v4l2_source *)src;
+
+    free_frame_pool(&v->pool);
+    if (close(v->fd) == -1) {
+        perror("cam close");
+    }
+    free(v);
+}
+
+/*
+ * Opens a camera, negotiates the capture mode closest to want and queues
+ * the frame pool.  Exits if the camera can't be used.
+ */
+struct frame_source *
+open_v4l2_source(const char *name, const struct capture_mode *want, bool userptr, int n_buffers)
+{
+    struct v4l2_source *v = calloc(1, sizeof(*v));
+    struct frame_source *src = &v->source;
+    struct capture_mode mode;
+    struct v4l2_format fmt = {};
+
+    v->fd = open(name, O_RDWR | O_NONBLOCK, 0);
+    if (v->fd == -1) {
+        errno_exit((char *)name);
+    }
+    if (!is_capture_device(v->fd)) {
+        SDL_Log("%s isn't a video capture device", name);
+        exit(EXIT_FAILURE);
+    }
+
+    struct capture_mode modes[MAX_CAPTURE_MODES];
+    int n_modes = enum_capture_modes(v->fd, modes);
+    const char *reason;
+    char fourcc[5];
+
+    for (int i = 0; i < n_modes; i++) {
+        debugf("mode: %ux%u@%.1f %s", modes[i].width, modes[i].height, mode_fps(&modes[i]),
+                fourcc_name(modes[i].pixelformat, fourcc));
+    }
+
+    if (n_modes == 0) {
+        // driver doesn't list them, try what was asked for or the old
+        // default
+        mode.pixelformat = want->pixelformat ? want->pixelformat : V4L2_PIX_FMT_YUYV;
+        mode.width = want->width ? want->width : 640;
+        mode.height = want->height ? want->height : 480;
+        mode.interval = want->interval.numerator ? want->interval : (struct v4l2_fract){ 1, 20 };
+        reason = "camera doesn't list its modes";
+    } else {
+        int chosen = choose_capture_mode(modes, n_modes, want,
+                FINISH_LINE_MIN_WIDTH, FINISH_LINE_HEIGHT + FINISH_LINE_MARGIN, &reason);
+        if (chosen < 0) {
+            SDL_Log("no camera mode covers the finish line%s", want->pixelformat || want->width
+                    || want->interval.numerator ? " and matches -f" : "");
+            exit(EXIT_FAILURE);
+        }
+        mode = modes[chosen];
+        if (want->interval.numerator) {
+            mode.interval = want->interval;
+        }
+    }
+
+    SDL_Log("%s: %ux%u@%.1f %s, %s", name, mode.width, mode.height, mode_fps(&mode),
+            fourcc_name(mode.pixelformat, fourcc), reason);
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(v->fd, VIDIOC_G_FMT, &fmt) == -1) {
+        errno_exit("VIDIOC_G_FMT");
+    }
+
+    fmt.fmt.pix.width = mode.width;
+    fmt.fmt.pix.height = mode.height;
+    fmt.fmt.pix.pixelformat = mode.pixelformat;
+    if (ioctl(v->fd, VIDIOC_S_FMT, &fmt) == -1) {
+        errno_exit("VIDIOC_S_FMT");
+    }
+
+    if (ioctl(v->fd, VIDIOC_G_FMT, &fmt) == -1) {
+        errno_exit("VIDIOC_G_FMT");
+    }
+
+    if (fmt.fmt.pix.width != mode.width || fmt.fmt.pix.height != mode.height
+            || fmt.fmt.pix.pixelformat != mode.pixelformat) {
+        SDL_Log("camera didn't take the mode, got %ux%u %s", fmt.fmt.pix.width, fmt.fmt.pix.height,
+                fourcc_name(fmt.fmt.pix.pixelformat, fourcc));
+        exit(EXIT_FAILURE);
+    }
+
+    struct v4l2_streamparm vparm = {};
+    vparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl(v->fd, VIDIOC_G_PARM, &vparm) == -1) {
+        debugf("VIDIOC_G_PARM: %s", strerror(errno));
+    } else if (vparm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) {
+        vparm.parm.capture.timeperframe = mode.interval;
+        if (ioctl(v->fd, VIDIOC_S_PARM, &vparm) == -1) {
+            debugf("VIDIOC_S_PARM: %s", strerror(errno));
+        }
+    }
+    // what the camera actually runs at
+    if (ioctl(v->fd, VIDIOC_G_PARM, &vparm) == 0 && vparm.parm.capture.timeperframe.denominator) {
+        mode.interval = vparm.parm.capture.timeperframe;
+    }
+
+    if (!userptr || !frame_pool_init_userptr(&v->pool, v->fd, n_buffers, fmt.fmt.pix.sizeimage)) {
+        if (userptr) {
+            SDL_Log("USERPTR not supported by the camera, using MMAP");
+        }
+        frame_pool_init_mmap(&v->pool, v->fd, n_buffers);
+    }
+    debugf("camera buffers: %d %s", v->pool.n_buffers, v->pool.memory == V4L2_MEMORY_USERPTR ? "userptr" : "mmap");
+
+
+    frame_pool_queue_all(&v->pool, v->fd);
+
+    src->pixelformat = fmt.fmt.pix.pixelformat;
+    src->width = fmt.fmt.pix.width;
+    src->height = fmt.fmt.pix.height;
+    src->bytesperline = fmt.fmt.pix.bytesperline;
+    src->sizeimage = fmt.fmt.pix.sizeimage;
+    src->interval = mode.interval;
+    src->start = v4l2_source_start;
+    src->next = v4l2_source_next;
+    src->release = v4l2_source_release;
+    src->restart = v4l2_source_restart;
+    src->stop = v4l2_source_stop;
+    src->close = v4l2_source_close;
+
+    return src;
+}
+
+/*
+ * Recording container written by the recorder (-o, -O).  A header with the
+ * capture mode, then each frame as it came from the camera (or its luma
+ * plane) after a small header with its size, sequence and capture
+ * timestamp, 8 byte aligned.  Closing the recording appends an index of
+ * every frame and a trailer at the very end pointing to it, so any frame is
+ * found from the mapped file without reading the others.  A recording that
+ * was never closed is indexed from the frame headers instead.
+ */
+#define RECORD_MAGIC "RACEREC1"
+#define RECORD_INDEX_MAGIC "RACEIDX1"
+#define RECORD_FRAME_MAGIC 0x454d5246 // FRME
+
+struct record_header {
+    char magic[8];
+    u32 pixelformat;
+    u32 width;
+    u32 height;
+    u32 interval_numerator;
+    u32 interval_denominator;
+    // bytes per row of GREY and YUYV frames, 0 when the rows are packed
+    u32 bytesperline;
+    u32 reserved[8];
+};
+
+struct record_frame {
+    u32 magic;
+    u32 size;
+    u32 sequence;
+    u32 reserved;
+    u64 timestamp_ns;
+};
+
+// also what file sources index every recording with
+struct record_entry {
+    // of the frame data
+    u64 offset;
+    u64 timestamp_ns;
+    u32 size;
+    u32 sequence;
+};
+
+struct record_trailer {
+    char magic[8];
+    u64 index_offset;
+    u64 n_frames;
+};
+
+static inline u64
+record_frame_size(u32 size)
+{
+    return sizeof(struct record_frame) + (((u64)size + 7) & ~(u64)7);
+}
+
+/*
+ * A recording replayed from a file through mmap so frames go to the
+ * pipeline without a copy.  Y4M is replayed as GREY from the luma plane,
+ * each FRAME can carry its capture time in ns as an Xts= parameter,
+ * otherwise frames are at the Y4M frame rate.  The recorder's container
+ * replays in the format it was recorded in.  Anything else is raw YUYV
+ * frames of the -f size and rate.
+ */
+struct file_source {
+    struct frame_source source;
+    const u8 *map;
+    size_t size;
+
+    int n_frames;
+    size_t frame_size;
+    // where each frame's data starts, its size and when it was captured.
+    // Points into the map for a closed recording, otherwise owned.
+    struct record_entry *frames;
+    bool own_frames;
+    int next_frame;
+
+    enum replay_mode mode;
+    // monotonic_ns when the first frame was replayed in real time
+    u64 replay_start_ns;
+    // frames a single stepped replay may go on
+    _Atomic int steps;
+};
+
+// files without timestamps count from here.  A frame timestamp of 0 means
+// the source doesn't have one and the capture thread uses the clock.
+#define FILE_START_NS 1000000000
+
+static void
+file_source_add(struct file_source *fs, size_t offset, u64 timestamp_ns, u32 size, u32 sequence)
+{
+    // doubles at powers of 2
+    if ((fs->n_frames & (fs->n_frames - 1)) == 0) {
+        int n = fs->n_frames ? 2*fs->n_frames : 1;
+        fs->frames = realloc(fs->frames, n*sizeof(fs->frames[0]));
+        if (!fs->frames) {
+            errno_exit("realloc");
+        }
+        fs->own_frames = true;
+    }
+
+    fs->frames[fs->n_frames++] = (struct record_entry){
+        .offset = offset, .timestamp_ns = timestamp_ns, .size = size, .sequence = sequence,
+    };
+}
+
+static u64
+interval_ns(struct v4l2_fract interval)
+{
+    return interval.denominator ? 1000000000ull*interval.numerator/interval.denominator : 0;
+}
+
+// frame offsets and timestamps of a Y4M file, false if the header isn't
+// understood
+bool
+y4m_index(struct file_source *fs)
+{
+    struct frame_source *src = &fs->source;
+    const char *p = (const char *)fs->map;
+    const char *end = p + fs->size;
+
+    const char *eol = memchr(p, '\n', fs->size);
+    if (!eol || eol - p > 255) {
+        return false;
+    }
+
+    char header[256];
+    memcpy(header, p, eol - p);
+    header[eol - p] = '\0';
+
+    // 420jpeg when there's no C
+    const char *chroma = "420";
+    u32 fps_num = 30;
+    u32 fps_den = 1;
+    char *save;
+    for (char *t = strtok_r(header + strlen("YUV4MPEG2"), " ", &save); t; t = strtok_r(NULL, " ", &save)) {
+        if (t[0] == 'W') {
+            src->width = strtoul(t + 1, NULL, 10);
+        } else if (t[0] == 'H') {
+            src->height = strtoul(t + 1, NULL, 10);
+        } else if (t[0] == 'F') {
+            sscanf(t + 1, "%u:%u", &fps_num, &fps_den);
+        } else if (t[0] == 'C') {
+            chroma = (const char *)p + (t + 1 - header);
+        }
+    }
+
+    const size_t w = src->width;
+    const size_t h = src->height;
+    if (strncmp(chroma, "mono", 4) == 0) {
+        fs->frame_size = w*h;
+    } else if (strncmp(chroma, "420", 3) == 0) {
+        fs->frame_size = w*h + 2*((w + 1)/2)*((h + 1)/2);
+    } else if (strncmp(chroma, "422", 3) == 0) {
+        fs->frame_size = w*h + 2*((w + 1)/2)*h;
+    } else if (strncmp(chroma, "444 ", 4) == 0 || strncmp(chroma, "444\n", 4) == 0) {
+        fs->frame_size = 3*w*h;
+    } else {
+        debugf("y4m chroma not supported: %.8s", chroma);
+        return false;
+    }
+    if (!w || !h || !fps_num || !fps_den) {
+        return false;
+    }
+
+    src->pixelformat = V4L2_PIX_FMT_GREY;
+    src->interval = (struct v4l2_fract){ fps_den, fps_num };
+    const u64 frame_ns = interval_ns(src->interval);
+
+    p = eol + 1;
+    while (end - p > 5 && memcmp(p, "FRAME", 5) == 0) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol || (size_t)(end - eol - 1) < fs->frame_size) {
+            break;
+        }
+
+        u64 ts = FILE_START_NS + fs->n_frames*frame_ns;
+        for (const char *q = p + 5; q + 4 < eol; q++) {
+            if (memcmp(q, " Xts=", 5) == 0) {
+                ts = strtoull(q + 5, NULL, 10);
+                break;
+            }
+        }
+
+        file_source_add(fs, eol + 1 - (const char *)fs->map, ts, fs->frame_size, fs->n_frames);
+        p = eol + 1 + fs->frame_size;
+    }
+
+    return fs->n_frames > 0;
+}
+
+// the frames of a recorder container from its index, or its frame headers
+// if it wasn't closed
+bool
+record_index(struct file_source *fs)
+{
+    struct frame_source *src = &fs->source;
+    const struct record_header *h = (const struct record_header *)fs->map;
+    src->pixelformat = h->pixelformat;
+    src->width = h->width;
+    src->height = h->height;
+    src->interval = (struct v4l2_fract){ h->interval_numerator, h->interval_denominator };
+    src->bytesperline = h->bytesperline;
+
+    // the capture thread reads whole uncompressed frames
+    u64 min_size = 1;
+    if (h->pixelformat == V4L2_PIX_FMT_YUYV || h->pixelformat == V4L2_PIX_FMT_GREY) {
+        min_size = (u64)source_stride(src)*h->height;
+    }
+
+    const struct record_trailer *t = (const struct record_trailer *)(fs->map + fs->size - sizeof(*t));
+    if (fs->size >= sizeof(*h) + sizeof(*t) && memcmp(t->magic, RECORD_INDEX_MAGIC, 8) == 0
+            && t->index_offset >= sizeof(*h) && t->index_offset % 8 == 0
+            && t->index_offset <= fs->size - sizeof(*t)
+            && t->n_frames <= (fs->size - sizeof(*t) - t->index_offset)/sizeof(struct record_entry)) {
+        fs->frames = (struct record_entry *)(fs->map + t->index_offset);
+        fs->own_frames = false;
+        fs->n_frames = t->n_frames;
+        for (int i = 0; i < fs->n_frames; i++) {
+            const struct record_entry *e = &fs->frames[i];
+            if (e->size < min_size || e->offset > t->index_offset || e->size > t->index_offset - e->offset) {
+                return false;
+            }
+        }
+    } else {
+        SDL_Log("recording has no index, it wasn't closed, reading the frame headers");
+        u64 offset = sizeof(*h);
+        while (offset + sizeof(struct record_frame) <= fs->size) {
+            const struct record_frame *rf = (const struct record_frame *)(fs->map + offset);
+            if (rf->magic != RECORD_FRAME_MAGIC || rf->size < min_size
+                    || record_frame_size(rf->size) > fs->size - offset) {
+                break;
+            }
+            file_source_add(fs, offset + sizeof(*rf), rf->timestamp_ns, rf->size, rf->sequence);
+            offset += record_frame_size(rf->size);
+        }
+    }
+
+    return fs->n_frames > 0 && interval_ns(src->interval) > 0;
+}
+
+static void
+file_source_start(struct frame_source *src)
+{
+    (void)src;
+}
+
+static enum frame_status
+file_source_next(struct frame_source *src, int wake_fd, int timeout_ms, struct frame *f)
+{
+    struct file_source *fs = (struct file_source *)src;
+
+    if (fs->next_frame == fs->n_frames) {
+        return FRAME_END;
+    }
+
+    const struct record_entry *e = &fs->frames[fs->next_frame];
+    const u64 ts = e->timestamp_ns;
+    if (fs->mode == REPLAY_REALTIME) {
+        u64 now = monotonic_ns();
+        if (!fs->replay_start_ns) {
+            fs->replay_start_ns = now;
+        }
+        u64 due = fs->replay_start_ns + (ts > fs->frames[0].timestamp_ns ? ts - fs->frames[0].timestamp_ns : 0);
+        if (now < due) {
+            u64 wait_ms = (due - now + 999999)/1000000;
+            wait_frame(-1, wake_fd, wait_ms < (u64)timeout_ms ? (int)wait_ms : timeout_ms);
+            if (monotonic_ns() < due) {
+                return FRAME_NONE;
+            }
+        }
+    } else if (fs->mode == REPLAY_STEP) {
+        if (atomic_load(&fs->steps) == 0) {
+            wait_frame(-1, wake_fd, timeout_ms);
+            if (atomic_load(&fs->steps) == 0) {
+                return FRAME_NONE;
+            }
+        }
+        atomic_fetch_sub(&fs->steps, 1);
+    }
+
+    f->data = fs->map + e->offset;
+    f->bytesused = e->size;
+    f->sequence = e->sequence;
+    f->timestamp_ns = ts;
+    f->index = fs->next_frame;
+    fs->next_frame++;
+
+    return FRAME_READY;
+}
+
+// the mapping outlives every frame
+static void
+file_source_release(struct frame_source *src, const struct frame *f)
+{
+    (void)src;
+    (void)f;
+}
+
+static void
+file_source_step(struct frame_source *src)
+{
+    struct file_source *fs = (struct file_source *)src;
+
+    atomic_fetch_add(&fs->steps, 1);
+}
+
+static void
+file_source_close(struct frame_source *src)
+{
+    struct file_source *fs = (struct file_source *)src;
+
+    if (munmap((void *)fs->map, fs->size) == -1) {
+        perror("munmap");
+    }
+    if (fs->own_frames) {
+        free(fs->frames);
+    }
+    free(fs);
+}
+
+/*
+ * Opens a recording to replay.  Raw YUYV needs the size from want, the rate
+ * defaults to 30fps.  Returns NULL if the file can't be used.
+ */
+struct frame_source *
+open_file_source(const char *name, const struct capture_mode *want, enum replay_mode mode)
+{
+    int fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        SDL_Log("%s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        SDL_Log("%s: empty or can't stat", name);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        SDL_Log("%s: mmap: %s", name, strerror(errno));
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    struct file_source *fs = calloc(1, sizeof(*fs));
+    struct frame_source *src = &fs->source;
+    fs->map = map;
+    fs->size = st.st_size;
+    fs->mode = mode;
+
+    src->recorded = true;
+    src->start = file_source_start;
+    src->next = file_source_next;
+    src->release = file_source_release;
+    src->step = mode == REPLAY_STEP ? file_source_step : NULL;
+    src->stop = file_source_start;
+    src->close = file_source_close;
+
+    bool ok;
+    if (fs->size > 9 && memcmp(map, "YUV4MPEG2", 9) == 0) {
+        ok = y4m_index(fs);
+    } else if (fs->size >= sizeof(struct record_header) && memcmp(map, RECORD_MAGIC, 8) == 0) {
+        ok = record_index(fs);
+    } else {
+        src->pixelformat = V4L2_PIX_FMT_YUYV;
+        src->width = want->width;
+        src->height = want->height;
+        src->interval = want->interval.numerator ? want->interval : (struct v4l2_fract){ 1, 30 };
+        fs->frame_size = (size_t)src->width*src->height*2;
+
+        ok = fs->frame_size > 0;
+        for (size_t offset = 0; ok && offset + fs->frame_size <= fs->size; offset += fs->frame_size) {
+            file_source_add(fs, offset, FILE_START_NS + fs->n_frames*interval_ns(src->interval),
+                    fs->frame_size, fs->n_frames);
+        }
+        if (!ok) {
+            SDL_Log("%s: raw YUYV needs the size, like -f 640x480@30", name);
+        }
+        ok = ok && fs->n_frames > 0;
+    }
+
+    if (!ok || src->width < FINISH_LINE_MIN_WIDTH || src->height < FINISH_LINE_HEIGHT + FINISH_LINE_MARGIN) {
+        SDL_Log("%s: not a recording that covers the finish line", name);
+        src->close(src);
+        return NULL;
+    }
+
+    char fourcc[5];
+    SDL_Log("%s: %d frames %ux%u@%.1f %s", name, fs->n_frames, src->width, src->height,
+            mode_fps(&(struct capture_mode){ .interval = src->interval }),
+            fourcc_name(src->pixelformat, fourcc));
+
+    return src;
+}
+
+/*
+ * Every camera's crossings merged on one race timeline.  Frame timestamps
+ * are all CLOCK_MONOTONIC, from the driver or taken at DQBUF, so crossings
+ * from different cameras compare directly.  Finish cameras start and end
+ * laps, split cameras time a point on the lap.  More than one finish camera
+ * sees the same crossing from different angles, the earliest one counts.
+ * Crossings arrive from the capture threads a frame or so late and not in
+ * time order, each only after its sub-frame estimate.
+ */
+#define MAX_CAMERAS 4
+#define RACE_LAPS 3
+
+enum camera_role {
+    CAMERA_FINISH,
+    CAMERA_SPLIT,
+};
+
+struct race {
+    SDL_mutex *mutex;
+
+    int n_cameras;
+    enum camera_role roles[MAX_CAMERAS];
+    // laps shorter than this are the same car seen again, ns
+    u64 min_lap_ns;
+
+    // finish line crossings, the first is the race start.  A lap runs from
+    // one crossing to the next.
+    u64 crossings[RACE_LAPS + 1];
+    int n_crossings;
+    // crossing time of each split camera on each lap, 0 for none
+    u64 splits[RACE_LAPS][MAX_CAMERAS];
+    bool logged;
+    // finished races are appended here when not NULL
+    const char *log_name;
+    // a line for every start, lap, split and finish when not NULL
+    FILE *events;
+};
+
+void
+init_race(struct race *r, int n_cameras, const enum camera_role *roles)
+{
+    *r = (struct race){};
+    r->mutex = SDL_CreateMutex();
+    r->n_cameras = n_cameras;
+    memcpy(r->roles, roles, n_cameras*sizeof(roles[0]));
+    r->min_lap_ns = 2000000000ull;
+}
+
+void
+race_reset(struct race *r)
+{
+    SDL_LockMutex(r->mutex);
+    r->n_crossings = 0;
+    memset(r->splits, 0, sizeof(r->splits));
+    r->logged = false;
+    if (r->events) {
+        fprintf(r->events, "reset\n");
+        fflush(r->events);
+    }
+    SDL_UnlockMutex(r->mutex);
+}
+
+// the event for finish line crossing k.  An earlier crossing from another
+// camera corrects the last one.
+static void
+race_crossing_event(struct race *r, int k, int camera, bool corrected)
+{
+    if (!r->events) {
+        return;
+    }
+
+    const char *note = corrected ? " corrected" : "";
+    if (k == 0) {
+        fprintf(r->events, "start %.6f camera %d%s\n", r->crossings[0]/1e9, camera, note);
+    } else {
+        fprintf(r->events, "lap %d %.3f camera %d%s\n", k, (r->crossings[k] - r->crossings[k - 1])/1e9, camera, note);
+    }
+    if (k == RACE_LAPS) {
+        fprintf(r->events, "finish %.3f%s\n", (r->crossings[k] - r->crossings[0])/1e9, note);
+    }
+    fflush(r->events);
+}
+
+// the lap a crossing at ns is on, -1 before the race or after the last lap
+static int
+race_lap_at(const struct race *r, u64 ns)
+{
+    if (r->n_crossings == 0 || ns < r->crossings[0]) {
+        return -1;
+    }
+
+    int lap = 0;
+    while (lap + 1 < r->n_crossings && ns >= r->crossings[lap + 1]) {
+        lap++;
+    }
+
+    return lap < RACE_LAPS ? lap : -1;
+}
+
+// adds a crossing by camera at ns
+void
+race_crossing(struct race *r, int camera, u64 ns)
+{
+    SDL_LockMutex(r->mutex);
+
+    if (r->roles[camera] == CAMERA_SPLIT) {
+        // the first time past the split on each lap
+        int lap = race_lap_at(r, ns);
+        if (lap >= 0 && !r->splits[lap][camera]) {
+            r->splits[lap][camera] = ns;
+            if (r->events) {
+                fprintf(r->events, "split %d %.3f camera %d\n", lap + 1, (ns - r->crossings[lap])/1e9, camera);
+                fflush(r->events);
+            }
+        }
+    } else if (r->n_crossings > 0 && ns < r->crossings[r->n_crossings - 1] + r->min_lap_ns
+            && ns + r->min_lap_ns > r->crossings[r->n_crossings - 1]) {
+        // another finish camera or the same car still on the line
+        if (ns < r->crossings[r->n_crossings - 1]) {
+            r->crossings[r->n_crossings - 1] = ns;
+            race_crossing_event(r, r->n_crossings - 1, camera, true);
+        } else {
+            debug("ignoring too fast lap!!!");
+        }
+    } else if (r->n_crossings <= RACE_LAPS
+            && (r->n_crossings == 0 || ns > r->crossings[r->n_crossings - 1])) {
+        r->crossings[r->n_crossings++] = ns;
+        race_crossing_event(r, r->n_crossings - 1, camera, false);
+    }
+
+    SDL_UnlockMutex(r->mutex);
+}
+
+// lap time in seconds, the current lap is timed to now_ns
+static double
+race_lap_time(const struct race *r, int lap, u64 now_ns)
+{
+    u64 end = lap + 1 < r->n_crossings ? r->crossings[lap + 1] : now_ns;
+
+    return end > r->crossings[lap] ? (end - r->crossings[lap])/1e9 : 0.0;
+}
+
+/*
+ * Lap times with splits as of now_ns on the view of the overlay.  Once the
+ * race is over and no other finish camera can still move the last crossing
+ * it's appended to the race's log.
+ */
+void
+race_overlay(struct race *r, struct overlay *o, enum overlay_view view, u64 now_ns)
+{
+    SDL_LockMutex(r->mutex);
+
+    int n_laps = r->n_crossings < RACE_LAPS ? r->n_crossings : RACE_LAPS;
+    bool over = r->n_crossings == RACE_LAPS + 1;
+    int current = over ? -1 : r->n_crossings - 1;
+
+    int fastest = -1;
+    for (int i = 0; i < n_laps; i++) {
+        if (i != current && (fastest < 0 || race_lap_time(r, i, now_ns) < race_lap_time(r, fastest, now_ns))) {
+            fastest = i;
+        }
+    }
+
+    int y = 2;
+    double total = 0.0;
+    char text[64];
+    for (int i = 0; i < n_laps; i++) {
+        double lap_time = race_lap_time(r, i, now_ns);
+        total += lap_time;
+
+        int len = snprintf(text, sizeof(text), "lap %d: %.3f", i + 1, lap_time);
+        for (int c = 0; c < r->n_cameras; c++) {
+            if (r->roles[c] == CAMERA_SPLIT && len < (int)sizeof(text)) {
+                if (r->splits[i][c]) {
+                    len += snprintf(text + len, sizeof(text) - len, " %.3f",
+                            (r->splits[i][c] - r->crossings[i])/1e9);
+                } else {
+                    len += snprintf(text + len, sizeof(text) - len, " -");
+                }
+            }
+        }
+        if (i == fastest && len < (int)sizeof(text)) {
+            snprintf(text + len, sizeof(text) - len, " fastest");
+        }
+        y += overlay_text(o, view, 2, y, &GREEN, text);
+    }
+
+    if (n_laps > 1 || over) {
+        snprintf(text, sizeof(text), "total: %.3f", total);
+        overlay_text(o, view, 2, y, &GREEN, text);
+    }
+
+    if (over && !r->logged && now_ns > r->crossings[RACE_LAPS] + r->min_lap_ns) {
+        r->logged = true;
+        debug("XXX race is over XXXX");
+        FILE *f = r->log_name ? fopen(r->log_name, "a") : NULL;
+        if (f) {
+            for (int i = 0; i < RACE_LAPS; i++) {
+                fprintf(f, "%.3f,", race_lap_time(r, i, now_ns));
+            }
+            fprintf(f, "%.3f\n", total);
+            fclose(f);
+        }
+    }
+
+    SDL_UnlockMutex(r->mutex);
+}
+
+/*
+ * Photo finish.  The capture thread copies every frame as it came from the
+ * camera into a preallocated ring holding the frames around a crossing, pre
+ * before it and post after.  When the last frame after a crossing is in, the
+ * ring's buffers are swapped with a spare set so the window is frozen without
+ * a copy, and a background thread saves it as Y4M with the capture
+ * timestamps (replayable with -d).  The memory can be locked so the copy
+ * never faults.  A crossing while the last window is still being saved is
+ * counted as missed.
+ */
+struct finish_frame {
+    u8 *data;
+    u32 bytesused;
+    u32 sequence;
+    u64 timestamp_ns;
+};
+
+struct photo_finish {
+    int camera;
+    int pre;
+    int post;
+    // pre + post + 1 frames, the newest at (n_frames - 1) % n_slots
+    int n_slots;
+    struct finish_frame *ring;
+    u64 n_frames;
+    // frames still to come after a crossing, -1 when not triggered
+    int post_remaining;
+    u64 trigger_ns;
+
+    // the frozen window, owned by the save thread while busy
+    struct finish_frame *window;
+    int n_window;
+    u64 window_trigger_ns;
+    _Atomic bool busy;
+
+    u32 pixelformat;
+    u32 width;
+    u32 height;
+    // bytes per row of GREY and YUYV frames
+    u32 stride;
+    struct v4l2_fract interval;
+    size_t slot_size;
+    u8 *memory;
+    size_t memory_size;
+    bool locked;
+
+    int wake_fd;
+    _Atomic bool running;
+    SDL_Thread *thread;
+
+    // saved here, NULL for the current directory
+    const char *dir;
+    _Atomic u64 saved;
+    u64 missed;
+    // frames bigger than the driver said, too big for a slot
+    u64 too_big;
+};
+
+// pre:post frames with an optional :lock, false if it doesn't parse
+bool
+parse_photo_finish(const char *spec, int *pre, int *post, bool *lock)
+{
+    char lock_text[8] = "";
+    int n = sscanf(spec, "%d:%d:%7s", pre, post, lock_text);
+    if (n < 2 || *pre < 0 || *post < 0 || *pre + *post > 10000) {
+        return false;
+    }
+    *lock = n == 3;
+
+    return n == 2 || strcmp(lock_text, "lock") == 0;
+}
+
+struct photo_finish *
+new_photo_finish(int camera, const struct frame_source *src, int pre, int post, bool lock)
+{
+    struct photo_finish *pf = calloc(1, sizeof(*pf));
+    pf->camera = camera;
+    pf->pre = pre;
+    pf->post = post;
+    pf->n_slots = pre + post + 1;
+    pf->post_remaining = -1;
+    pf->pixelformat = src->pixelformat;
+    pf->width = src->width;
+    pf->height = src->height;
+    pf->interval = src->interval;
+    // rows may be padded.  MJPEG frames are kept compressed, they're nearly
+    // always smaller than YUYV and the driver's sizeimage bounds them.
+    pf->stride = source_stride(src);
+    pf->slot_size = (size_t)src->width*src->height*2;
+    if (src->pixelformat != V4L2_PIX_FMT_MJPEG) {
+        pf->slot_size = (size_t)pf->stride*src->height;
+    }
+    if (src->sizeimage > pf->slot_size) {
+        pf->slot_size = src->sizeimage;
+    }
+
+    // the ring and the spare window, touched so it's all allocated now
+    pf->memory_size = 2*pf->n_slots*pf->slot_size;
+    pf->memory = malloc(pf->memory_size);
+    pf->ring = calloc(pf->n_slots, sizeof(pf->ring[0]));
+    pf->window = calloc(pf->n_slots, sizeof(pf->window[0]));
+    if (!pf->memory || !pf->ring || !pf->window) {
+        errno_exit("photo finish malloc");
+    }
+    memset(pf->memory, 0, pf->memory_size);
+    for (int i = 0; i < pf->n_slots; i++) {
+        pf->ring[i].data = pf->memory + i*pf->slot_size;
+        pf->window[i].data = pf->memory + (pf->n_slots + i)*pf->slot_size;
+    }
+
+    if (lock) {
+        if (mlock(pf->memory, pf->memory_size) == 0) {
+            pf->locked = true;
+        } else {
+            SDL_Log("camera %d photo finish not locked in memory: %s", camera, strerror(errno));
+        }
+    }
+    SDL_Log("camera %d photo finish %d frames before and %d after, %.1f MB%s", camera, pre, post,
+            pf->memory_size/1e6, pf->locked ? " locked" : "");
+
+    return pf;
+}
+
+// swaps the ring's buffers with the window's, oldest first
+static void
+photo_finish_freeze(struct photo_finish *pf)
+{
+    pf->post_remaining = -1;
+    if (atomic_load_explicit(&pf->busy, memory_order_acquire)) {
+        pf->missed++;
+        SDL_Log("camera %d photo finish missed, still saving the last one", pf->camera);
+        return;
+    }
+
+    pf->n_window = pf->n_frames < (u64)pf->n_slots ? (int)pf->n_frames : pf->n_slots;
+    for (int i = 0; i < pf->n_window; i++) {
+        struct finish_frame *slot = &pf->ring[(pf->n_frames - pf->n_window + i) % pf->n_slots];
+        struct finish_frame spare = pf->window[i];
+        pf->window[i] = *slot;
+        slot->data = spare.data;
+    }
+    pf->window_trigger_ns = pf->trigger_ns;
+
+    atomic_store_explicit(&pf->busy, true, memory_order_release);
+    wake_eventfd(pf->wake_fd);
+}
+
+// capture thread, every frame before it's released
+void
+photo_finish_add(struct photo_finish *pf, const struct frame *f, u64 frame_ns)
+{
+    if (f->bytesused > pf->slot_size) {
+        if (!pf->too_big++) {
+            SDL_Log("camera %d photo finish frame of %u bytes doesn't fit a %zu byte slot, not kept",
+                    pf->camera, f->bytesused, pf->slot_size);
+        }
+        return;
+    }
+
+    struct finish_frame *slot = &pf->ring[pf->n_frames % pf->n_slots];
+    memcpy(slot->data, f->data, f->bytesused);
+    slot->bytesused = f->bytesused;
+    slot->sequence = f->sequence;
+    slot->timestamp_ns = frame_ns;
+    pf->n_frames++;
+
+    if (pf->post_remaining > 0 && --pf->post_remaining == 0) {
+        photo_finish_freeze(pf);
+    }
+}
+
+// capture thread, a crossing in the newest frame.  Crossings within the
+// window of the last one are part of it.
+void
+photo_finish_trigger(struct photo_finish *pf, u64 trigger_ns)
+{
+    if (pf->post_remaining >= 0) {
+        return;
+    }
+
+    pf->trigger_ns = trigger_ns;
+    pf->post_remaining = pf->post;
+    if (pf->post == 0) {
+        photo_finish_freeze(pf);
+    }
+}
+
+// the frozen window as Y4M, 4:2:2 planar or mono for GREY
+static bool
+save_photo_finish(struct photo_finish *pf, jpeg_decoder *jpeg, u8 *luma, u8 *yuyv, u8 *planes)
+{
+    const u32 w = pf->width;
+    const u32 h = pf->height;
+    const bool mono = pf->pixelformat == V4L2_PIX_FMT_GREY;
+
+    char filename[320];
+    snprintf(filename, sizeof(filename), "%s%sfinish-%d-%lu.y4m", pf->dir ? pf->dir : "", pf->dir ? "/" : "",
+            pf->camera, pf->window_trigger_ns);
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        SDL_Log("unable to save %s: %s", filename, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 %s\n", w, h, pf->interval.denominator,
+            pf->interval.numerator, mono ? "Cmono" : "C422");
+    int n_written = 0;
+    for (int i = 0; i < pf->n_window; i++) {
+        const struct finish_frame *frame = &pf->window[i];
+        size_t size = mono ? w*h : 2*w*h;
+        const u8 *data = frame->data;
+        u32 stride = pf->stride;
+        if (pf->pixelformat == V4L2_PIX_FMT_MJPEG) {
+            if (!jpeg_parse(jpeg, data, frame->bytesused) || jpeg->width != (int)w || jpeg->height != (int)h
+                    || !jpeg_decode_frame(jpeg, luma, w, yuyv, 2*w)) {
+                debugf("photo finish bad MJPEG frame: %u", frame->sequence);
+                continue;
+            }
+            data = yuyv;
+            stride = 2*w;
+        }
+
+        if (!mono) {
+            // Y0 U Y1 V to Y, U and V planes
+            u8 *y = planes;
+            u8 *u = planes + w*h;
+            u8 *v = u + w/2*h;
+            for (u32 row = 0; row < h; row++) {
+                const u8 *in = data + (size_t)row*stride;
+                for (u32 x = 0; x < w; x += 2) {
+                    *y++ = in[x*2];
+                    *u++ = in[x*2 + 1];
+                    *y++ = in[x*2 + 2];
+                    *v++ = in[x*2 + 3];
+                }
+            }
+            data = planes;
+        } else if (stride != w) {
+            for (u32 row = 0; row < h; row++) {
+                memcpy(planes + (size_t)row*w, data + (size_t)row*stride, w);
+            }
+            data = planes;
+        }
+
+        fprintf(file, "FRAME Xts=%lu Xseq=%u\n", frame->timestamp_ns, frame->sequence);
+        if (fwrite(data, size, 1, file) == 1) {
+            n_written++;
+        }
+    }
+
+    bool ok = fclose(file) == 0 && n_written > 0;
+    if (ok) {
+        SDL_Log("camera %d photo finish saved %d frames to %s", pf->camera, n_written, filename);
+    }
+
+    return ok;
+}
+
+int
+run_photo_finish(void *data)
+{
+    struct photo_finish *pf = data;
+
+    jpeg_decoder jpeg;
+    jpeg_init(&jpeg);
+    u8 *luma = malloc((size_t)pf->width*pf->height);
+    u8 *yuyv = malloc((size_t)pf->width*pf->height*2);
+    u8 *planes = malloc((size_t)pf->width*pf->height*2);
+
+    // a window frozen before stop_photo_finish is still saved
+    for (;;) {
+        if (atomic_load_explicit(&pf->busy, memory_order_acquire)) {
+            if (save_photo_finish(pf, &jpeg, luma, yuyv, planes)) {
+                atomic_fetch_add(&pf->saved, 1);
+            }
+            atomic_store_explicit(&pf->busy, false, memory_order_release);
+            continue;
+        }
+        if (!atomic_load(&pf->running)) {
+            break;
+        }
+
+        u64 count;
+        if (read(pf->wake_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+            debugf("eventfd read: %s", strerror(errno));
+            break;
+        }
+    }
+
+    free(luma);
+    free(yuyv);
+    free(planes);
+
+    return 0;
+}
+
+void
+start_photo_finish(struct photo_finish *pf)
+{
+    pf->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (pf->wake_fd == -1) {
+        errno_exit("eventfd");
+    }
+    atomic_init(&pf->running, true);
+    pf->thread = SDL_CreateThread(run_photo_finish, "photo finish", pf);
+}
+
+// after the capture thread is done, saves a frozen window and frees it
+void
+stop_photo_finish(struct photo_finish *pf)
+{
+    atomic_store(&pf->running, false);
+    wake_eventfd(pf->wake_fd);
+    if (pf->thread) {
+        SDL_WaitThread(pf->thread, NULL);
+    }
+    close(pf->wake_fd);
+
+    if (pf->missed || pf->too_big) {
+        SDL_Log("camera %d photo finish saved %lu, missed %lu, %lu frames too big", pf->camera,
+                atomic_load(&pf->saved), pf->missed, pf->too_big);
+    }
+
+    if (pf->locked) {
+        munlock(pf->memory, pf->memory_size);
+    }
+    free(pf->memory);
+    free(pf->ring);
+    free(pf->window);
+    free(pf);
+}
+
+/*
+ * Streaming recorder.  The capture thread appends each frame with its
+ * header to a large preallocated chunk, a copy and no system calls, and a
+ * full chunk is written at its file offset while the next fills.  Writes go
+ * through io_uring, set up with the raw system calls, so submitting and
+ * completing them never blocks the capture thread.  Without io_uring a few
+ * threads pwrite the chunks instead.  A frame that finds every chunk still
+ * being written is dropped and counted rather than waiting on the disk.
+ * The index is written when the recording is closed, see record_index.
+ */
+#define RECORD_CHUNK_SIZE (8 << 20)
+#define RECORD_CHUNKS 4
+#define RECORD_WRITERS 2
+
+struct record_chunk {
+    u8 *data;
+    size_t used;
+    u64 offset;
+    // capture thread only, full and handed off until it's filled again
+    bool submitted;
+    // submitted and not completed, cleared by whoever completes it
+    _Atomic bool writing;
+};
+
+// the mapped io_uring submission and completion rings
+struct uring {
+    int fd;
+    u32 *sq_head;
+    u32 *sq_tail;
+    u32 *sq_mask;
+    u32 *sq_array;
+    struct io_uring_sqe *sqes;
+    u32 *cq_head;
+    u32 *cq_tail;
+    u32 *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+struct recorder {
+    char name[256];
+    int fd;
+    int camera;
+    size_t chunk_size;
+    struct record_chunk chunks[RECORD_CHUNKS];
+    // the chunk being filled
+    int current;
+    // bytes in the file once every chunk is written
+    u64 size;
+
+    struct record_entry *index;
+    u64 n_index;
+    u64 max_index;
+
+    // io_uring when fd isn't -1, otherwise the writer threads take chunks
+    // from the queue, a token on work_fd for each
+    struct uring ring;
+    int in_flight;
+    SDL_mutex *mutex;
+    int queue[RECORD_CHUNKS];
+    int queue_head;
+    int queue_tail;
+    int work_fd;
+    SDL_Thread *writers[RECORD_WRITERS];
+
+    u64 start_ns;
+    u64 dropped;
+    _Atomic u64 write_errors;
+};
+
+static bool
+uring_init(struct uring *r, u32 entries)
+{
+    struct io_uring_params p = {};
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd == -1) {
+        return false;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries*sizeof(u32);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) {
+            r->sq_map_size = r->cq_map_size;
+        }
+        r->cq_map_size = r->sq_map_size;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = r->sq_map;
+    if (r->sq_map != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        r->fd = -1;
+        return false;
+    }
+
+    u8 *sq = r->sq_map;
+    r->sq_head = (u32 *)(sq + p.sq_off.head);
+    r->sq_tail = (u32 *)(sq + p.sq_off.tail);
+    r->sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (u32 *)(sq + p.sq_off.array);
+    u8 *cq = r->cq_map;
+    r->cq_head = (u32 *)(cq + p.cq_off.head);
+    r->cq_tail = (u32 *)(cq + p.cq_off.tail);
+    r->cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return true;
+}
+
+// IORING_OP_WRITE and the probe are both 5.6, before that setup works but
+// every write fails with EINVAL
+static bool
+uring_supports(struct uring *r, u8 op)
+{
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } p = {};
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, &p, 256) == -1) {
+        return false;
+    }
+
+    return op <= p.probe.last_op && (p.probe.ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static void
+uring_close(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_map != r->sq_map) {
+        munmap(r->cq_map, r->cq_map_size);
+    }
+    munmap(r->sq_map, r->sq_map_size);
+    close(r->fd);
+}
+
+// the whole buffer at offset, false on an error
+static bool
+pwrite_all(int fd, const u8 *data, size_t size, u64 offset)
+{
+    while (size) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+static void
+record_chunk_done(struct recorder *rec, struct record_chunk *c, bool ok)
+{
+    if (!ok) {
+        atomic_fetch_add(&rec->write_errors, 1);
+        SDL_Log("camera %d recording write at %lu failed: %s", rec->camera, c->offset, strerror(errno));
+    }
+    atomic_store_explicit(&c->writing, false, memory_order_release);
+}
+
+// completed io_uring writes, waits for at least min_complete
+static void
+record_reap(struct recorder *rec, int min_complete)
+{
+    struct uring *r = &rec->ring;
+    if (min_complete && syscall(__NR_io_uring_enter, r->fd, 0, min_complete, IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+        debugf("io_uring_enter: %s", strerror(errno));
+    }
+
+    u32 head = *r->cq_head;
+    u32 tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct record_chunk *c = &rec->chunks[cqe->user_data];
+        bool ok = cqe->res >= 0;
+        if (ok && (size_t)cqe->res < c->used) {
+            // short write, the rest the slow way
+            ok = pwrite_all(rec->fd, c->data + cqe->res, c->used - cqe->res, c->offset + cqe->res);
+        } else if (!ok) {
+            errno = -cqe->res;
+        }
+        record_chunk_done(rec, c, ok);
+        rec->in_flight--;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+record_submit(struct recorder *rec, int chunk)
+{
+    struct record_chunk *c = &rec->chunks[chunk];
+    c->submitted = true;
+    atomic_store_explicit(&c->writing, true, memory_order_relaxed);
+
+    if (rec->ring.fd != -1) {
+        struct uring *r = &rec->ring;
+        u32 tail = *r->sq_tail;
+        u32 i = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[i];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = rec->fd;
+        sqe->addr = (u64)(uintptr_t)c->data;
+        sqe->len = c->used;
+        sqe->off = c->offset;
+        sqe->user_data = chunk;
+        r->sq_array[i] = i;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) == 1) {
+            rec->in_flight++;
+        } else {
+            // not submitted, take it back and write it here
+            __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+            record_chunk_done(rec, c, pwrite_all(rec->fd, c->data, c->used, c->offset));
+        }
+    } else {
+        SDL_LockMutex(rec->mutex);
+        rec->queue[rec->queue_tail++ % RECORD_CHUNKS] = chunk;
+        SDL_UnlockMutex(rec->mutex);
+        wake_eventfd(rec->work_fd);
+    }
+}
+
+// without io_uring, writes queued chunks until a token with nothing queued
+int
+run_record_writer(void *data)
+{
+    struct recorder *rec = data;
+
+    for (;;) {
+        u64 token;
+        if (read(rec->work_fd, &token, sizeof(token)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debugf("eventfd read: %s", strerror(errno));
+            break;
+        }
+
+        int chunk = -1;
+        SDL_LockMutex(rec->mutex);
+        if (rec->queue_head != rec->queue_tail) {
+            chunk = rec->queue[rec->queue_head++ % RECORD_CHUNKS];
+        }
+        SDL_UnlockMutex(rec->mutex);
+        if (chunk == -1) {
+            break;
+        }
+
+        struct record_chunk *c = &rec->chunks[chunk];
+        record_chunk_done(rec, c, pwrite_all(rec->fd, c->data, c->used, c->offset));
+    }
+
+    return 0;
+}
+
+/*
+ * A new recording of frames in the source's format, or only their luma
+ * with GREY.  bytesperline is the source's, 0 if its rows are packed.
+ * NULL if the file can't be created.  uring false always uses the writer
+ * threads.
+ */
+struct recorder *
+open_recorder(const char *name, int camera, u32 pixelformat, u32 width, u32 height, u32 bytesperline,
+        struct v4l2_fract interval, bool uring)
+{
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        SDL_Log("unable to record to %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    struct record_header h = {
+        .pixelformat = pixelformat, .width = width, .height = height, .bytesperline = bytesperline,
+        .interval_numerator = interval.numerator, .interval_denominator = interval.denominator,
+    };
+    memcpy(h.magic, RECORD_MAGIC, 8);
+    if (!pwrite_all(fd, (const u8 *)&h, sizeof(h), 0)) {
+        SDL_Log("unable to record to %s: %s", name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct recorder *rec = calloc(1, sizeof(*rec));
+    snprintf(rec->name, sizeof(rec->name), "%s", name);
+    rec->fd = fd;
+    rec->camera = camera;
+    rec->size = sizeof(h);
+    // at least 2 frames a chunk
+    rec->chunk_size = RECORD_CHUNK_SIZE;
+    size_t max_frame = record_frame_size(width*height*2 > bytesperline*height ? width*height*2 : bytesperline*height);
+    if (2*max_frame > rec->chunk_size) {
+        rec->chunk_size = 2*max_frame;
+    }
+    for (int i = 0; i < RECORD_CHUNKS; i++) {
+        // touched so the copies never fault
+        rec->chunks[i].data = malloc(rec->chunk_size);
+        if (!rec->chunks[i].data) {
+            errno_exit("recorder malloc");
+        }
+        memset(rec->chunks[i].data, 0, rec->chunk_size);
+    }
+    rec->chunks[0].offset = rec->size;
+
+    bool have_uring = uring && uring_init(&rec->ring, RECORD_CHUNKS);
+    if (have_uring && !uring_supports(&rec->ring, IORING_OP_WRITE)) {
+        debug("io_uring has no IORING_OP_WRITE");
+        uring_close(&rec->ring);
+        have_uring = false;
+    } else if (uring && !have_uring) {
+        debugf("io_uring not available: %s", strerror(errno));
+    }
+    if (!have_uring) {
+        rec->ring.fd = -1;
+        rec->mutex = SDL_CreateMutex();
+        rec->work_fd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+        if (rec->work_fd == -1) {
+            errno_exit("eventfd");
+        }
+        for (int i = 0; i < RECORD_WRITERS; i++) {
+            rec->writers[i] = SDL_CreateThread(run_record_writer, "record writer", rec);
+        }
+    }
+
+    char fourcc[5];
+    SDL_Log("camera %d recording %ux%u %s to %s with %s", camera, width, height, fourcc_name(pixelformat, fourcc),
+            name, rec->ring.fd != -1 ? "io_uring" : "pwrite threads");
+
+    return rec;
+}
+
+// capture thread, false if the frame was dropped because the disk is behind
+bool
+recorder_add(struct recorder *rec, const u8 *data, u32 size, u32 sequence, u64 timestamp_ns)
+{
+    if (!rec->start_ns) {
+        rec->start_ns = monotonic_ns();
+    }
+    if (rec->in_flight) {
+        record_reap(rec, 0);
+    }
+
+    const u64 need = record_frame_size(size);
+    struct record_chunk *c = &rec->chunks[rec->current];
+    if (c->submitted || c->used + need > rec->chunk_size) {
+        // once, a drop leaves it current while it's written
+        if (!c->submitted && c->used) {
+            record_submit(rec, rec->current);
+        }
+
+        int next = (rec->current + 1) % RECORD_CHUNKS;
+        if (need > rec->chunk_size || atomic_load_explicit(&rec->chunks[next].writing, memory_order_acquire)) {
+            rec->dropped++;
+            return false;
+        }
+        rec->current = next;
+        c = &rec->chunks[next];
+        c->used = 0;
+        c->submitted = false;
+        c->offset = rec->size;
+    }
+
+    if (rec->n_index == rec->max_index) {
+        rec->max_index = rec->max_index ? 2*rec->max_index : 4096;
+        rec->index = realloc(rec->index, rec->max_index*sizeof(rec->index[0]));
+        if (!rec->index) {
+            errno_exit("realloc");
+        }
+    }
+    rec->index[rec->n_index++] = (struct record_entry){
+        .offset = rec->size + sizeof(struct record_frame), .timestamp_ns = timestamp_ns,
+        .size = size, .sequence = sequence,
+    };
+
+    struct record_frame *rf = (struct record_frame *)(c->data + c->used);
+    *rf = (struct record_frame){
+        .magic = RECORD_FRAME_MAGIC, .size = size, .sequence = sequence, .timestamp_ns = timestamp_ns,
+    };
+    memcpy(rf + 1, data, size);
+    c->used += need;
+    rec->size += need;
+
+    return true;
+}
+
+// writes what's left and the index, then frees the recorder
+void
+close_recorder(struct recorder *rec)
+{
+    struct record_chunk *c = &rec->chunks[rec->current];
+    if (!c->submitted && c->used) {
+        record_submit(rec, rec->current);
+    }
+
+    if (rec->ring.fd != -1) {
+        while (rec->in_flight) {
+            record_reap(rec, 1);
+        }
+        uring_close(&rec->ring);
+    } else {
+        // a token each with nothing queued stops the writers
+        for (int i = 0; i < RECORD_WRITERS; i++) {
+            wake_eventfd(rec->work_fd);
+        }
+        for (int i = 0; i < RECORD_WRITERS; i++) {
+            SDL_WaitThread(rec->writers[i], NULL);
+        }
+        close(rec->work_fd);
+        SDL_DestroyMutex(rec->mutex);
+    }
+
+    struct record_trailer t = { .index_offset = rec->size, .n_frames = rec->n_index };
+    memcpy(t.magic, RECORD_INDEX_MAGIC, 8);
+    bool ok = pwrite_all(rec->fd, (const u8 *)rec->index, rec->n_index*sizeof(rec->index[0]), rec->size)
+        && pwrite_all(rec->fd, (const u8 *)&t, sizeof(t), rec->size + rec->n_index*sizeof(rec->index[0]));
+    if (close(rec->fd) == -1 || !ok) {
+        SDL_Log("camera %d recording %s index not written: %s", rec->camera, rec->name, strerror(errno));
+    }
+
+    double elapsed = rec->start_ns ? (monotonic_ns() - rec->start_ns)/1e9 : 0;
+    SDL_Log("camera %d recorded %lu frames, %.1f MB to %s, %.1f MB/s, %lu dropped, %lu write errors",
+            rec->camera, rec->n_index, rec->size/1e6, rec->name, elapsed > 0 ? rec->size/1e6/elapsed : 0.0,
+            rec->dropped, atomic_load(&rec->write_errors));
+
+    for (int i = 0; i < RECORD_CHUNKS; i++) {
+        free(rec->chunks[i].data);
+    }
+    free(rec->index);
+    free(rec);
+}
+
+struct capture_data {
+    // set by other threads, stop_capture clears running and wakes the
+    // capture thread
+    _Atomic bool running;
+    _Atomic bool reset_race;
+    // set when the capture thread returns, like at the end of a replay
+    _Atomic bool done;
+    // nothing is shown, frames aren't published to the display
+    bool headless;
+    // SDL event type pushed to wake the display for a new frame, 0 for
+    // none.  Only one is pending at a time, the display clears it before
+    // taking the frame.
+    _Atomic u32 frame_event;
+    _Atomic bool frame_event_pending;
+    // where frames come from and an eventfd to wake the capture thread
+    struct frame_source *source;
+    int wake_fd;
+
+    u32 width;
+    u32 height;
+    // median filter the whole frame instead of only the finish line
+    bool median_frame;
+    // show the changed pixels next to the background
+    _Atomic bool show_mask;
+    // GREY, YUYV or MJPEG
+    u32 pixelformat;
+
+    // the background is ready, set once by the capture thread before the
+    // first frame it publishes for the display
+    _Atomic bool valid_image;
+    // luma display images, the camera buffer shown as the color view (NULL
+    // data for none) and what's drawn over them, indexed by the display triple
+    // buffer.  Each slot owns its camera buffer until it's released.  MJPEG
+    // frames are decoded to yuyv instead.
+    image *gray[3];
+    struct frame frames[3];
+    image *yuyv[3];
+    struct overlay overlays[3];
+    struct triple_buffer display;
+    // frames the driver skipped because it had no buffer, from the sequence
+    // numbers
+    u64 dropped_frames;
+    // times the watchdog restarted the stream after no frames
+    u64 stalls;
+
+    // index into the race's cameras, crossings go to the shared race
+    int camera;
+    struct race *race;
+    // keeps the frames around each crossing when not NULL
+    struct photo_finish *photo_finish;
+    // records every frame when not NULL, as it came from the camera or only
+    // the luma
+    struct recorder *recorder;
+    bool record_luma;
+    // every crossing this camera sees when not NULL, for the synthetic scene
+    u64 *crossing_log;
+    int n_crossing_log;
+    int max_crossing_log;
+
+    // sensor readout time in ns for the rolling shutter model, -1 for the
+    // frame interval
+    s64 readout_ns;
+
+    // frame timestamps are from the driver, otherwise taken at DQBUF
+    bool kernel_timestamps;
+    // this thread's stage times, NULL for none.  The display traces its
+    // stages from the base time and sequence of the frame in each slot.
+    struct trace_ring *trace;
+    u64 frame_base_ns[3];
+    u32 frame_sequence[3];
+    // capture to end of processing for the last frame and the max, ns
+    u64 frame_latency;
+    u64 max_frame_latency;
+};
+
+// wakes the capture thread if it's waiting for a frame
+void
+wake_capture(struct capture_data *cd)
+{
+    wake_eventfd(cd->wake_fd);
+}
+
+// the capture thread finishes the frame it's on and exits
+void
+stop_capture(struct capture_data *cd)
+{
+    atomic_store(&cd->running, false);
+    wake_capture(cd);
+}
+
+int
+run_capture(void *data)
+{
+    struct capture_data *cd = data;
+
+    struct frame_source *src = cd->source;
+
+    debugf("capture timeperframe: %u/%u", src->interval.numerator, src->interval.denominator);
+
+    // without a measured readout time assume the sensor reads out over the
+    // whole frame interval, the worst case
+    struct rolling_shutter shutter = { .height = cd->height };
+    if (cd->readout_ns >= 0) {
+        shutter.readout_ns = cd->readout_ns;
+    } else {
+        shutter.readout_ns = interval_ns(src->interval);
+    }
+    debugf("rolling shutter readout: %.1f ms", shutter.readout_ns/1e6);
+
+    // no frame for 10 frame intervals, or a second for slow cameras, is a
+    // stall and the stream is restarted
+    u64 stall_ns = 1000000000ull;
+    if (10*interval_ns(src->interval) > stall_ns) {
+        stall_ns = 10*interval_ns(src->interval);
+    }
+
+    src->start(src);
+
+    struct frame f;
+    bool have_sequence = false;
+    u32 last_sequence = 0;
+    // replay stats
+    int n_frames = 0;
+    u64 first_frame_ns = 0;
+
+    // TODO(jason): maybe read these from cam fd with VIDIOC_G_FMT
+    // probably should be setting camera settings
+    u32 cam_width = cd->width;
+    u32 cam_height = cd->height;
+
+    for (int i = 0; i < 3; i++) {
+        cd->gray[i] = new_image(cd->width, cd->height, 1);
+        cd->yuyv[i] = cd->pixelformat == V4L2_PIX_FMT_MJPEG ? new_image(cd->width, cd->height, 2) : NULL;
+    }
+    jpeg_decoder jpeg;
+    jpeg_init(&jpeg);
+    u32 write_index = cd->display.back;
+
+    image *finish_line = new_image(FINISH_LINE_WIDTH, FINISH_LINE_HEIGHT, 1);
+    background *bg_finish_line = new_background(finish_line->width, finish_line->height);
+    image *tmp_finish_line = new_image_like(finish_line);
+    image *filtered_frame = cd->median_frame ? new_image(cam_width, cam_height, 1) : NULL;
+    int finish_line_x = cam_width/2 - finish_line->width/2;
+    int finish_line_y = cam_height - finish_line->height - FINISH_LINE_MARGIN;
+    bool finish_line_active = false;
+    // sub-frame crossing time, see crossing_estimate
+    struct crossing crossing = {};
+    u16 profile[finish_line->width];
+    u16 row_profile[finish_line->height];
+    const int crossing_x = finish_line->width/2;
+    const int crossing_min_rows = finish_line->height/16;
+    // if the background has been mixed enough and the finish line should be
+    // checked
+    bool finish_line_valid = false;
+    int motion_threshold = 8;
+    // percent of the finish line pixels that have to change
+    const double motion_percent = 20.0;
+
+    const int require_bg_frames = 60;
+    const int n_usable_frames  = require_bg_frames - require_bg_frames/3;
+    int need_bg_frames = require_bg_frames;
+    // background blend weight is 1/2^shift.  Fast while building it at
+    // startup, then slow enough that a car sitting on the line takes a few
+    // seconds to become background.
+    const int startup_bg_shift = 3;
+    const int bg_shift = 7;
+
+    u64 last_frame_ns = monotonic_ns();
+
+    while (atomic_load(&cd->running)) {
+        //s64 start = SDL_GetPerformanceCounter();
+        //debugf("got frame: %d, elapsed: %ld", vbuf.index, (start - last_frame_count)/1000);
+        //last_frame_count = start;
+
+        if (atomic_exchange(&cd->reset_race, false)) {
+            crossing.pending = false;
+            //need_bg_frames = require_bg_frames;
+        }
+
+        u64 now = monotonic_ns();
+        if (src->restart && now - last_frame_ns > stall_ns) {
+            SDL_Log("camera %d stalled, no frame for %.0f ms, restarting", cd->camera,
+                    (now - last_frame_ns)/1e6);
+            cd->stalls++;
+            src->restart(src);
+            have_sequence = false;
+            last_frame_ns = now;
+            continue;
+        }
+
+        // wakes for stop_capture, otherwise at the stall deadline.  Only a
+        // replay can be past it.
+        int timeout_ms = now - last_frame_ns < stall_ns ? (last_frame_ns + stall_ns - now)/1000000 + 1 : 100;
+        u64 wait_ns = monotonic_ns();
+        enum frame_status status = src->next(src, cd->wake_fd, timeout_ms, &f);
+        if (status == FRAME_END) {
+            u64 elapsed = monotonic_ns() - first_frame_ns;
+            SDL_Log("camera %d replay done, %d frames in %.1f ms, %.0f fps", cd->camera, n_frames,
+                    elapsed/1e6, elapsed ? n_frames*1e9/elapsed : 0.0);
+            break;
+        } else if (status == FRAME_NONE) {
+            continue;
+        }
+        last_frame_ns = monotonic_ns();
+        if (!n_frames++) {
+            first_frame_ns = last_frame_ns;
+        }
+
+        if (have_sequence && f.sequence - last_sequence > 1) {
+            cd->dropped_frames += f.sequence - last_sequence - 1;
+        }
+        have_sequence = true;
+        last_sequence = f.sequence;
+
+        // lap times use when the frame was captured so they don't include
+        // the time waiting for DQBUF or processing the frame
+        u64 frame_ns = f.timestamp_ns;
+        cd->kernel_timestamps = frame_ns > 0;
+        if (!frame_ns) {
+            frame_ns = monotonic_ns();
+        }
+
+        // a recording's timestamps are from when it was made
+        const u64 base_ns = src->recorded ? last_frame_ns : frame_ns;
+        if (cd->kernel_timestamps && !src->recorded) {
+            trace_stage(cd->trace, STAGE_CAPTURE, cd->camera, f.sequence, base_ns, frame_ns, frame_ns);
+        }
+        trace_stage(cd->trace, STAGE_DQBUF, cd->camera, f.sequence, base_ns, wait_ns, last_frame_ns);
+
+        if (cd->photo_finish) {
+            photo_finish_add(cd->photo_finish, &f, frame_ns);
+        }
+        if (cd->recorder && !cd->record_luma) {
+            recorder_add(cd->recorder, f.data, f.bytesused, f.sequence, frame_ns);
+        }
+
+        image *write1_image = cd->gray[write_index];
+        struct overlay *overlay = &cd->overlays[write_index];
+        overlay->rect_color = NULL;
+        overlay->n_texts = 0;
+
+        const u8 *frame_data = f.data;
+        bool show = !cd->headless;
+        if (cd->pixelformat == V4L2_PIX_FMT_MJPEG) {
+            // detection only needs the luma of the finish line.  The whole
+            // frame is decoded only when the display has taken the last one
+            // or it's all filtered.
+            show = show && triple_buffer_taken(&cd->display);
+            bool ok = jpeg_parse(&jpeg, frame_data, f.bytesused)
+                && jpeg.width == (int)cam_width && jpeg.height == (int)cam_height;
+            if (ok && (show || cd->median_frame || cd->record_luma)) {
+                image *yuyv = show ? cd->yuyv[write_index] : NULL;
+                ok = jpeg_decode_frame(&jpeg, write1_image->data, write1_image->stride,
+                        yuyv ? yuyv->data : NULL, yuyv ? yuyv->stride : 0);
+                copy_rect_image(tmp_finish_line->width, tmp_finish_line->height, write1_image,
+                        finish_line_x, finish_line_y, tmp_finish_line, 0, 0);
+            } else if (ok) {
+                ok = jpeg_decode_luma(&jpeg, tmp_finish_line->data, tmp_finish_line->stride,
+                        finish_line_x, finish_line_y, tmp_finish_line->width, tmp_finish_line->height);
+            }
+            src->release(src, &f);
+
+            if (!ok) {
+                debugf("bad MJPEG frame: %u", f.sequence);
+                continue;
+            }
+        } else if (cd->pixelformat == V4L2_PIX_FMT_GREY) {
+            // already the luma plane, the display shows it for both views
+            const u32 src_stride = source_stride(src);
+            for (u32 row = 0; row < cam_height; row++) {
+                memcpy(write1_image->data + row*write1_image->stride, frame_data + row*src_stride, cam_width);
+            }
+            copy_rect_image(tmp_finish_line->width, tmp_finish_line->height, write1_image,
+                    finish_line_x, finish_line_y, tmp_finish_line, 0, 0);
+            src->release(src, &f);
+        } else {
+            // one pass over the camera buffer.  The display shows the camera
+            // buffer itself so there's no color conversion or copy here, the
+            // display slot takes the buffer over from dequeuing it.
+            yuyv_demux(frame_data, source_stride(src), NULL, write1_image, NULL,
+                    tmp_finish_line, finish_line_x, finish_line_y);
+            if (show) {
+                cd->frames[write_index] = f;
+            } else {
+                src->release(src, &f);
+            }
+        }
+
+        if (cd->recorder && cd->record_luma) {
+            recorder_add(cd->recorder, write1_image->data, write1_image->n_pixels, f.sequence, frame_ns);
+        }
+
+        if (cd->median_frame) {
+            // filter the whole luma frame and take the finish line from it
+            median_image(write1_image, filtered_frame, 2);
+            copy_image(filtered_frame, write1_image);
+            copy_rect_image(finish_line->width, finish_line->height, filtered_frame, finish_line_x, finish_line_y, finish_line, 0, 0);
+        } else {
+            median_image(tmp_finish_line, finish_line, 2);
+        }
+        //copy_image(tmp_finish_line, finish_line);
+        u64 convert_ns = monotonic_ns();
+        trace_stage(cd->trace, STAGE_CONVERT, cd->camera, f.sequence, base_ns, last_frame_ns, convert_ns);
+
+        // after startup the background is updated with the motion check below
+        if (need_bg_frames) {
+            if (need_bg_frames == n_usable_frames) {
+                // initialize mix
+                reset_background(bg_finish_line, finish_line);
+                atomic_store_explicit(&cd->valid_image, true, memory_order_release);
+            } else if (need_bg_frames < n_usable_frames) {
+                // threshold 255 blends every pixel
+                diff_update_background(finish_line, bg_finish_line, NULL, NULL, NULL, 255, startup_bg_shift);
+                if (show) {
+                    overlay_text(overlay, OVERLAY_GRAY, 2, 2, &WHITE, "mixing background");
+                }
+            } else if (show) {
+                overlay_text(overlay, OVERLAY_GRAY, 2, 2, &WHITE, "skipping frame");
+                // ignore some frames at the beginning
+            }
+            need_bg_frames--;
+
+            if (need_bg_frames == 0 && !finish_line_valid) {
+                finish_line_valid = true;
+            }
+
+            //debugf("background frame.  remaining: %d", need_bg_frames);
+        }
+
+        if (finish_line_valid) {
+            // tmp_finish_line is free after the median, reuse it for the
+            // mask.  It's only made for the debug view.  Pixels without motion
+            // are blended into the background in the same pass that counts
+            // the changed pixels of each column and row.
+            image *mask = show && atomic_load_explicit(&cd->show_mask, memory_order_relaxed) ? tmp_finish_line : NULL;
+            int changed = diff_update_background(finish_line, bg_finish_line, mask, profile, row_profile,
+                    motion_threshold, bg_shift);
+            double percent = 100.0*changed/finish_line->n_pixels;
+
+            // the rows with motion were exposed later than the frame
+            // timestamp, use the center of them for this frame's time
+            double center_row;
+            int first_row, last_row;
+            bool rows_changed = changed_rows(row_profile, finish_line->height, finish_line->width/8,
+                    &center_row, &first_row, &last_row);
+            u64 sample_ns = row_time(&shutter, frame_ns, finish_line_y + center_row);
+            crossing_add(&crossing, sample_ns, profile, finish_line->width, crossing_min_rows);
+
+            if (rows_changed && show) {
+                char rows_text[32];
+                snprintf(rows_text, 32, "rows %d-%d", first_row, last_row);
+                overlay_text(overlay, OVERLAY_GRAY, 2, finish_line->height + 18, &WHITE, rows_text);
+            }
+
+            // the race gets the crossing once there's a frame after it for
+            // the sub-frame estimate
+            if (crossing.pending) {
+                crossing.pending = false;
+
+                u64 estimate = crossing_estimate(&crossing, finish_line->width, crossing_x);
+                //debugf("crossing correction: %.1f ms", estimate ? ((s64)estimate - (s64)crossing.trigger_ns)/1e6 : 0.0);
+                race_crossing(cd->race, cd->camera, estimate ? estimate : crossing.trigger_ns);
+                if (cd->n_crossing_log < cd->max_crossing_log) {
+                    cd->crossing_log[cd->n_crossing_log++] = estimate ? estimate : crossing.trigger_ns;
+                }
+            }
+
+            if (show) {
+                char percent_text[32];
+                snprintf(percent_text, 32, "%.2f", percent);
+                overlay_text(overlay, OVERLAY_GRAY, 2, finish_line->height + 2, &WHITE, percent_text);
+            }
+            const color *highlight;
+            if (percent > motion_percent) {
+                if (!finish_line_active) {
+                    finish_line_active = true;
+
+                    crossing.pending = true;
+                    crossing.trigger_ns = frame_ns;
+                    if (cd->photo_finish) {
+                        photo_finish_trigger(cd->photo_finish, frame_ns);
+                    }
+                    debugf("camera %d crossing rows %d-%d, %.1f ms after frame start", cd->camera,
+                            first_row, last_row, (sample_ns - frame_ns)/1e6);
+                }
+
+                highlight = &GREEN;
+            } else {
+                highlight = &WHITE;
+                finish_line_active = false;
+            }
+
+            if (show) {
+                int x = 0;
+                int y = 0;
+                copy_rect_image(finish_line->width, finish_line->height, finish_line, 0, 0, write1_image, x, y);
+                x += finish_line->width + 2;
+                copy_rect_image(finish_line->width, finish_line->height, bg_finish_line->image, 0, 0, write1_image, x, y);
+                if (mask) {
+                    x += finish_line->width + 2;
+                    copy_rect_image(finish_line->width, finish_line->height, mask, 0, 0, write1_image, x, y);
+                }
+            }
+            overlay->rect_color = highlight;
+            overlay->rect_x = finish_line_x;
+            overlay->rect_y = finish_line_y;
+            overlay->rect_width = finish_line->width;
+            overlay->rect_height = finish_line->height;
+        }
+
+        u64 detect_ns = monotonic_ns();
+        trace_stage(cd->trace, STAGE_DETECT, cd->camera, f.sequence, base_ns, convert_ns, detect_ns);
+
+        // the race is drawn over the first camera, the others only show
+        // their own crossings.  Nothing is drawn for a frame that isn't
+        // published.
+        if (cd->camera == 0 && show) {
+            race_overlay(cd->race, overlay, OVERLAY_COLOR, frame_ns);
+        }
+
+        cd->frame_latency = monotonic_ns() - base_ns;
+        if (cd->frame_latency > cd->max_frame_latency) {
+            cd->max_frame_latency = cd->frame_latency;
+        }
+
+        if (show) {
+            char latency_text[64];
+            snprintf(latency_text, 64, "%s %.1f max %.1f ms, %lu unshown", cd->kernel_timestamps ? "capture" : "dqbuf",
+                    cd->frame_latency/1e6, cd->max_frame_latency/1e6,
+                    atomic_load_explicit(&cd->display.overwritten, memory_order_relaxed));
+            overlay_text(overlay, OVERLAY_COLOR, 2, cam_height - 16, &WHITE, latency_text);
+        }
+
+        if (show && (cd->dropped_frames || src->starved_frames || cd->stalls)) {
+            char dropped_text[64];
+            snprintf(dropped_text, 64, "dropped %lu starved %lu stalled %lu", cd->dropped_frames,
+                    src->starved_frames, cd->stalls);
+            overlay_text(overlay, OVERLAY_COLOR, 2, cam_height - 32, &RED, dropped_text);
+        }
+
+        // update current image frame for display.  The slot coming back
+        // from the display doesn't need its camera buffer anymore.
+        if (show) {
+            cd->frame_base_ns[write_index] = base_ns;
+            cd->frame_sequence[write_index] = f.sequence;
+            write_index = triple_buffer_publish(&cd->display);
+            trace_stage(cd->trace, STAGE_PUBLISH, cd->camera, f.sequence, base_ns, detect_ns, monotonic_ns());
+            u32 frame_event = atomic_load_explicit(&cd->frame_event, memory_order_relaxed);
+            if (frame_event && !atomic_exchange(&cd->frame_event_pending, true)) {
+                SDL_Event event = { .type = frame_event };
+                if (SDL_PushEvent(&event) != 1) {
+                    atomic_store(&cd->frame_event_pending, false);
+                }
+            }
+            if (cd->frames[write_index].data) {
+                src->release(src, &cd->frames[write_index]);
+                cd->frames[write_index].data = NULL;
+            }
+        }
+    }
+
+    src->stop(src);
+
+    free_image(finish_line);
+    free_image(tmp_finish_line);
+    free_image(filtered_frame);
+    free_background(bg_finish_line);
+    atomic_store(&cd->done, true);
+
+    return 0;
+}
+
+// capture_data images are freed after the capture thread is joined so the
+// display never sees them go away
+void
+free_capture_images(struct capture_data *cd)
+{
+    for (int i = 0; i < 3; i++) {
+        free_image(cd->gray[i]);
+        free_image(cd->yuyv[i]);
+    }
+}
+
+/*
+ * Synthetic race scene for accuracy and throughput testing.  A static track
+ * with a car sprite driving left to right through the finish line at known
+ * sub-frame times.  The sprite is drawn with its edges antialiased at
+ * sub-pixel positions, and each row at the time the rolling shutter exposed
+ * it.  Sensor noise, lighting drift and dropped frames can be added.  The
+ * crossing times are where the leading edge passes the middle of the
+ * finish line, what crossing_estimate measures.
+ */
+struct scene {
+    u32 width;
+    u32 height;
+    struct v4l2_fract interval;
+    int n_crossings;
+    // time between crossings, s
+    double lap_s;
+    // pixels/s
+    double speed;
+    // +- luma noise on each pixel every frame
+    int noise;
+    // +- luma of a slow sine over the whole frame, like clouds
+    int drift;
+    u64 readout_ns;
+    // chance of each frame being dropped
+    double drop;
+    u32 seed;
+};
+
+#define SCENE_SPRITE_WIDTH 96
+#define SCENE_SPRITE_HEIGHT 160
+#define SCENE_BUFFERS 6
+#define SCENE_MAX_LAPS 100000
+
+// defaults then comma separated key=value: w, h, fps, laps, lap (s), speed
+// (px/s), noise, drift, readout (ms), drop (0-1) and seed
+bool
+parse_scene(const char *spec, struct scene *sc)
+{
+    *sc = (struct scene){
+        .width = 640, .height = 480, .interval = { 1, 30 }, .n_crossings = 20, .lap_s = 3.0,
+        .speed = 1500.0, .seed = 1,
+    };
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *save;
+    for (char *t = strtok_r(buf, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        char *v = strchr(t, '=');
+        if (!v) {
+            return false;
+        }
+        *v++ = '\0';
+        double d = atof(v);
+
+        if (strcmp(t, "w") == 0) {
+            sc->width = d;
+        } else if (strcmp(t, "h") == 0) {
+            sc->height = d;
+        } else if (strcmp(t, "fps") == 0) {
+            sc->interval = (struct v4l2_fract){ 1000, d*1000 };
+        } else if (strcmp(t, "laps") == 0) {
+            sc->n_crossings = d > 0 && d <= SCENE_MAX_LAPS ? d : 0;
+        } else if (strcmp(t, "lap") == 0) {
+            sc->lap_s = d;
+        } else if (strcmp(t, "speed") == 0) {
+            sc->speed = d;
+        } else if (strcmp(t, "noise") == 0) {
+            sc->noise = d;
+        } else if (strcmp(t, "drift") == 0) {
+            sc->drift = d;
+        } else if (strcmp(t, "readout") == 0) {
+            sc->readout_ns = d*1e6;
+        } else if (strcmp(t, "drop") == 0) {
+            sc->drop = d;
+        } else if (strcmp(t, "seed") == 0) {
+            sc->seed = d;
+        } else {
+            return false;
+        }
+    }
+
+    return sc->width >= FINISH_LINE_MIN_WIDTH && sc->height >= FINISH_LINE_HEIGHT + FINISH_LINE_MARGIN
+        && sc->width % 2 == 0 && sc->interval.denominator && sc->n_crossings > 0
+        && sc->lap_s*sc->speed > sc->width + SCENE_SPRITE_WIDTH && sc->speed > 0;
+}
+
+struct scene_source {
+    struct frame_source source;
+    struct scene scene;
+
+    // when the leading edge passes the middle of the frame
+    u64 *crossings;
+    int n_frames;
+    int next_frame;
+    u64 start_ns;
+
+    // static track luma
+    u8 *track;
+    u8 *buffers[SCENE_BUFFERS];
+    bool busy[SCENE_BUFFERS];
+    u32 rng;
+    // time spent drawing frames, not part of the pipeline
+    u64 generate_ns;
+};
+
+static u32
+scene_rand(struct scene_source *ss)
+{
+    // xorshift32
+    u32 x = ss->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return ss->rng = x;
+}
+
+static void
+scene_draw(struct scene_source *ss, u8 *yuyv, u64 frame_ns)
+{
+    const struct scene *sc = &ss->scene;
+    const int width = sc->width;
+    const int sprite_y = sc->height - FINISH_LINE_MARGIN - FINISH_LINE_HEIGHT + 48;
+    const double half_lap_ns = sc->lap_s*5e8;
+    const int light = sc->drift ? lround(sc->drift*sin(2*M_PI*(frame_ns - ss->start_ns)/7e9)) : 0;
+
+    // the crossing nearest the frame, the sprite is off screen between them
+    int k = 0;
+    while (k + 1 < sc->n_crossings && ss->crossings[k + 1] < frame_ns + half_lap_ns) {
+        k++;
+    }
+
+    for (u32 row = 0; row < sc->height; row++) {
+        const u8 *track = ss->track + row*width;
+        u8 *out = yuyv + row*width*2;
+
+        // sprite columns for this row, xl > xr for none
+        double xl = 1, xr = 0;
+        if ((int)row >= sprite_y && (int)row < sprite_y + SCENE_SPRITE_HEIGHT) {
+            u64 row_ns = frame_ns + sc->readout_ns*row/sc->height;
+            xr = width/2 + sc->speed*((s64)(row_ns - ss->crossings[k]))/1e9;
+            xl = xr - SCENE_SPRITE_WIDTH;
+        }
+
+        for (int x = 0; x < width; x += 2) {
+            int y[2];
+            double cover = 0;
+            for (int i = 0; i < 2; i++) {
+                int v = track[x + i] + light;
+                if (sc->noise) {
+                    u32 r = scene_rand(ss);
+                    v += ((int)(r & 0xff) + (int)((r >> 8) & 0xff) - 255)*sc->noise/255;
+                }
+
+                if (x + i + 1 > xl && x + i < xr) {
+                    // fraction of the pixel the sprite covers
+                    double c = fmin(x + i + 1, xr) - fmax(x + i, xl);
+                    cover += c;
+                    v = v*(1 - c) + 210*c;
+                }
+                y[i] = clamp(v, 0, 255);
+            }
+
+            // red car on a gray track
+            out[x*2] = y[0];
+            out[x*2 + 1] = cover > 1 ? 90 : 128;
+            out[x*2 + 2] = y[1];
+            out[x*2 + 3] = cover > 1 ? 200 : 128;
+        }
+    }
+}
+
+static void
+scene_source_start(struct frame_source *src)
+{
+    (void)src;
+}
+
+static enum frame_status
+scene_source_next(struct frame_source *src, int wake_fd, int timeout_ms, struct frame *f)
+{
+    struct scene_source *ss = (struct scene_source *)src;
+    (void)wake_fd;
+    (void)timeout_ms;
+
+    // dropped frames are skipped, the sequence numbers show the gap
+    while (ss->next_frame < ss->n_frames && ss->scene.drop > 0
+            && scene_rand(ss) < ss->scene.drop*4294967295.0) {
+        ss->next_frame++;
+    }
+    if (ss->next_frame >= ss->n_frames) {
+        return FRAME_END;
+    }
+
+    int b = 0;
+    while (b < SCENE_BUFFERS && ss->busy[b]) {
+        b++;
+    }
+    if (b == SCENE_BUFFERS) {
+        return FRAME_NONE;
+    }
+
+    u64 start = monotonic_ns();
+    u64 frame_ns = ss->start_ns + ss->next_frame*interval_ns(src->interval);
+    scene_draw(ss, ss->buffers[b], frame_ns);
+    ss->generate_ns += monotonic_ns() - start;
+
+    ss->busy[b] = true;
+    f->data = ss->buffers[b];
+    f->bytesused = src->width*src->height*2;
+    f->sequence = ss->next_frame;
+    f->timestamp_ns = frame_ns;
+    f->index = b;
+    ss->next_frame++;
+
+    return FRAME_READY;
+}
+
+static void
+scene_source_release(struct frame_source *src, const struct frame *f)
+{
+    struct scene_source *ss = (struct scene_source *)src;
+
+    ss->busy[f->index] = false;
+}
+
+static void
+scene_source_close(struct frame_source *src)
+{
+    struct scene_source *ss = (struct scene_source *)src;
+
+    for (int i = 0; i < SCENE_BUFFERS; i++) {
+        free(ss->buffers[i]);
+    }
+    free(ss->track);
+    free(ss->crossings);
+    free(ss);
+}
+
+struct frame_source *
+open_scene_source(const struct scene *sc)
+{
+    struct scene_source *ss = calloc(1, sizeof(*ss));
+    struct frame_source *src = &ss->source;
+    ss->scene = *sc;
+    ss->rng = sc->seed ? sc->seed : 1;
+    ss->start_ns = FILE_START_NS;
+
+    src->pixelformat = V4L2_PIX_FMT_YUYV;
+    src->width = sc->width;
+    src->height = sc->height;
+    src->interval = sc->interval;
+    src->recorded = true;
+    src->start = scene_source_start;
+    src->next = scene_source_next;
+    src->release = scene_source_release;
+    src->stop = scene_source_start;
+    src->close = scene_source_close;
+
+    // after the background is built, at any time within a frame
+    const u64 frame_ns = interval_ns(sc->interval);
+    ss->crossings = malloc(sc->n_crossings*sizeof(ss->crossings[0]));
+    for (int k = 0; k < sc->n_crossings; k++) {
+        ss->crossings[k] = ss->start_ns + 100*frame_ns + sc->lap_s*1e9*(k + 0.5) + scene_rand(ss) % frame_ns;
+    }
+    ss->n_frames = (ss->crossings[sc->n_crossings - 1] + sc->lap_s*5e8 - ss->start_ns)/frame_ns;
+
+    ss->track = malloc(sc->width*sc->height);
+    for (u32 y = 0; y < sc->height; y++) {
+        for (u32 x = 0; x < sc->width; x++) {
+            // asphalt with a lane line
+            u8 v = 70 + ((x*7 ^ y*13) & 0x1f);
+            ss->track[y*sc->width + x] = (y % 120) < 4 ? 200 : v;
+        }
+    }
+    for (int i = 0; i < SCENE_BUFFERS; i++) {
+        ss->buffers[i] = malloc(sc->width*sc->height*2);
+    }
+
+    return src;
+}
+
+/*
+ * Runs a synthetic scene through the capture pipeline as fast as it goes and
+ * prints how far off the crossing times were and the frame rate.  Returns
+ * the number of crossings missed or extra.
+ */
+int
+run_scene(const struct scene *sc, bool quiet)
+{
+    struct frame_source *src = open_scene_source(sc);
+    struct scene_source *ss = (struct scene_source *)src;
+
+    const enum camera_role roles[] = { CAMERA_FINISH };
+    struct race race;
+    init_race(&race, 1, roles);
+
+    struct capture_data cd = {};
+    cd.source = src;
+    cd.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    cd.pixelformat = src->pixelformat;
+    cd.width = src->width;
+    cd.height = src->height;
+    cd.readout_ns = sc->readout_ns;
+    // only the detection is timed, nothing is drawn or published
+    cd.headless = true;
+    cd.race = &race;
+    cd.max_crossing_log = 2*sc->n_crossings + 4;
+    cd.crossing_log = malloc(cd.max_crossing_log*sizeof(cd.crossing_log[0]));
+    init_triple_buffer(&cd.display);
+    atomic_init(&cd.running, true);
+
+    u64 start = monotonic_ns();
+    run_capture(&cd);
+    u64 elapsed = monotonic_ns() - start - ss->generate_ns;
+
+    // each crossing matched with the nearest measured one within half a lap
+    double *errors = malloc(sc->n_crossings*sizeof(errors[0]));
+    double *abs_errors = malloc(sc->n_crossings*sizeof(abs_errors[0]));
+    if (!errors || !abs_errors) {
+        errno_exit("malloc");
+    }
+    int n_errors = 0;
+    int matched = 0;
+    for (int k = 0; k < sc->n_crossings; k++) {
+        int best = -1;
+        for (int i = 0; i < cd.n_crossing_log; i++) {
+            s64 e = cd.crossing_log[i] - ss->crossings[k];
+            if (llabs(e) < sc->lap_s*5e8 && (best < 0 || llabs(e) < llabs((s64)(cd.crossing_log[best] - ss->crossings[k])))) {
+                best = i;
+            }
+        }
+        if (best >= 0) {
+            errors[n_errors++] = ((s64)(cd.crossing_log[best] - ss->crossings[k]))/1e6;
+            matched++;
+        }
+    }
+    int missed = sc->n_crossings - matched;
+    int extra = cd.n_crossing_log - matched;
+
+    double mean = 0, sd = 0;
+    for (int i = 0; i < n_errors; i++) {
+        mean += errors[i];
+    }
+    mean = n_errors ? mean/n_errors : 0;
+    for (int i = 0; i < n_errors; i++) {
+        sd += (errors[i] - mean)*(errors[i] - mean);
+    }
+    sd = n_errors > 1 ? sqrt(sd/(n_errors - 1)) : 0;
+
+    // sorted by size for the percentiles
+    for (int i = 0; i < n_errors; i++) {
+        abs_errors[i] = fabs(errors[i]);
+        for (int j = i; j > 0 && abs_errors[j] < abs_errors[j - 1]; j--) {
+            double t = abs_errors[j];
+            abs_errors[j] = abs_errors[j - 1];
+            abs_errors[j - 1] = t;
+        }
+    }
+
+    int n_frames = ss->next_frame - (int)cd.dropped_frames;
+    if (!quiet) {
+        printf("scene %ux%u@%.1f speed %.0f px/s noise %d drift %d readout %.1f ms drop %.2f, kernel %s\n",
+                sc->width, sc->height, mode_fps(&(struct capture_mode){ .interval = sc->interval }),
+                sc->speed, sc->noise, sc->drift, sc->readout_ns/1e6, sc->drop, kernel->name);
+        printf("crossings %d, missed %d, extra %d\n", sc->n_crossings, missed, extra);
+        if (n_errors) {
+            printf("error ms: mean %+.3f sd %.3f, |error| p50 %.3f p90 %.3f max %.3f\n", mean, sd,
+                    abs_errors[n_errors/2], abs_errors[n_errors*9/10], abs_errors[n_errors - 1]);
+        }
+        printf("%d frames (%lu dropped) in %.1f ms, %.0f fps\n", n_frames, cd.dropped_frames,
+                elapsed/1e6, elapsed ? n_frames*1e9/elapsed : 0.0);
+    }
+
+    free(errors);
+    free(abs_errors);
+    free_capture_images(&cd);
+    free(cd.crossing_log);
+    close(cd.wake_fd);
+    SDL_DestroyMutex(race.mutex);
+    src->close(src);
+
+    return missed + extra;
+}
+
+// a camera, its capture thread and how the display shows it
+struct camera {
+    char *name;
+    enum camera_role role;
+    struct frame_source *source;
+    struct capture_data cd;
+    SDL_Thread *thread;
+
+    // where the gray and color frames are shown
+    SDL_Rect views[2];
+    SDL_Texture *gray_texture;
+    SDL_Texture *color_texture;
+    // SDL has no single channel texture so the gray view is YV12 with a
+    // constant chroma plane uploaded with the luma
+    u8 *gray_chroma;
+    // shown until the background is ready
+    image *checkerboard1;
+    image *checkerboard2;
+};
+
+// starts every capture thread, the display owns the front of each triple
+// buffer from here on
+void
+start_cameras(struct camera *cameras, int n_cameras)
+{
+    for (int i = 0; i < n_cameras; i++) {
+        struct capture_data *cd = &cameras[i].cd;
+        init_triple_buffer(&cd->display);
+        atomic_init(&cd->running, true);
+        cameras[i].thread = SDL_CreateThread(run_capture, "capture", cd);
+    }
+}
+
+// stops and joins every capture thread, then closes the cameras
+void
+stop_cameras(struct camera *cameras, int n_cameras)
+{
+    // every capture thread is woken so they stop together within a frame
+    // of processing
+    u64 stop_ns = monotonic_ns();
+    for (int i = 0; i < n_cameras; i++) {
+        stop_capture(&cameras[i].cd);
+    }
+
+    for (int i = 0; i < n_cameras; i++) {
+        struct camera *cam = &cameras[i];
+        if (cam->thread) {
+            int tr;
+            SDL_WaitThread(cam->thread, &tr);
+            debugf("capture thread %d returned: %d", i, tr);
+        }
+        if (cam->cd.photo_finish) {
+            stop_photo_finish(cam->cd.photo_finish);
+        }
+        if (cam->cd.recorder) {
+            close_recorder(cam->cd.recorder);
+        }
+        close(cam->cd.wake_fd);
+        free_capture_images(&cam->cd);
+
+        cam->source->close(cam->source);
+
+        free_image(cam->checkerboard1);
+        free_image(cam->checkerboard2);
+        free(cam->gray_chroma);
+    }
+    debugf("capture stopped in %.1f ms", (monotonic_ns() - stop_ns)/1e6);
+}
+
+// a line of control from stdin, false to quit
+static bool
+headless_command(struct camera *cameras, int n_cameras, struct race *race, const char *command)
+{
+    if (strcmp(command, "reset") == 0) {
+        race_reset(race);
+        for (int i = 0; i < n_cameras; i++) {
+            atomic_store(&cameras[i].cd.reset_race, true);
+        }
+    } else if (strcmp(command, "step") == 0) {
+        for (int i = 0; i < n_cameras; i++) {
+            if (cameras[i].source->step) {
+                cameras[i].source->step(cameras[i].source);
+                wake_capture(&cameras[i].cd);
+            }
+        }
+    } else if (strcmp(command, "latency") == 0) {
+        print_trace_summary(stderr);
+    } else if (strcmp(command, "quit") == 0) {
+        return false;
+    } else if (command[0]) {
+        SDL_Log("unknown command: %s, expected reset, step, latency or quit", command);
+    }
+
+    return true;
+}
+
+/*
+ * Timing without a display, the race's events are the output.  Control is
+ * lines on stdin: reset, step, latency and quit, or signals: INT and TERM
+ * quit, HUP and USR1 reset the race and USR2 prints the latencies.  The
+ * signals have to be blocked before the capture threads start so they all
+ * come here.  Returns when told to quit or every camera is done, like at
+ * the end of a replay.
+ */
+void
+run_headless(struct camera *cameras, int n_cameras, struct race *race, const sigset_t *signals)
+{
+    int signal_fd = signalfd(-1, signals, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        errno_exit("signalfd");
+    }
+
+    struct pollfd fds[2] = {
+        { .fd = signal_fd, .events = POLLIN },
+        { .fd = STDIN_FILENO, .events = POLLIN },
+    };
+    char line[256];
+    size_t len = 0;
+
+    bool running = true;
+    while (running) {
+        bool capturing = false;
+        for (int i = 0; i < n_cameras; i++) {
+            capturing = capturing || !atomic_load(&cameras[i].cd.done);
+        }
+        if (!capturing) {
+            break;
+        }
+
+        // wakes to check the cameras
+        if (poll(fds, 2, 100) <= 0) {
+            continue;
+        }
+
+        struct signalfd_siginfo si;
+        if ((fds[0].revents & POLLIN) && read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+            if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
+                running = false;
+            } else if (si.ssi_signo == SIGHUP || si.ssi_signo == SIGUSR1) {
+                running = headless_command(cameras, n_cameras, race, "reset");
+            } else if (si.ssi_signo == SIGUSR2) {
+                running = headless_command(cameras, n_cameras, race, "latency");
+            }
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = read(STDIN_FILENO, line + len, sizeof(line) - 1 - len);
+            if (n <= 0) {
+                // closed, only signals from now on
+                fds[1].fd = -1;
+                continue;
+            }
+            len += n;
+
+            char *start = line;
+            char *eol;
+            while (running && (eol = memchr(start, '\n', line + len - start))) {
+                *eol = '\0';
+                if (eol > start && eol[-1] == '\r') {
+                    eol[-1] = '\0';
+                }
+                running = headless_command(cameras, n_cameras, race, start);
+                start = eol + 1;
+            }
+            len -= start - line;
+            memmove(line, start, len);
+            if (len == sizeof(line) - 1) {
+                // too long for a command
+                len = 0;
+            }
+        }
+    }
+
+    close(signal_fd);
+}
+
+// writes the stage latencies if there's a file and frees the rings
+void
+save_trace(const char *trace_file)
+{
+    if (trace_file) {
+        if (write_trace(trace_file)) {
+            SDL_Log("wrote trace %s", trace_file);
+        } else {
+            SDL_Log("unable to write trace %s: %s", trace_file, strerror(errno));
+        }
+    }
+    free_trace_rings();
+}
+
+/*
+ * Screenshots and recording without reading back from the renderer.  The
+ * display copies what it shows, each camera's gray and color frames and the
+ * overlay layer, into a preallocated slot of a small queue.  A writer thread
+ * composites them on the CPU the way the renderer draws them and saves the
+ * BMP.  When the writer falls behind shots are dropped instead of waiting so
+ * the display loop never touches the disk.
+ */
+#define SHOT_QUEUE_SIZE 4
+
+struct shot_camera {
+    // luma, and the raw YUYV color view or NULL when it shows the luma
+    image *gray;
+    image *yuyv;
+    SDL_Rect views[2];
+    // only the first camera has a gray view
+    bool show_gray;
+};
+
+struct shot {
+    char filename[64];
+    struct shot_camera cameras[MAX_CAMERAS];
+    // BGRA drawn over the cameras
+    image *overlay;
+};
+
+struct shot_writer {
+    int n_cameras;
+    struct shot shots[SHOT_QUEUE_SIZE];
+    // the display queues at head and the writer takes from tail, a single
+    // producer and consumer
+    _Atomic u32 head;
+    _Atomic u32 tail;
+    // wakes the writer for a new shot or to stop
+    int wake_fd;
+    _Atomic bool running;
+    SDL_Thread *thread;
+    // composited shot and a converted camera row, writer only
+    image *frame;
+    u8 *row;
+
+    _Atomic u64 written;
+    _Atomic u64 failed;
+    // display only, shots that didn't fit in the queue and the most queued
+    u64 dropped;
+    u32 max_depth;
+};
+
+void
+init_shot_writer(struct shot_writer *w, const struct camera *cameras, int n_cameras, int width, int height)
+{
+    *w = (struct shot_writer){ .n_cameras = n_cameras };
+    w->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (w->wake_fd == -1) {
+        errno_exit("eventfd");
+    }
+    w->frame = new_image(width, height, 4);
+
+    u32 max_width = 0;
+    for (int i = 0; i < n_cameras; i++) {
+        if (cameras[i].cd.width > max_width) {
+            max_width = cameras[i].cd.width;
+        }
+    }
+    w->row = malloc(max_width*4);
+
+    for (int s = 0; s < SHOT_QUEUE_SIZE; s++) {
+        struct shot *shot = &w->shots[s];
+        shot->overlay = new_image(width, height, 4);
+        for (int i = 0; i < n_cameras; i++) {
+            const struct camera *cam = &cameras[i];
+            struct shot_camera *sc = &shot->cameras[i];
+            sc->gray = new_image(cam->cd.width, cam->cd.height, 1);
+            sc->yuyv = cam->cd.pixelformat == V4L2_PIX_FMT_GREY ? NULL : new_image(cam->cd.width, cam->cd.height, 2);
+            sc->views[OVERLAY_GRAY] = cam->views[OVERLAY_GRAY];
+            sc->views[OVERLAY_COLOR] = cam->views[OVERLAY_COLOR];
+            sc->show_gray = i == 0;
+        }
+    }
+}
+
+u32
+shot_queue_depth(struct shot_writer *w)
+{
+    return atomic_load_explicit(&w->head, memory_order_relaxed) - atomic_load_explicit(&w->tail, memory_order_relaxed);
+}
+
+// the next free slot for the display to fill, NULL and counted as dropped
+// when the queue is full
+struct shot *
+shot_begin(struct shot_writer *w)
+{
+    u32 head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&w->tail, memory_order_acquire) == SHOT_QUEUE_SIZE) {
+        w->dropped++;
+        return NULL;
+    }
+
+    return &w->shots[head % SHOT_QUEUE_SIZE];
+}
+
+// hands the slot from shot_begin to the writer
+void
+shot_queue(struct shot_writer *w)
+{
+    u32 head = atomic_load_explicit(&w->head, memory_order_relaxed) + 1;
+    atomic_store_explicit(&w->head, head, memory_order_release);
+
+    u32 depth = shot_queue_depth(w);
+    if (depth > w->max_depth) {
+        w->max_depth = depth;
+    }
+
+    wake_eventfd(w->wake_fd);
+}
+
+// what each camera's textures show, the frame in the display's slot or the
+// checkerboard before the background is ready
+void
+copy_shot(struct shot *shot, const struct camera *cameras, int n_cameras, const image *overlay)
+{
+    for (int i = 0; i < n_cameras; i++) {
+        const struct capture_data *cd = &cameras[i].cd;
+        struct shot_camera *sc = &shot->cameras[i];
+
+        const u8 *gray = cameras[i].checkerboard1->data;
+        const u8 *yuyv = cameras[i].checkerboard2->data;
+        u32 yuyv_stride = cameras[i].checkerboard2->stride;
+        if (atomic_load_explicit(&cd->valid_image, memory_order_acquire)) {
+            gray = cd->gray[cd->display.front]->data;
+            // the camera buffer's rows may be padded
+            yuyv = cd->frames[cd->display.front].data;
+            yuyv_stride = source_stride(cd->source);
+            if (!yuyv && cd->yuyv[cd->display.front]) {
+                yuyv = cd->yuyv[cd->display.front]->data;
+                yuyv_stride = cd->yuyv[cd->display.front]->stride;
+            }
+        }
+
+        memcpy(sc->gray->data, gray, sc->gray->n_pixels);
+        if (sc->yuyv && yuyv) {
+            for (int row = 0; row < sc->yuyv->height; row++) {
+                memcpy(sc->yuyv->data + row*sc->yuyv->stride, yuyv + row*yuyv_stride, sc->yuyv->width*2);
+            }
+        }
+    }
+
+    memcpy(shot->overlay->data, overlay->data, overlay->n_pixels*4);
+}
+
+// nearest neighbor scale of a camera frame into view, luma is shown like
+// the YV12 texture with neutral chroma
+static void
+composite_view(image *frame, const SDL_Rect *view, const image *gray, const image *yuyv, u8 *row)
+{
+    const image *src = yuyv ? yuyv : gray;
+    for (int y = clamp(view->y, 0, frame->height); y < view->y + view->h && y < frame->height; y++) {
+        int src_y = (y - view->y)*src->height/view->h;
+        if (yuyv) {
+            yuyv2rgba(yuyv->data + src_y*yuyv->stride, row, yuyv->width);
+        } else {
+            const u8 *g = gray->data + src_y*gray->stride;
+            for (int x = 0; x < gray->width; x++) {
+                u8 v = clamp255(g[x] - 16);
+                row[x*4] = v;
+                row[x*4 + 1] = v;
+                row[x*4 + 2] = v;
+                row[x*4 + 3] = 255;
+            }
+        }
+
+        u32 *out = (u32 *)(frame->data + y*frame->stride);
+        for (int x = clamp(view->x, 0, frame->width); x < view->x + view->w && x < frame->width; x++) {
+            int src_x = (x - view->x)*src->width/view->w;
+            memcpy(&out[x], row + src_x*4, 4);
+        }
+    }
+}
+
+// the shot as the renderer draws the display: black, the camera views and
+// the overlay blended over them.  row holds 4 bytes per pixel of the widest
+// camera.
+void
+composite_shot(const struct shot *shot, int n_cameras, image *frame, u8 *row)
+{
+    clear_image(frame);
+
+    for (int i = 0; i < n_cameras; i++) {
+        const struct shot_camera *sc = &shot->cameras[i];
+        if (sc->show_gray) {
+            composite_view(frame, &sc->views[OVERLAY_GRAY], sc->gray, NULL, row);
+        }
+        composite_view(frame, &sc->views[OVERLAY_COLOR], sc->gray, sc->yuyv, row);
+    }
+
+    const u8 *ov = shot->overlay->data;
+    u8 *out = frame->data;
+    for (int i = 0; i < frame->n_pixels*4; i += 4) {
+        int a = ov[i + 3];
+        for (int c = 0; c < 3; c++) {
+            out[i + c] = (ov[i + c]*a + out[i + c]*(255 - a) + 127)/255;
+        }
+        out[i + 3] = 255;
+    }
+}
+
+int
+run_shot_writer(void *data)
+{
+    struct shot_writer *w = data;
+
+    // everything queued before stop_shot_writer is written
+    for (;;) {
+        u32 tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&w->head, memory_order_acquire)) {
+            if (!atomic_load(&w->running)) {
+                break;
+            }
+            u64 count;
+            if (read(w->wake_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+                debugf("eventfd read: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        // the display may reuse the slot once it's released
+        const struct shot *shot = &w->shots[tail % SHOT_QUEUE_SIZE];
+        char filename[sizeof(shot->filename)];
+        memcpy(filename, shot->filename, sizeof(filename));
+        composite_shot(shot, w->n_cameras, w->frame, w->row);
+        atomic_store_explicit(&w->tail, tail + 1, memory_order_release);
+
+        SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(w->frame->data, w->frame->width, w->frame->height, 32,
+                w->frame->stride, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
+        if (surface && SDL_SaveBMP(surface, filename) == 0) {
+            atomic_fetch_add(&w->written, 1);
+        } else {
+            SDL_Log("unable to save %s: %s", filename, SDL_GetError());
+            atomic_fetch_add(&w->failed, 1);
+        }
+        SDL_FreeSurface(surface);
+    }
+
+    return 0;
+}
+
+void
+start_shot_writer(struct shot_writer *w)
+{
+    atomic_init(&w->running, true);
+    w->thread = SDL_CreateThread(run_shot_writer, "shot writer", w);
+}
+
+// writes what's queued and frees the writer
+void
+stop_shot_writer(struct shot_writer *w)
+{
+    atomic_store(&w->running, false);
+    wake_eventfd(w->wake_fd);
+    if (w->thread) {
+        SDL_WaitThread(w->thread, NULL);
+    }
+
+    u64 written = atomic_load(&w->written);
+    if (written || w->dropped) {
+        SDL_Log("shots written %lu, dropped %lu, failed %lu, max queued %u of %d", written, w->dropped,
+                atomic_load(&w->failed), w->max_depth, SHOT_QUEUE_SIZE);
+    }
+
+    close(w->wake_fd);
+    free_image(w->frame);
+    free(w->row);
+    for (int s = 0; s < SHOT_QUEUE_SIZE; s++) {
+        free_image(w->shots[s].overlay);
+        for (int i = 0; i < w->n_cameras; i++) {
+            free_image(w->shots[s].cameras[i].gray);
+            free_image(w->shots[s].cameras[i].yuyv);
+        }
+    }
+}
+
+// a long car moving across a 64 column finish line at a known speed, sampled
+// at 20fps.  The estimate should be much better than the 50ms frame time.
+// The fastest one is only seen partially in one frame so it's a guess.
+int
+test_crossing_estimate()
+{
+    const int width = 64;
+    const int line_x = width/2;
+    const u64 frame_ns = 50000000;
+    // px per ms, offset of the frame times from when the edge was at 0
+    const double speeds[] = { 0.4, 0.8, 1.2 };
+    const double offsets[] = { 3.0, 17.0, 41.0 };
+
+    int failed = 0;
+    for (int dir = -1; dir <= 1; dir += 2) {
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                struct crossing c = {};
+                u16 profile[width];
+                double speed = speeds[i];
+                u64 start = 1000000000;
+                // true time the edge gets to line_x
+                double expected_ms = line_x/speed;
+                bool triggered = false;
+
+                for (int f = 0; f < 10; f++) {
+                    double t = f*frame_ns/1e6 - offsets[j];
+                    double edge = t*speed;
+
+                    // car is 200px long, columns count when the car covers
+                    // their center
+                    for (int x = 0; x < width; x++) {
+                        double pos = dir > 0 ? x + 0.5 : width - x - 0.5;
+                        profile[x] = (pos <= edge && pos > edge - 200) ? 100 : 0;
+                    }
+
+                    crossing_add(&c, start + f*frame_ns, profile, width, 16);
+
+                    if (triggered) {
+                        break;
+                    }
+
+                    // trigger at 20% of the width like the motion check
+                    triggered = edge >= width/5;
+                }
+
+                u64 ns = crossing_estimate(&c, width, line_x);
+                double actual_ms = ((s64)ns - (s64)start)/1e6 - offsets[j];
+                if (!ns || fabs(actual_ms - expected_ms) > 5.0) {
+                    printf("crossing_estimate: FAILED dir: %d, speed: %.1f, expected %.1f, got %.1f\n",
+                            dir, speed, expected_ms, actual_ms);
+                    failed++;
+                }
+            }
+        }
+    }
+
+    printf("crossing_estimate: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// a car filling rows 100-139 of a 256 row finish line at the bottom of a
+// 480 row frame, read out over 50ms
+int
+test_rolling_shutter()
+{
+    int failed = 0;
+    struct rolling_shutter rs = { .readout_ns = 50000000, .height = 480 };
+    u16 rows[256] = {};
+    for (int y = 100; y < 140; y++) {
+        rows[y] = 30;
+    }
+    rows[150] = 2;
+
+    double center;
+    int first, last;
+    if (!changed_rows(rows, 256, 8, &center, &first, &last) || first != 100 || last != 139
+            || fabs(center - 119.5 - 2*30.5/1202.0) > 0.01) {
+        printf("rolling_shutter: FAILED changed rows %d-%d center %.2f\n", first, last, center);
+        failed++;
+    }
+
+    u64 ns = row_time(&rs, 1000000000, 480 - 256 - 32 + center);
+    double expected_ms = (480 - 256 - 32 + center)*50.0/480;
+    if (fabs((ns - 1000000000)/1e6 - expected_ms) > 0.001) {
+        printf("rolling_shutter: FAILED row time %.3f expected %.3f\n", (ns - 1000000000)/1e6, expected_ms);
+        failed++;
+    }
+
+    memset(rows, 0, sizeof(rows));
+    if (changed_rows(rows, 256, 8, &center, &first, &last) || center != 128) {
+        printf("rolling_shutter: FAILED empty\n");
+        failed++;
+    }
+
+    printf("rolling_shutter: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// producer and consumer indexes never collide, the consumer gets the newest
+// frame and frames published over are counted
+int
+test_triple_buffer()
+{
+    int failed = 0;
+    struct triple_buffer tb;
+    init_triple_buffer(&tb);
+
+    // frame number in each slot
+    int slots[3] = { -1, -1, -1 };
+    int frame = 0;
+    u64 expected_overwritten = 0;
+
+    srand(3);
+    for (int i = 0; i < 1000; i++) {
+        int n = rand() % 4;
+        for (int j = 0; j < n; j++) {
+            if (tb.back == tb.front) {
+                failed++;
+            }
+            slots[tb.back] = frame++;
+            triple_buffer_publish(&tb);
+        }
+        if (n > 1) {
+            expected_overwritten += n - 1;
+        }
+
+        bool acquired = triple_buffer_acquire(&tb);
+        if (acquired != (n > 0) || (n > 0 && slots[tb.front] != frame - 1)) {
+            printf("triple_buffer: FAILED acquire %d after %d publishes\n", acquired, n);
+            failed++;
+        }
+    }
+
+    if (tb.front == tb.back || atomic_load(&tb.overwritten) != expected_overwritten) {
+        printf("triple_buffer: FAILED overwritten %lu expected %lu\n", atomic_load(&tb.overwritten),
+                expected_overwritten);
+        failed++;
+    }
+
+    printf("triple_buffer: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// the summary only sees the newest events and the trace file every event
+// still in the rings
+int
+test_trace()
+{
+    int failed = 0;
+
+    struct trace_ring *camera = new_trace_ring("camera 0");
+    struct trace_ring *display = new_trace_ring("display");
+    trace_stage(NULL, STAGE_DETECT, 0, 0, 0, 0, 0);
+
+    // wraps the ring, latencies 0-99 ms
+    const int n_events = TRACE_RING_SIZE + 3000;
+    for (int i = 0; i < n_events; i++) {
+        u64 base = i*33333333ull;
+        trace_stage(camera, STAGE_DETECT, 0, i, base, base + 1000000, base + (i % 100)*1000000ull);
+    }
+    trace_stage(display, STAGE_PRESENT, 1, 7, 1000000, 2000000, 5000000);
+
+    struct stage_stats stats[N_STAGES];
+    trace_summary(stats);
+    const struct stage_stats *detect = &stats[STAGE_DETECT];
+    const struct stage_stats *present = &stats[STAGE_PRESENT];
+    if (detect->n != TRACE_SUMMARY_EVENTS || detect->p50 < 45000000 || detect->p50 > 55000000
+            || detect->p99 < 97000000 || detect->max != 99000000) {
+        printf("trace: FAILED detect n %d p50 %lu p99 %lu max %lu\n", detect->n, detect->p50, detect->p99, detect->max);
+        failed++;
+    }
+    if (present->n != 1 || present->p50 != 4000000 || present->max != 4000000 || stats[STAGE_UPLOAD].n) {
+        printf("trace: FAILED present n %d p50 %lu upload n %d\n", present->n, present->p50, stats[STAGE_UPLOAD].n);
+        failed++;
+    }
+
+    char filename[] = "/tmp/trace-XXXXXX";
+    int fd = mkstemp(filename);
+    close(fd);
+    int n_complete = 0;
+    bool names = false;
+    if (write_trace(filename)) {
+        FILE *f = fopen(filename, "r");
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            n_complete += strstr(line, "\"ph\":\"X\"") != NULL;
+            names |= strstr(line, "\"name\":\"display\"") != NULL;
+        }
+        fclose(f);
+    }
+    unlink(filename);
+    if (n_complete != TRACE_RING_SIZE + 1 || !names) {
+        printf("trace: FAILED %d events in the trace file, expected %d\n", n_complete, TRACE_RING_SIZE + 1);
+        failed++;
+    }
+
+    free_trace_rings();
+
+    printf("trace: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// everything drawn on the overlay layer is inside its damage, so copying
+// the damage from the base clears it, and that's a small part of the layer
+int
+test_damage()
+{
+    int failed = 0;
+    image *base = new_image(1280, 720, 4);
+    image *img = new_image_like(base);
+    struct damage d = {};
+    img->damage = &d;
+
+    struct overlay o = {
+        .rect_color = &RED, .rect_x = 288, .rect_y = 192, .rect_width = 64, .rect_height = 256,
+    };
+    overlay_text(&o, OVERLAY_GRAY, 2, 2, &WHITE, "lap 1: 12.345 4.321 8.765 fastest");
+    overlay_text(&o, OVERLAY_COLOR, 2, 464, &RED, "dropped 3 frames");
+    const SDL_Rect views[2] = { { 0, 0, 640, 480 }, { 640, 0, 640, 480 } };
+    draw_overlay(img, &o, views, 640, 480);
+    fill_square_center(img, 4, 4, 4, &RED);
+    draw_text(img, 970, 700, 1, &BLACK, "shots queued 0/4 dropped 0");
+
+    int area = 0;
+    for (int i = 0; i < d.n_rects; i++) {
+        area += d.rects[i].w*d.rects[i].h;
+    }
+    struct damage merged = d;
+    damage_merge(&merged, &d);
+    failed += d.all || area > img->n_pixels/10 || merged.n_rects != d.n_rects;
+
+    copy_damage(img, base, &d);
+    int left = 0;
+    for (int i = 0; i < img->n_pixels*4; i++) {
+        left += img->data[i] != 0;
+    }
+    failed += left != 0;
+
+    printf("damage: %s, %d rects %.1f%% of the layer\n", failed ? "FAILED" : "ok", d.n_rects,
+            100.0*area/img->n_pixels);
+
+    free_image(base);
+    free_image(img);
+
+    return failed;
+}
+
+// the queue drops shots when full and the composite matches what the
+// renderer draws
+int
+test_shot()
+{
+    int failed = 0;
+
+    struct camera cameras[2] = {};
+    cameras[0].cd = (struct capture_data){ .width = 64, .height = 48, .pixelformat = V4L2_PIX_FMT_YUYV };
+    cameras[0].views[OVERLAY_GRAY] = (SDL_Rect){ .x = 0, .y = 0, .w = 32, .h = 24 };
+    cameras[0].views[OVERLAY_COLOR] = (SDL_Rect){ .x = 32, .y = 0, .w = 32, .h = 24 };
+    cameras[1].cd = (struct capture_data){ .width = 32, .height = 24, .pixelformat = V4L2_PIX_FMT_GREY };
+    cameras[1].views[OVERLAY_GRAY] = (SDL_Rect){ .x = 0, .y = 24, .w = 32, .h = 24 };
+    cameras[1].views[OVERLAY_COLOR] = cameras[1].views[OVERLAY_GRAY];
+
+    struct shot_writer w;
+    init_shot_writer(&w, cameras, 2, 64, 48);
+
+    for (int i = 0; i < SHOT_QUEUE_SIZE + 1; i++) {
+        struct shot *shot = shot_begin(&w);
+        if ((shot != NULL) != (i < SHOT_QUEUE_SIZE)) {
+            printf("shot: FAILED slot %d %s\n", i, shot ? "not full" : "full");
+            failed++;
+        }
+        if (shot) {
+            shot_queue(&w);
+        }
+    }
+    if (w.dropped != 1 || w.max_depth != SHOT_QUEUE_SIZE) {
+        printf("shot: FAILED dropped %lu max queued %u\n", w.dropped, w.max_depth);
+        failed++;
+    }
+
+    // luma 100 and 200 on the left and right of camera 0, neutral chroma,
+    // camera 1 is 50
+    struct shot *shot = &w.shots[0];
+    image *gray = shot->cameras[0].gray;
+    image *yuyv = shot->cameras[0].yuyv;
+    for (int y = 0; y < 48; y++) {
+        for (int x = 0; x < 64; x++) {
+            u8 luma = x < 32 ? 100 : 200;
+            gray->data[y*gray->stride + x] = luma;
+            yuyv->data[y*yuyv->stride + x*2] = luma;
+            yuyv->data[y*yuyv->stride + x*2 + 1] = 128;
+        }
+    }
+    memset(shot->cameras[1].gray->data, 50, shot->cameras[1].gray->n_pixels);
+    clear_image(shot->overlay);
+    set_pixel(shot->overlay, 1, 1, &RED);
+    set_pixel(shot->overlay, 40, 40, &BLUE);
+
+    composite_shot(shot, 2, w.frame, w.row);
+
+    // x, y, bgr
+    const int expected[][5] = {
+        { 1, 1, 0, 0, 255 },
+        { 5, 5, 84, 84, 84 },
+        { 20, 5, 184, 184, 184 },
+        { 40, 5, 84, 84, 84 },
+        { 60, 20, 184, 184, 184 },
+        { 5, 30, 34, 34, 34 },
+        // 128 alpha blue over nothing
+        { 40, 40, 128, 0, 0 },
+        { 50, 40, 0, 0, 0 },
+    };
+    for (int i = 0; i < (int)(sizeof(expected)/sizeof(expected[0])); i++) {
+        const u8 *p = w.frame->data + expected[i][1]*w.frame->stride + expected[i][0]*4;
+        if (p[0] != expected[i][2] || p[1] != expected[i][3] || p[2] != expected[i][4] || p[3] != 255) {
+            printf("shot: FAILED pixel %d,%d: %u %u %u %u\n", expected[i][0], expected[i][1], p[0], p[1], p[2], p[3]);
+            failed++;
+        }
+    }
+
+    stop_shot_writer(&w);
+
+    printf("shot: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// the window around a crossing is frozen without a copy and saved as a Y4M
+// that replays with the capture timestamps
+int
+test_photo_finish()
+{
+    int failed = 0;
+
+    // big enough for the finish line to replay it
+    const u32 width = 200;
+    const u32 height = 288;
+    // padded rows like some drivers
+    const u32 stride = width*2 + 32;
+    struct frame_source src = {
+        .pixelformat = V4L2_PIX_FMT_YUYV, .width = width, .height = height,
+        .bytesperline = stride, .interval = { 1, 100 },
+    };
+    struct photo_finish *pf = new_photo_finish(0, &src, 2, 1, false);
+    pf->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    atomic_init(&pf->running, false);
+    char dir[] = "/tmp/race-monitor-finish-XXXXXX";
+    pf->dir = mkdtemp(dir);
+    if (!pf->dir) {
+        printf("photo_finish: FAILED mkdtemp\n");
+        failed++;
+    }
+
+    // luma is the frame number, chroma neutral
+    u8 *data = malloc(stride*height);
+    const u64 base_ns = 987654321000;
+    for (u32 i = 0; i < 10; i++) {
+        memset(data, 0xee, stride*height);
+        for (u32 p = 0; p < width*height; p++) {
+            data[p/width*stride + p%width*2] = 16 + i;
+            data[p/width*stride + p%width*2 + 1] = 128;
+        }
+        struct frame f = { .data = data, .bytesused = stride*height, .sequence = i };
+        photo_finish_add(pf, &f, base_ns + i*10000000);
+        if (i == 5 || i == 7) {
+            photo_finish_trigger(pf, base_ns + i*10000000);
+        }
+    }
+
+    // 3-6 frozen, the crossing at 7 came while it was waiting to be saved
+    if (!atomic_load(&pf->busy) || pf->n_window != 4 || pf->missed != 1) {
+        printf("photo_finish: FAILED busy %d window %d missed %lu\n", atomic_load(&pf->busy), pf->n_window, pf->missed);
+        failed++;
+    }
+    for (int i = 0; i < pf->n_window; i++) {
+        const struct finish_frame *frame = &pf->window[i];
+        if (frame->sequence != (u32)(3 + i) || frame->data[0] != 19 + i) {
+            printf("photo_finish: FAILED window %d sequence %u luma %u\n", i, frame->sequence, frame->data[0]);
+            failed++;
+        }
+    }
+
+    run_photo_finish(pf);
+
+    char filename[320];
+    snprintf(filename, sizeof(filename), "%s/finish-0-%lu.y4m", dir, base_ns + 50000000);
+    struct frame_source *replay = open_file_source(filename, &(struct capture_mode){}, REPLAY_FAST);
+    int n_frames = 0;
+    if (replay) {
+        replay->start(replay);
+        struct frame f;
+        while (replay->next(replay, -1, 0, &f) == FRAME_READY) {
+            if (f.timestamp_ns != base_ns + (3 + n_frames)*10000000ull || f.data[0] != 19 + n_frames
+                    || f.data[width*height - 1] != 19 + n_frames || f.data[width*height] != 128) {
+                printf("photo_finish: FAILED replay frame %d ts %lu luma %u\n", n_frames, f.timestamp_ns, f.data[0]);
+                failed++;
+            }
+            replay->release(replay, &f);
+            n_frames++;
+        }
+        replay->stop(replay);
+        replay->close(replay);
+    }
+    unlink(filename);
+    rmdir(dir);
+    if (pf->too_big || n_frames != 4 || atomic_load(&pf->saved) != 1) {
+        printf("photo_finish: FAILED %d frames replayed, %lu saved\n", n_frames, atomic_load(&pf->saved));
+        failed++;
+    }
+
+    stop_photo_finish(pf);
+    free(data);
+
+    printf("photo_finish: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// recordings replay with their timestamps and sequences through io_uring
+// and the writer threads, and without the index when never closed
+int
+test_recorder()
+{
+    int failed = 0;
+
+    const u32 width = 200;
+    const u32 height = 288;
+    // rows padded like some drivers
+    const u32 stride = width*2 + 32;
+    const u32 size = stride*height;
+    const int n_frames = 200;
+    u8 *data = malloc(size);
+
+    for (int uring = 1; uring >= 0; uring--) {
+        char filename[] = "/tmp/race-monitor-record-XXXXXX";
+        int fd = mkstemp(filename);
+        close(fd);
+
+        struct recorder *rec = open_recorder(filename, 0, V4L2_PIX_FMT_YUYV, width, height, stride,
+                (struct v4l2_fract){ 1, 60 }, uring);
+        // every other sequence number so they're not the frame numbers
+        for (int i = 0; i < n_frames; i++) {
+            memset(data, i, size);
+            recorder_add(rec, data, size, 2*i, 1000000000ull + i*16666667ull);
+        }
+        u64 dropped = rec->dropped;
+        u64 index_offset = rec->size;
+        close_recorder(rec);
+
+        // the second time without the index
+        for (int closed = 1; closed >= 0; closed--) {
+            if (!closed && truncate(filename, index_offset) == -1) {
+                failed++;
+            }
+
+            struct frame_source *src = open_file_source(filename, &(struct capture_mode){}, REPLAY_FAST);
+            int n = 0;
+            if (src) {
+                src->start(src);
+                struct frame f;
+                int last = -1;
+                while (src->next(src, -1, 0, &f) == FRAME_READY) {
+                    int i = f.sequence/2;
+                    if (i <= last || f.bytesused != size || f.data[0] != (u8)i || f.data[size - 1] != (u8)i
+                            || f.timestamp_ns != 1000000000ull + i*16666667ull) {
+                        printf("recorder %s: FAILED frame %d sequence %u\n", uring ? "io_uring" : "pwrite", n, f.sequence);
+                        failed++;
+                    }
+                    last = i;
+                    n++;
+                }
+                if (src->pixelformat != V4L2_PIX_FMT_YUYV || src->width != width || src->bytesperline != stride
+                        || src->interval.denominator != 60) {
+                    printf("recorder: FAILED mode\n");
+                    failed++;
+                }
+                src->close(src);
+            }
+            if (n != n_frames - (int)dropped) {
+                printf("recorder %s: FAILED %d frames replayed%s, %d recorded\n", uring ? "io_uring" : "pwrite", n,
+                        closed ? "" : " without the index", n_frames - (int)dropped);
+                failed++;
+            }
+        }
+        unlink(filename);
+    }
+
+    // an index offset past the trailer falls back to the frame headers,
+    // a frame smaller than the mode isn't replayed
+    char filename[] = "/tmp/race-monitor-record-XXXXXX";
+    int fd = mkstemp(filename);
+    struct recorder *rec = open_recorder(filename, 0, V4L2_PIX_FMT_YUYV, width, height, 0,
+            (struct v4l2_fract){ 1, 60 }, false);
+    for (int i = 0; i < 3; i++) {
+        recorder_add(rec, data, size, i, 1000000000ull + i*16666667ull);
+    }
+    close_recorder(rec);
+
+    struct stat st;
+    const u64 bad_offset = ~7ull;
+    const u32 small_size = 4;
+    for (int small = 0; small < 2; small++) {
+        if (fstat(fd, &st) == -1
+                || pwrite(fd, &bad_offset, 8, st.st_size - sizeof(struct record_trailer) + 8) != 8
+                || (small && pwrite(fd, &small_size, 4, sizeof(struct record_header) + 4) != 4)) {
+            failed++;
+        }
+        struct frame_source *src = open_file_source(filename, &(struct capture_mode){}, REPLAY_FAST);
+        int n = 0;
+        if (src) {
+            src->start(src);
+            struct frame f;
+            while (src->next(src, -1, 0, &f) == FRAME_READY) {
+                n++;
+            }
+            src->close(src);
+        }
+        if (n != (small ? 0 : 3)) {
+            printf("recorder: FAILED %d frames replayed from a bad %s\n", n, small ? "frame" : "index");
+            failed++;
+        }
+    }
+    close(fd);
+    unlink(filename);
+    free(data);
+
+    printf("recorder: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// buffers go back to the driver once their owner releases them, one the
+// driver won't take is kept to try again
+int
+test_frame_pool()
+{
+    int failed = 0;
+    struct frame_pool pool = { .n_buffers = 4, .memory = V4L2_MEMORY_MMAP };
+
+    // all dequeued, the display keeps 0 and 1
+    frame_release(&pool, 2);
+    frame_release(&pool, 3);
+    failed += atomic_load(&pool.released) != 0xc;
+
+    frame_release(&pool, 1);
+    failed += atomic_load(&pool.released) != 0xe;
+
+    frame_release(&pool, 0);
+    failed += atomic_load(&pool.released) != 0xf;
+
+    // the driver had 1 and 3 when the stream was stopped
+    atomic_store(&pool.released, 0);
+    pool.queued = 0xa;
+    frame_pool_streamoff(&pool);
+    failed += atomic_load(&pool.released) != 0xa || pool.queued != 0;
+
+    // QBUF fails without a camera
+    failed += frame_pool_requeue(&pool, -1) != 0 || atomic_load(&pool.released) != 0xa;
+
+    printf("frame_pool: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// a pipe stands in for the camera.  stop_capture has to wake a wait long
+// before its timeout.
+int
+test_wait_frame()
+{
+    int failed = 0;
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        printf("wait_frame: FAILED pipe\n");
+        return 1;
+    }
+
+    struct capture_data cd = {};
+    cd.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    atomic_init(&cd.running, true);
+
+    u64 start = monotonic_ns();
+    bool frame = wait_frame(pipe_fds[0], cd.wake_fd, 20);
+    u64 elapsed = monotonic_ns() - start;
+    if (frame || elapsed < 15000000) {
+        printf("wait_frame: FAILED timeout %.1f ms\n", elapsed/1e6);
+        failed++;
+    }
+
+    stop_capture(&cd);
+    start = monotonic_ns();
+    frame = wait_frame(pipe_fds[0], cd.wake_fd, 1000);
+    elapsed = monotonic_ns() - start;
+    if (frame || atomic_load(&cd.running) || elapsed > 100000000) {
+        printf("wait_frame: FAILED wakeup %.1f ms\n", elapsed/1e6);
+        failed++;
+    }
+
+    // the wakeup was consumed
+    failed += wait_frame(pipe_fds[0], cd.wake_fd, 0);
+
+    if (write(pipe_fds[1], "f", 1) != 1 || !wait_frame(pipe_fds[0], cd.wake_fd, 1000)) {
+        printf("wait_frame: FAILED frame\n");
+        failed++;
+    }
+
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    close(cd.wake_fd);
+
+    printf("wait_frame: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// 30 fps deadlines keep their phase through a late present and restart a
+// period out after an idle display
+int
+test_pacing()
+{
+    int failed = 0;
+    const u64 period = 33333333;
+
+    u64 deadline = next_deadline_ns(1000000000, 1002000000, period);
+    if (deadline != 1033333333) {
+        printf("pacing: FAILED late present %lu\n", deadline);
+        failed++;
+    }
+    deadline = next_deadline_ns(1000000000, 5000000000, period);
+    if (deadline != 5033333333) {
+        printf("pacing: FAILED idle %lu\n", deadline);
+        failed++;
+    }
+
+    u64 start = monotonic_ns();
+    sleep_until_ns(start + 10000000);
+    u64 elapsed = monotonic_ns() - start;
+    if (elapsed < 10000000 || elapsed > 100000000) {
+        printf("pacing: FAILED sleep %.1f ms\n", elapsed/1e6);
+        failed++;
+    }
+    // a past deadline doesn't sleep
+    start = monotonic_ns();
+    sleep_until_ns(start - period);
+    sleep_until_ns(0);
+    elapsed = monotonic_ns() - start;
+    if (elapsed > 5000000) {
+        printf("pacing: FAILED past deadline %.1f ms\n", elapsed/1e6);
+        failed++;
+    }
+
+    printf("pacing: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// 48x16 gray ramp next to a flat ramp, 4:2:2, restart every 2 MCUs and no
+// DHT like MJPEG frames
+static const u8 test_jpeg_data[] = {
+    0xff, 0xd8, 0xff, 0xdb, 0x00, 0x43, 0x00, 0x02, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x01, 0x01,
+    0x01, 0x02, 0x02, 0x02, 0x02, 0x02, 0x04, 0x03, 0x02, 0x02, 0x02, 0x02, 0x05, 0x04, 0x04, 0x03,
+    0x04, 0x06, 0x05, 0x06, 0x06, 0x06, 0x05, 0x06, 0x06, 0x06, 0x07, 0x09, 0x08, 0x06, 0x07, 0x09,
+    0x07, 0x06, 0x06, 0x08, 0x0b, 0x08, 0x09, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x06, 0x08, 0x0b, 0x0c,
+    0x0b, 0x0a, 0x0c, 0x09, 0x0a, 0x0a, 0x0a, 0xff, 0xdb, 0x00, 0x43, 0x01, 0x02, 0x02, 0x02, 0x02,
+    0x02, 0x02, 0x05, 0x03, 0x03, 0x05, 0x0a, 0x07, 0x06, 0x07, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
+    0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
+    0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a,
+    0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0xff, 0xc0, 0x00, 0x11,
+    0x08, 0x00, 0x10, 0x00, 0x30, 0x03, 0x01, 0x21, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01, 0xff,
+    0xdd, 0x00, 0x04, 0x00, 0x02, 0xff, 0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11,
+    0x00, 0x3f, 0x00, 0xfc, 0xe5, 0xf0, 0xd7, 0x82, 0x3e, 0xef, 0xee, 0x7f, 0x4a, 0xf4, 0x0f, 0x0d,
+    0x78, 0x23, 0xee, 0xfe, 0xe7, 0xf4, 0xa0, 0x0f, 0x40, 0xf0, 0xd7, 0x82, 0x3e, 0xef, 0xee, 0x7f,
+    0x4a, 0xfd, 0x82, 0xff, 0x00, 0x85, 0x93, 0xff, 0x00, 0x4f, 0x1f, 0xad, 0x00, 0x7f, 0xff, 0xd0,
+    0xfb, 0xa3, 0xfe, 0x16, 0x4f, 0xfd, 0x3c, 0x7e, 0xb4, 0x7f, 0xc2, 0xc9, 0xff, 0x00, 0xa7, 0x8f,
+    0xd6, 0x80, 0x3f, 0x17, 0x7c, 0x35, 0xe0, 0x8f, 0xbb, 0xfb, 0x9f, 0xd2, 0xbd, 0x03, 0xc3, 0x5e,
+    0x08, 0xfb, 0xbf, 0xb9, 0xfd, 0x28, 0x03, 0xff, 0xd1, 0xe1, 0x7c, 0x35, 0xe0, 0x8f, 0xbb, 0xfb,
+    0x9f, 0xd2, 0xbe, 0xa2, 0xff, 0x00, 0x85, 0x93, 0xff, 0x00, 0x4f, 0x1f, 0xad, 0x00, 0x1f, 0xf0,
+    0xb2, 0x7f, 0xe9, 0xe3, 0xf5, 0xa3, 0xfe, 0x16, 0x4f, 0xfd, 0x3c, 0x7e, 0xb4, 0x01, 0xff, 0xd9,
+};
+
+int
+test_jpeg()
+{
+    const int width = 48;
+    const int height = 16;
+    int failed = 0;
+
+    jpeg_decoder d;
+    jpeg_init(&d);
+    if (!jpeg_parse(&d, test_jpeg_data, sizeof(test_jpeg_data)) || d.width != width || d.height != height) {
+        printf("jpeg: FAILED parse\n");
+        return 1;
+    }
+
+    u8 luma[width*height];
+    u8 yuyv[width*height*2];
+    if (!jpeg_decode_frame(&d, luma, width, yuyv, width*2)) {
+        printf("jpeg: FAILED decode\n");
+        return 1;
+    }
+
+    int max_error = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int expected = x < 24 ? 40 + x*2 + y*3 : 200 - y*4;
+            int error = abs(luma[y*width + x] - expected);
+            max_error = error > max_error ? error : max_error;
+            failed += yuyv[(y*width + x)*2] != luma[y*width + x];
+            failed += abs(yuyv[(y*width + x)*2 + 1] - 0x80) > 2;
+        }
+    }
+    failed += max_error > 4;
+
+    // starts in the second restart interval and crosses into the third
+    const int rx = 20;
+    const int ry = 9;
+    const int rw = 23;
+    const int rh = 6;
+    u8 roi[rw*rh];
+    if (!jpeg_parse(&d, test_jpeg_data, sizeof(test_jpeg_data))
+            || !jpeg_decode_luma(&d, roi, rw, rx, ry, rw, rh)) {
+        failed++;
+    } else {
+        for (int y = 0; y < rh; y++) {
+            failed += memcmp(roi + y*rw, luma + (ry + y)*width + rx, rw) != 0;
+        }
+    }
+
+    // progressive isn't supported
+    u8 progressive[sizeof(test_jpeg_data)];
+    memcpy(progressive, test_jpeg_data, sizeof(progressive));
+    for (size_t i = 0; i + 1 < sizeof(progressive); i++) {
+        if (progressive[i] == 0xff && progressive[i + 1] == 0xc0) {
+            progressive[i + 1] = 0xc2;
+            break;
+        }
+    }
+    failed += jpeg_parse(&d, progressive, sizeof(progressive));
+
+    // more 1 bit codes than there are, and a DRI too short for its interval
+    u8 bits[16 + 256] = { 200 };
+    jpeg_huffman h;
+    failed += jpeg_build_huffman(&h, bits, bits + 16);
+    u8 short_dri[sizeof(test_jpeg_data) + 4] = { 0xff, 0xd8, 0xff, 0xdd, 0x00, 0x02 };
+    memcpy(short_dri + 6, test_jpeg_data + 2, sizeof(test_jpeg_data) - 2);
+    failed += jpeg_parse(&d, short_dri, sizeof(short_dri));
+
+    printf("jpeg: %s, max luma error %d\n", failed ? "FAILED" : "ok", max_error);
+
+    return failed;
+}
+
+int
+test_capture_mode()
+{
+    const u32 grey = V4L2_PIX_FMT_GREY;
+    const u32 yuyv = V4L2_PIX_FMT_YUYV;
+    const u32 mjpg = V4L2_PIX_FMT_MJPEG;
+    const struct capture_mode modes[] = {
+        { yuyv, 1280, 720, { 1, 10 } },
+        { yuyv, 640, 480, { 1, 30 } },
+        { yuyv, 320, 240, { 1, 120 } },
+        { mjpg, 1280, 720, { 1, 60 } },
+        { mjpg, 640, 480, { 1, 60 } },
+        { grey, 800, 600, { 1, 60 } },
+        { V4L2_PIX_FMT_RGB24, 640, 480, { 1, 90 } },
+    };
+    const int n = sizeof(modes)/sizeof(modes[0]);
+
+    struct {
+        const char *f;
+        int expected;
+    } cases[] = {
+        // 320x240 is too short and RGB isn't supported
+        { "", 5 },
+        { ":MJPG", 4 },
+        { ":YUYV", 1 },
+        { "1280x720", 3 },
+        { "@30:YUYV", 1 },
+        { "320x240", -1 },
+    };
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        struct capture_mode want;
+        const char *reason = NULL;
+        if (!parse_capture_mode(cases[i].f, &want)) {
+            printf("capture_mode: FAILED parse %s\n", cases[i].f);
+            failed++;
+            continue;
+        }
+        int chosen = choose_capture_mode(modes, n, &want, FINISH_LINE_MIN_WIDTH,
+                FINISH_LINE_HEIGHT + FINISH_LINE_MARGIN, &reason);
+        if (chosen != cases[i].expected || (chosen >= 0 && !reason)) {
+            printf("capture_mode: FAILED -f %s chose %d expected %d\n", cases[i].f, chosen, cases[i].expected);
+            failed++;
+        }
+    }
+
+    struct capture_mode m;
+    failed += parse_capture_mode("640x", &m) || parse_capture_mode(":YUY", &m) || parse_capture_mode("x", &m);
+
+    printf("capture_mode: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// crossings from two finish cameras and two split cameras arriving out of
+// order merge into the same laps
+int
+test_race()
+{
+    const enum camera_role roles[] = { CAMERA_FINISH, CAMERA_FINISH, CAMERA_SPLIT, CAMERA_SPLIT };
+    const u64 s = 1000000000ull;
+    struct race r;
+    init_race(&r, 4, roles);
+    char *events = NULL;
+    size_t events_size = 0;
+    r.events = open_memstream(&events, &events_size);
+
+    int failed = 0;
+
+    race_crossing(&r, 2, 5*s);              // split before the start
+    race_crossing(&r, 0, 10*s);             // start
+    race_crossing(&r, 1, 10*s + s/100);     // other angle, later
+    race_crossing(&r, 0, 11*s);             // still on the line
+    race_crossing(&r, 2, 15*s);
+    race_crossing(&r, 2, 16*s);             // only the first per lap
+    race_crossing(&r, 1, 22*s);
+    race_crossing(&r, 3, 20*s);             // late, still lap 1
+    race_crossing(&r, 0, 21*s + 99*s/100);  // other angle, earlier
+    race_crossing(&r, 3, 28*s);
+    race_crossing(&r, 0, 34*s + s/2);
+    race_crossing(&r, 1, 45*s);             // over
+    race_crossing(&r, 0, 60*s);             // after the race
+
+    const u64 crossings[] = { 10*s, 21*s + 99*s/100, 34*s + s/2, 45*s };
+    if (r.n_crossings != 4 || memcmp(r.crossings, crossings, sizeof(crossings)) != 0) {
+        printf("race: FAILED crossings %d\n", r.n_crossings);
+        failed++;
+    }
+
+    struct overlay o = {};
+    race_overlay(&r, &o, OVERLAY_COLOR, 45*s);
+    const char *expected[] = {
+        "lap 1: 11.990 5.000 10.000",
+        "lap 2: 12.510 - 6.010",
+        "lap 3: 10.500 - - fastest",
+        "total: 35.000",
+    };
+    for (int i = 0; i < 4; i++) {
+        if (i >= o.n_texts || strcmp(o.texts[i].text, expected[i]) != 0) {
+            printf("race: FAILED \"%s\" expected \"%s\"\n", i < o.n_texts ? o.texts[i].text : "", expected[i]);
+            failed++;
+        }
+    }
+
+    race_reset(&r);
+    race_crossing(&r, 2, 5*s);
+    if (r.n_crossings != 0 || r.splits[0][2]) {
+        printf("race: FAILED reset\n");
+        failed++;
+    }
+
+    fclose(r.events);
+    const char *expected_events =
+        "start 10.000000 camera 0\n"
+        "split 1 5.000 camera 2\n"
+        "lap 1 12.000 camera 1\n"
+        "split 1 10.000 camera 3\n"
+        "lap 1 11.990 camera 0 corrected\n"
+        "split 2 6.010 camera 3\n"
+        "lap 2 12.510 camera 0\n"
+        "lap 3 10.500 camera 1\n"
+        "finish 35.000\n"
+        "reset\n";
+    if (strcmp(events, expected_events) != 0) {
+        printf("race: FAILED events:\n%s", events);
+        failed++;
+    }
+    free(events);
+
+    SDL_DestroyMutex(r.mutex);
+
+    printf("race: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+/*
+ * A Y4M recording of a bar crossing the finish line twice, frames 2ms apart
+ * so the real time replay is quick.  Every replay mode has to give the same
+ * crossing times.
+ */
+int
+test_replay()
+{
+    const int width = 320;
+    const int height = 288;
+    const int n_frames = 140;
+    const u64 frame_ns = 2000000;
+    int failed = 0;
+
+    char name[] = "/tmp/race-monitor-test-XXXXXX";
+    int fd = mkstemp(name);
+    FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!f) {
+        printf("replay: FAILED temp file\n");
+        return 1;
+    }
+
+    u8 *frame = malloc(width*height);
+    fprintf(f, "YUV4MPEG2 W%d H%d F500:1 Ip A1:1 Cmono\n", width, height);
+    for (int i = 0; i < n_frames; i++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                frame[y*width + x] = 40 + ((x*7 + y*13) & 0x1f);
+            }
+        }
+
+        // 24 wide at 6 pixels a frame, through the finish line at x 128-191
+        int bar = (i >= 70 && i < 100) ? 60 + (i - 70)*6 : (i >= 110 && i < 140) ? 60 + (i - 110)*6 : -1;
+        for (int y = 0; bar >= 0 && y < height; y++) {
+            for (int x = bar; x < bar + 24 && x < width; x++) {
+                frame[y*width + x] = 220;
+            }
+        }
+
+        // starts at an odd time to check timestamps aren't taken from the
+        // frame number
+        fprintf(f, "FRAME Xts=%lu\n", (u64)1000000000 + 333 + i*frame_ns);
+        fwrite(frame, 1, width*height, f);
+    }
+    fclose(f);
+    free(frame);
+
+    const enum replay_mode modes[] = { REPLAY_REALTIME, REPLAY_FAST, REPLAY_STEP };
+    const char *mode_names[] = { "realtime", "fast", "step" };
+    const enum camera_role roles[] = { CAMERA_FINISH };
+    u64 crossings[3][RACE_LAPS + 1] = {};
+    struct capture_mode want = {};
+
+    for (int m = 0; m < 3; m++) {
+        struct frame_source *src = open_file_source(name, &want, modes[m]);
+        if (!src || src->width != (u32)width || src->pixelformat != V4L2_PIX_FMT_GREY) {
+            printf("replay: FAILED open %s\n", mode_names[m]);
+            failed++;
+            break;
+        }
+        for (int i = 0; src->step && i < n_frames; i++) {
+            src->step(src);
+        }
+
+        struct race race;
+        init_race(&race, 1, roles);
+        race.min_lap_ns = 20*frame_ns;
+
+        struct capture_data cd = {};
+        cd.source = src;
+        cd.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        cd.pixelformat = src->pixelformat;
+        cd.width = src->width;
+        cd.height = src->height;
+        cd.readout_ns = 0;
+        cd.race = &race;
+        init_triple_buffer(&cd.display);
+        atomic_init(&cd.running, true);
+
+        u64 start = monotonic_ns();
+        run_capture(&cd);
+        u64 elapsed = monotonic_ns() - start;
+        printf("replay %s: %.1f ms\n", mode_names[m], elapsed/1e6);
+
+        if (race.n_crossings != 2) {
+            printf("replay %s: FAILED %d crossings\n", mode_names[m], race.n_crossings);
+            failed++;
+        }
+        memcpy(crossings[m], race.crossings, sizeof(race.crossings));
+        if (modes[m] == REPLAY_REALTIME && elapsed < (n_frames - 1)*frame_ns) {
+            printf("replay realtime: FAILED too fast\n");
+            failed++;
+        }
+
+        free_capture_images(&cd);
+        close(cd.wake_fd);
+        SDL_DestroyMutex(race.mutex);
+        src->close(src);
+    }
+
+    if (memcmp(crossings[0], crossings[1], sizeof(crossings[0])) != 0
+            || memcmp(crossings[0], crossings[2], sizeof(crossings[0])) != 0) {
+        printf("replay: FAILED crossings differ between modes\n");
+        failed++;
+    }
+
+    unlink(name);
+
+    printf("replay: %s\n", failed ? "FAILED" : "ok");
+
+    return failed;
+}
 
-        // TODO(jason): this shouldn't be either or.  It should ALSO add to background if necessary
-        if (need_bg_frames) {
-            last_bg_mix = now;
+// a clean synthetic scene with some dropped frames has every crossing found
+// and nothing extra
+int
+test_scene()
+{
+    int failed = 0;
+    struct scene scene;
+
+    failed += !parse_scene("laps=5,speed=600,drop=0.02,seed=3", &scene);
+    failed += parse_scene("laps=5,bogus=1", &scene) || parse_scene("w=100", &scene) || parse_scene("laps", &scene)
+        || parse_scene("laps=1e9", &scene);
+    if (failed) {
+        printf("scene: FAILED parse\n");
+        return failed;
+    }
 
-            if (need_bg_frames == n_usable_frames) {
-                // initialize mix
-                copy_image(finish_line, bg_finish_line);
-                cd->valid_image = true;
-            } else if (need_bg_frames < n_usable_frames) {
-                mix_images(bg_finish_line, finish_line, 10);
-                draw_shadow_text(write1_image, 2, 2, 1, &WHITE, "mixing background");
-            } else {
-                draw_shadow_text(write1_image, 2, 2, 1, &WHITE, "skipping frame");
-                // ignore some frames at the beginning
-            }
-            need_bg_frames--;
+    parse_scene("laps=5,speed=600,drop=0.02,seed=3", &scene);
+    int wrong = run_scene(&scene, true);
+    if (wrong) {
+        printf("scene: FAILED %d crossings missed or extra\n", wrong);
+        failed++;
+    }
 
-            if (need_bg_frames == 0 && !finish_line_valid) {
-                finish_line_valid = true;
-            }
+    printf("scene: %s\n", failed ? "FAILED" : "ok");
 
-            //debugf("background frame.  remaining: %d", need_bg_frames);
-        }
+    return failed;
+}
 
-        // as long as a race is running update the current lap time
-        if (lap_start > 0 && lap < n_laps) {
-            lap_times[lap] = (double)(now - lap_start)/SDL_GetPerformanceFrequency();
-        }
+// run with -t.  returns the number of failed tests
+int
+run_tests()
+{
+    int failed = 0;
+
+    failed += test_yuyv2rgba();
+    failed += test_yuyv_demux();
+    failed += test_median_image();
+    failed += test_diff_count();
+    failed += test_diff_update_bg();
+    failed += test_crossing_estimate();
+    failed += test_rolling_shutter();
+    failed += test_triple_buffer();
+    failed += test_trace();
+    failed += test_damage();
+    failed += test_shot();
+    failed += test_photo_finish();
+    failed += test_recorder();
+    failed += test_frame_pool();
+    failed += test_wait_frame();
+    failed += test_pacing();
+    failed += test_jpeg();
+    failed += test_capture_mode();
+    failed += test_race();
+    failed += test_replay();
+    failed += test_scene();
+
+    printf("%s\n", failed ? "TESTS FAILED" : "all tests passed");
+
+    return failed;
+}
 
-        if (finish_line_valid) {
-            int percent = percent_diff_images(finish_line, bg_finish_line, tmp_finish_line, motion_threshold);
-            draw_int(write1_image, 2, finish_line->height + 2, 1, &WHITE, percent);
-            const color *highlight;
-            if (percent > 20) { // motion threshold
-                if (!finish_line_active) {
-                    finish_line_active = true;
+/*
+ * Kernel microbenchmarks, run with -B baseline by "qc bench".  Each kernel
+ * is timed on whole frames at 480p, 720p and 1080p after a warm up, the
+ * median of the repetitions is reported as ns/frame and cycles/pixel.  The
+ * results are compared against the baseline file, anything more than
+ * BENCH_REGRESSION slower is flagged and the exit status is the number of
+ * regressions.  A missing baseline (or -w) is written instead.  Timings are
+ * per kernel set so -k avx2 and -k scalar have separate baselines.
+ */
+#define BENCH_REGRESSION 1.10
 
-                    if (lap < n_laps) {
-                        if (lap_start > 0) {
-                            if (lap_times[lap] > min_lap_time) {
-                                if (lap == 0 || lap_times[lap] < lap_times[fastest_lap]) {
-                                    fastest_lap = lap;
-                                }
-
-                                lap_start = now;
-                                lap++;
-                            } else {
-                                debug("ignoring too fast lap!!!");
-                            }
-                        } else {
-                            lap_start = now;
-                            race_start = now;
-                        }
-                    }
-                }
+struct bench_frame {
+    int width;
+    int height;
+    u8 *yuyv;
+    image *y;
+    image *y2;
+    image *out;
+    image *rgba;
+    background *bg;
+};
 
-                highlight = &GREEN;
-            } else {
-                highlight = &WHITE;
-                finish_line_active = false;
+typedef void (*bench_func)(struct bench_frame *b);
+
+static void
+bench_yuyv2rgba(struct bench_frame *b)
+{
+    kernel->yuyv2rgba(b->yuyv, b->rgba->data, b->y->n_pixels);
+}
+
+static void
+bench_yuyv2y(struct bench_frame *b)
+{
+    yuyv2y(b->yuyv, b->out->data, b->y->n_pixels);
+}
+
+static void
+bench_yuyv_demux(struct bench_frame *b)
+{
+    yuyv_demux(b->yuyv, b->width*2, NULL, b->out, NULL, b->y2, 0, 0);
+}
+
+static void
+bench_median_channel(struct bench_frame *b)
+{
+    median_channel(b->y, b->out, 2, 0);
+}
+
+static void
+bench_median_image(struct bench_frame *b)
+{
+    median_image(b->y, b->out, 2);
+}
+
+static void
+bench_percent_diff_images(struct bench_frame *b)
+{
+    percent_diff_images(b->y, b->y2, b->out, 8);
+}
+
+static void
+bench_diff_update_background(struct bench_frame *b)
+{
+    diff_update_background(b->y, b->bg, NULL, NULL, NULL, 8, 7);
+}
+
+static void
+bench_mix_images(struct bench_frame *b)
+{
+    mix_images(b->out, b->y, 100);
+}
+
+static void
+bench_copy_rect_image(struct bench_frame *b)
+{
+    copy_rect_image(b->width, b->height, b->y, 0, 0, b->out, 0, 0);
+}
+
+// a screenful of overlay text
+static void
+bench_draw_text(struct bench_frame *b)
+{
+    for (int y = 0; y + 16 < b->height; y += 16) {
+        draw_text(b->rgba, 2, y, 1, &WHITE, "lap 1: 12.345 4.321 8.765 fastest 0123456789");
+    }
+}
+
+static const struct {
+    const char *name;
+    bench_func func;
+} benches[] = {
+    { "yuyv2rgba", bench_yuyv2rgba },
+    { "yuyv2y", bench_yuyv2y },
+    { "yuyv_demux", bench_yuyv_demux },
+    { "median_channel", bench_median_channel },
+    { "median_image", bench_median_image },
+    { "percent_diff_images", bench_percent_diff_images },
+    { "diff_update_background", bench_diff_update_background },
+    { "mix_images", bench_mix_images },
+    { "copy_rect_image", bench_copy_rect_image },
+    { "draw_text", bench_draw_text },
+};
+
+struct bench_result {
+    char name[64];
+    double ns;
+};
+
+static inline u64
+cpu_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// median ns and cycles per run after warming up, at least 10 runs and 200ms
+// unless a run is slow
+static void
+bench_time(bench_func func, struct bench_frame *b, u64 *ns, u64 *cycles)
+{
+    const int max_runs = 1000;
+    u64 run_ns[max_runs];
+    u64 run_cycles[max_runs];
+
+    u64 warm_up = monotonic_ns();
+    for (int i = 0; i < 3 && monotonic_ns() - warm_up < 100000000; i++) {
+        func(b);
+    }
+
+    int n = 0;
+    u64 total = 0;
+    while (n < max_runs && (n < 10 || total < 200000000) && !(n >= 3 && total > 1000000000)) {
+        u64 start_cycles = cpu_cycles();
+        u64 start = monotonic_ns();
+        func(b);
+        run_ns[n] = monotonic_ns() - start;
+        run_cycles[n] = cpu_cycles() - start_cycles;
+        total += run_ns[n];
+        n++;
+    }
+
+    qsort(run_ns, n, sizeof(run_ns[0]), compare_u64);
+    qsort(run_cycles, n, sizeof(run_cycles[0]), compare_u64);
+    *ns = run_ns[n/2];
+    *cycles = run_cycles[n/2];
+}
+
+// every kernel set's results in the file, -1 without one.  results is
+// allocated and grown to fit, free it either way.
+static int
+read_bench_baseline(const char *filename, struct bench_result **results)
+{
+    *results = NULL;
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        return -1;
+    }
+
+    int n = 0;
+    int max = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        if (n == max) {
+            max = max ? 2*max : 128;
+            *results = realloc(*results, max*sizeof(**results));
+            if (!*results) {
+                errno_exit("realloc");
             }
+        }
+        struct bench_result *r = &(*results)[n];
+        if (line[0] != '#' && sscanf(line, "%63s %lf", r->name, &r->ns) == 2) {
+            n++;
+        }
+    }
+    fclose(f);
+
+    return n;
+}
 
-            int x = 0;
-            int y = 0;
-            copy_rect_image(finish_line->width, finish_line->height, finish_line, 0, 0, write1_image, x, y);
-            x += bg_finish_line->width + 2;
-            copy_rect_image(finish_line->width, finish_line->height, bg_finish_line, 0, 0, write1_image, x, y);
-            //draw_rect(write1_image, 0, 0, finish_line->width, finish_line->height, highlight);
-            draw_rect(write1_image, finish_line_x, finish_line_y, finish_line->width, finish_line->height, highlight);
-            draw_rect(write2_image, finish_line_x, finish_line_y, finish_line->width, finish_line->height, highlight);
+int
+run_bench(const char *baseline_file, bool write_baseline)
+{
+    const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    const int n_sizes = sizeof(sizes)/sizeof(sizes[0]);
+    const int n_benches = sizeof(benches)/sizeof(benches[0]);
+
+    struct bench_result *baseline = NULL;
+    int n_baseline = write_baseline ? -1 : read_bench_baseline(baseline_file, &baseline);
+    struct bench_result *results = calloc(n_sizes*n_benches, sizeof(results[0]));
+    int n_results = 0;
+    int regressions = 0;
+
+    printf("kernel %s, baseline %s\n", kernel->name, n_baseline >= 0 ? baseline_file : "none");
+    printf("%-24s %-10s %12s %10s %10s\n", "", "", "ns/frame", "cycles/px", "baseline");
+
+    for (int s = 0; s < n_sizes; s++) {
+        struct bench_frame b = { .width = sizes[s][0], .height = sizes[s][1] };
+        const int n_pixels = b.width*b.height;
+        b.yuyv = malloc(n_pixels*2);
+        b.y = new_image(b.width, b.height, 1);
+        b.y2 = new_image_like(b.y);
+        b.out = new_image_like(b.y);
+        b.rgba = new_image(b.width, b.height, 4);
+        b.bg = new_background(b.width, b.height);
+
+        // a frame with some structure so the median and diff branches
+        // aren't all taken the same way
+        srand(1);
+        for (int i = 0; i < n_pixels*2; i++) {
+            b.yuyv[i] = (i/7 + (rand() & 0x3f)) & 0xff;
         }
+        yuyv2y(b.yuyv, b.y->data, n_pixels);
+        for (int i = 0; i < n_pixels; i++) {
+            b.y2->data[i] = b.y->data[i] + (rand() & 0xf) - 8;
+        }
+        reset_background(b.bg, b.y2);
 
-        if (race_start > 0) {
-            int x = 2;
-            int y = 2;
+        for (int i = 0; i < n_benches; i++) {
+            u64 ns, cycles;
+            bench_time(benches[i].func, &b, &ns, &cycles);
 
-            char text[256];
-            double total = 0.0;
-            for (int i = 0; i <= lap && i < n_laps; i++) {
-                snprintf(text, 256, "lap %d: %.3f %s", i + 1, lap_times[i], fastest_lap == i ? "fastest" : "");
-                total += lap_times[i];
-                y += draw_shadow_text(write2_image, x, y, 1, &GREEN, text);
-            }
+            struct bench_result *r = &results[n_results++];
+            snprintf(r->name, sizeof(r->name), "%s/%s/%dx%d", benches[i].name, kernel->name, b.width, b.height);
+            r->ns = ns;
 
-            if (lap > 0) {
-                snprintf(text, 256, "total: %.3f", total);
-                draw_shadow_text(write2_image, x, y, 1, &GREEN, text);
+            char cycles_text[16] = "-";
+            if (cycles) {
+                snprintf(cycles_text, sizeof(cycles_text), "%.2f", (double)cycles/n_pixels);
             }
-        }
 
-        if (lap == n_laps && !race_logged) {
-            race_logged = true;
-            debug("XXX race is over XXXX");
-            FILE *f = fopen("race.log", "a");
-            if (f) {
-                double total = 0.0;
-                for (int i = 0; i < n_laps; i++) {
-                    total += lap_times[i];
-                    fprintf(f, "%.3f,", lap_times[i]);
+            char base_text[32] = "";
+            for (int j = 0; j < n_baseline; j++) {
+                if (strcmp(baseline[j].name, r->name) == 0) {
+                    double ratio = r->ns/baseline[j].ns;
+                    bool regressed = ratio > BENCH_REGRESSION;
+                    snprintf(base_text, sizeof(base_text), "%+.1f%%%s", 100*(ratio - 1),
+                            regressed ? " REGRESSION" : "");
+                    regressions += regressed;
                 }
-                fprintf(f, "%.3f\n", total);
-                fclose(f);
             }
-        }
 
-
-        // update current image frame for display
-        if (SDL_LockMutex(cd->mutex) == 0) {
-            cd->rindex = !cd->rindex;
-            SDL_UnlockMutex(cd->mutex);
+            char size_text[16];
+            snprintf(size_text, sizeof(size_text), "%dx%d", b.width, b.height);
+            printf("%-24s %-10s %12lu %10s %10s\n", benches[i].name, size_text, ns, cycles_text, base_text);
         }
+
+        free(b.yuyv);
+        free_image(b.y);
+        free_image(b.y2);
+        free_image(b.out);
+        free_image(b.rgba);
+        free_background(b.bg);
     }
 
-    if (ioctl(cd->fd, VIDIOC_STREAMOFF, &vtype) == -1) {
-        errno_exit("VIDIOC_STREAMOFF");
+    if (n_baseline < 0) {
+        // other kernels' results are kept
+        free(baseline);
+        int n_old = read_bench_baseline(baseline_file, &baseline);
+        FILE *f = fopen(baseline_file, "w");
+        if (!f) {
+            perror(baseline_file);
+            free(baseline);
+            free(results);
+            return 1;
+        }
+        fprintf(f, "# ns/frame from run_bench\n");
+        for (int j = 0; j < n_old; j++) {
+            bool replaced = false;
+            for (int i = 0; i < n_results; i++) {
+                replaced = replaced || strcmp(baseline[j].name, results[i].name) == 0;
+            }
+            if (!replaced) {
+                fprintf(f, "%s %.0f\n", baseline[j].name, baseline[j].ns);
+            }
+        }
+        for (int i = 0; i < n_results; i++) {
+            fprintf(f, "%s %.0f\n", results[i].name, results[i].ns);
+        }
+        fclose(f);
+        printf("wrote baseline %s\n", baseline_file);
+    } else if (regressions) {
+        printf("%d regressions over %.0f%%\n", regressions, 100*(BENCH_REGRESSION - 1));
     }
+    free(baseline);
+    free(results);
 
-    return 0;
+    return regressions;
 }
 
 int
 main(int argc, char *argv[])
 {
     // target size for the whole window/frame
-    // c920 only supports YUYV 720p @ 10fps, MJPEG or H264 @ 30fps
+    // c920 only supports YUYV 720p @ 10fps, MJPEG or H264 @ 30fps, use -j
+    // for MJPEG
     // MacBook Only YUYV @ 5fps, no other image formats
     int frame_width = 1280;
     int frame_height = 720;
@@ -966,142 +7587,273 @@ main(int argc, char *argv[])
     const u64 target_fps = 30;
     //const u64 camera_fps = 30;
 
-    // target size for camera capture frame (v4l2)
-    // TODO(jason): for these to be different from frame_width/height requires a
-    // separate texture for drawing overlays instead of frame_rgba
-    u32 cam_width = 640;
-    u32 cam_height = 480;
 
-    char *vdev_name = NULL;
-
-    for (int i = 2; i < argc; i++) {
-        if (strcmp(argv[i - 1], "-d") == 0) {
-            vdev_name = strdup(argv[i]);
+    // -d adds a camera on the finish line, -s a split camera somewhere else
+    // on the track
+    char *finish_names[MAX_CAMERAS];
+    char *split_names[MAX_CAMERAS];
+    int n_finish = 0;
+    int n_split = 0;
+    char *kernel_name = NULL;
+    bool test = false;
+    bool median_frame = false;
+    s64 readout_ns = -1;
+    bool userptr = false;
+    // capture mode from -f, zero fields are negotiated
+    struct capture_mode want = {};
+    int n_buffers = 6;
+    enum replay_mode replay = REPLAY_REALTIME;
+    const char *scene_spec = NULL;
+    const char *bench_file = NULL;
+    bool write_baseline = false;
+    const char *trace_file = NULL;
+    // frames kept around each crossing, none by default
+    int finish_pre = 0;
+    int finish_post = 0;
+    bool finish_lock = false;
+    bool photo_finish = false;
+    // -o records the camera frames, -O only their luma
+    const char *record_name = NULL;
+    bool record_luma = false;
+    // no window, lap events to stdout or -e file
+    bool headless = false;
+    const char *events_name = NULL;
+    // -v presents on the display refresh instead of target_fps deadlines
+    bool vsync = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            test = true;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            median_frame = true;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            userptr = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            want.pixelformat = V4L2_PIX_FMT_MJPEG;
+        } else if (strcmp(argv[i], "-w") == 0) {
+            write_baseline = true;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            vsync = true;
         }
     }
 
-    // setup v4l
-    struct buffer *buffers;
-    unsigned int n_buffers;
-    struct v4l2_format fmt = {};
-
-    if (!vdev_name) {
-        char *names[] = {
-            "/dev/video2",
-            "/dev/video1",
-            "/dev/video0"
-        };
-
-        struct stat st;
-
-        for (int i = 0; i < 3; i++) {
-            if (stat(names[i], &st) != -1) {
-                vdev_name = names[i];
-                break;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i - 1], "-d") == 0 || strcmp(argv[i - 1], "-s") == 0) {
+            if (n_finish + n_split == MAX_CAMERAS) {
+                SDL_Log("too many cameras, at most %d", MAX_CAMERAS);
+                exit(EXIT_FAILURE);
+            }
+            // one is kept for the finish camera, found if no -d is given
+            if (argv[i - 1][1] == 's' && n_split == MAX_CAMERAS - 1) {
+                SDL_Log("too many split cameras, at most %d", MAX_CAMERAS - 1);
+                exit(EXIT_FAILURE);
+            }
+            if (argv[i - 1][1] == 'd') {
+                finish_names[n_finish++] = argv[i];
+            } else {
+                split_names[n_split++] = argv[i];
+            }
+        } else if (strcmp(argv[i - 1], "-p") == 0) {
+            // how recordings are replayed
+            if (strcmp(argv[i], "fast") == 0) {
+                replay = REPLAY_FAST;
+            } else if (strcmp(argv[i], "step") == 0) {
+                replay = REPLAY_STEP;
+            } else if (strcmp(argv[i], "realtime") == 0) {
+                replay = REPLAY_REALTIME;
+            } else {
+                SDL_Log("bad replay mode: %s, expected realtime, fast or step", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i - 1], "-B") == 0) {
+            // kernel benchmarks against a baseline file, see run_bench
+            bench_file = argv[i];
+        } else if (strcmp(argv[i - 1], "-P") == 0) {
+            // photo finish frames pre:post[:lock]
+            if (!parse_photo_finish(argv[i], &finish_pre, &finish_post, &finish_lock)) {
+                SDL_Log("bad photo finish: %s, expected frames before and after like 30:30 or 30:30:lock", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            photo_finish = true;
+        } else if (strcmp(argv[i - 1], "-o") == 0 || strcmp(argv[i - 1], "-O") == 0) {
+            // recording container, more cameras add .1, .2...
+            record_name = argv[i];
+            record_luma = argv[i - 1][1] == 'O';
+        } else if (strcmp(argv[i - 1], "-e") == 0) {
+            // lap events appended to a file
+            events_name = argv[i];
+        } else if (strcmp(argv[i - 1], "-T") == 0) {
+            // Chrome trace JSON of the stage latencies written on exit
+            trace_file = argv[i];
+        } else if (strcmp(argv[i - 1], "-g") == 0) {
+            // synthetic scene, see parse_scene
+            scene_spec = argv[i];
+        } else if (strcmp(argv[i - 1], "-k") == 0) {
+            // force a kernel: avx2, sse2, scalar
+            kernel_name = argv[i];
+        } else if (strcmp(argv[i - 1], "-R") == 0) {
+            // sensor readout time in ms, 0 for a global shutter
+            readout_ns = atof(argv[i])*1e6;
+        } else if (strcmp(argv[i - 1], "-b") == 0) {
+            // the display holds 2 so 4 leaves the driver 2
+            n_buffers = clamp(atoi(argv[i]), 4, FRAME_POOL_MAX);
+        } else if (strcmp(argv[i - 1], "-f") == 0) {
+            // capture mode WxH@fps:FOURCC, any part can be left out
+            if (!parse_capture_mode(argv[i], &want)) {
+                SDL_Log("bad capture mode: %s, expected like 640x480@30:YUYV", argv[i]);
+                exit(EXIT_FAILURE);
             }
-        }
-
-        if (!vdev_name) {
-            errno_exit("video device");
         }
     }
 
-    debugf("vdev_name: %s", vdev_name);
-
-    int cam_fd = open(vdev_name, O_RDWR, 0);
-    if (cam_fd == -1) {
-        errno_exit(vdev_name);
-    }
+    cpu_init(kernel_name);
 
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(cam_fd, VIDIOC_G_FMT, &fmt) == -1) {
-        errno_exit("VIDIOC_G_FMT");
+    if (test) {
+        exit(run_tests() ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    uint32_t fourcc = fmt.fmt.pix.pixelformat;
-    debugf("device: %s, width: %d, height: %d, fourcc: %c%c%c%c",
-            vdev_name, fmt.fmt.pix.width, fmt.fmt.pix.height,
-            fourcc & 0xff, fourcc >> 8 & 0xff, fourcc >> 16 & 0xff, fourcc >> 24 & 0xff);
-
-    // larger sizes are too slow, but may be due to VM
-    fmt.fmt.pix.width = cam_width;
-    fmt.fmt.pix.height = cam_height;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
-    if (ioctl(cam_fd, VIDIOC_S_FMT, &fmt) == -1) {
-        errno_exit("VIDIOC_S_FMT");
+    if (bench_file) {
+        exit(run_bench(bench_file, write_baseline) ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    if (ioctl(cam_fd, VIDIOC_G_FMT, &fmt) == -1) {
-        errno_exit("VIDIOC_G_FMT");
+    if (scene_spec) {
+        struct scene scene;
+        if (!parse_scene(scene_spec, &scene)) {
+            SDL_Log("bad scene: %s, expected like laps=50,noise=4,drift=20,readout=30,drop=0.02", scene_spec);
+            exit(EXIT_FAILURE);
+        }
+        exit(run_scene(&scene, false) ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
-    fourcc = fmt.fmt.pix.pixelformat;
-    debugf("device: %s, width: %d, height: %d, fourcc: %c%c%c%c",
-            vdev_name, fmt.fmt.pix.width, fmt.fmt.pix.height,
-            fourcc & 0xff, fourcc >> 8 & 0xff, fourcc >> 16 & 0xff, fourcc >> 24 & 0xff);
+    // setup v4l.  Finish cameras first, the first one is shown full size
+    // with the race.
+    int n_cameras = n_finish + n_split;
+    if (n_finish == 0) {
+        // the highest numbered capture device not already a split camera,
+        // usually a USB camera rather than one built in.  Cameras also have
+        // metadata nodes that can't capture.
+        char name[32];
+        int fd = -1;
+        for (int i = 63; i >= 0 && fd == -1; i--) {
+            snprintf(name, sizeof(name), "/dev/video%d", i);
+            bool used = false;
+            for (int c = 0; c < n_split; c++) {
+                used = used || strcmp(split_names[c], name) == 0;
+            }
+            fd = used ? -1 : open(name, O_RDWR, 0);
+            if (fd != -1 && !is_capture_device(fd)) {
+                close(fd);
+                fd = -1;
+            }
+        }
 
-    if (fmt.fmt.pix.width != cam_width || fmt.fmt.pix.height != cam_height) {
-        SDL_Log("camera width x height (%d x %d) not supported", cam_width, cam_height);
-        errno_exit("VIDIOC_G_FMT");
+        if (fd == -1) {
+            errno_exit("video device");
+        }
+        close(fd);
+        finish_names[n_finish++] = strdup(name);
+        n_cameras++;
     }
 
-    //int width = fmt.fmt.pix.width;
-    //int height = fmt.fmt.pix.height;
+    struct camera cameras[MAX_CAMERAS] = {};
+    enum camera_role roles[MAX_CAMERAS];
+    for (int i = 0; i < n_cameras; i++) {
+        struct camera *cam = &cameras[i];
+        cam->name = i < n_finish ? finish_names[i] : split_names[i - n_finish];
+        cam->role = roles[i] = i < n_finish ? CAMERA_FINISH : CAMERA_SPLIT;
+        debugf("camera %d: %s %s", i, cam->name, cam->role == CAMERA_FINISH ? "finish" : "split");
 
-    struct v4l2_requestbuffers req;
-    memset(&req, 0, sizeof(req));
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+        // a regular file is a recording to replay
+        struct stat st;
+        if (stat(cam->name, &st) == 0 && S_ISREG(st.st_mode)) {
+            cam->source = open_file_source(cam->name, &want, replay);
+            if (!cam->source) {
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            cam->source = open_v4l2_source(cam->name, &want, userptr, n_buffers);
+        }
 
-    if (ioctl(cam_fd, VIDIOC_REQBUFS, &req) == -1) {
-        errno_exit("VIDIOC_REQBUFS");
+        struct capture_data *cd = &cam->cd;
+        cd->source = cam->source;
+        cd->pixelformat = cam->source->pixelformat;
+        cd->width = cam->source->width;
+        cd->height = cam->source->height;
+        cd->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (cd->wake_fd == -1) {
+            errno_exit("eventfd");
+        }
     }
 
-    //debugf("allocated %d buffers", req.count);
-
-    buffers = calloc(req.count, sizeof(*buffers));
-    if (!buffers) {
-        errno_exit("calloc");
+    struct race race;
+    init_race(&race, n_cameras, roles);
+    race.log_name = "race.log";
+    if (events_name) {
+        race.events = fopen(events_name, "a");
+        if (!race.events) {
+            SDL_Log("unable to write events to %s: %s", events_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else if (headless) {
+        race.events = stdout;
     }
 
-    for (unsigned int i = 0; i < req.count; i++) {
-        struct v4l2_buffer vbuf;
-        memset(&vbuf, 0, sizeof(vbuf));
-
-        vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vbuf.memory = V4L2_MEMORY_MMAP;
-        vbuf.index = i;
-
-        if (ioctl(cam_fd, VIDIOC_QUERYBUF, &vbuf) == -1) {
-            errno_exit("VIDIOC_QUERYBUF");
+    // only the headless loop takes these, the capture threads inherit the
+    // mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    if (headless) {
+        const int control_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGUSR1, SIGUSR2 };
+        for (int i = 0; i < (int)(sizeof(control_signals)/sizeof(control_signals[0])); i++) {
+            sigaddset(&signals, control_signals[i]);
         }
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
 
-        buffers[i].length = vbuf.length;
-        buffers[i].start = mmap(NULL, vbuf.length,
-                PROT_READ | PROT_WRITE, MAP_SHARED,
-                cam_fd, vbuf.m.offset);
-
-        //debugf("buffers[%u]: %p", i, buffers[i].start);
-
-        if (buffers[i].start == MAP_FAILED) {
-            errno_exit("mmap");
+    for (int i = 0; i < n_cameras; i++) {
+        struct capture_data *cd = &cameras[i].cd;
+        cd->camera = i;
+        cd->race = &race;
+        cd->median_frame = median_frame;
+        cd->readout_ns = readout_ns;
+        cd->headless = headless;
+        char trace_name[32];
+        snprintf(trace_name, 32, "camera %d", i);
+        cd->trace = new_trace_ring(trace_name);
+        if (photo_finish) {
+            cd->photo_finish = new_photo_finish(i, cameras[i].source, finish_pre, finish_post, finish_lock);
+            start_photo_finish(cd->photo_finish);
+        }
+        if (record_name) {
+            char name[256];
+            if (i) {
+                snprintf(name, 256, "%s.%d", record_name, i);
+            } else {
+                snprintf(name, 256, "%s", record_name);
+            }
+            const struct frame_source *src = cameras[i].source;
+            cd->recorder = open_recorder(name, i, record_luma ? V4L2_PIX_FMT_GREY : src->pixelformat,
+                    src->width, src->height, record_luma ? 0 : src->bytesperline, src->interval, true);
+            cd->record_luma = cd->recorder && record_luma;
         }
     }
 
-    n_buffers = req.count;
-
-    for (unsigned int i = 0; i < n_buffers; i++) {
-        struct v4l2_buffer vbuf;
-        memset(&vbuf, 0, sizeof(vbuf));
-
-        vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        vbuf.memory = V4L2_MEMORY_MMAP;
-        vbuf.index = i;
-
-        if (ioctl(cam_fd, VIDIOC_QBUF, &vbuf) == -1) {
-            errno_exit("VIDIOC_QBUF");
+    // the window starts its capture threads once SDL is set up
+    if (headless) {
+        // a closed stdout only fails the event writes
+        signal(SIGPIPE, SIG_IGN);
+        start_cameras(cameras, n_cameras);
+        run_headless(cameras, n_cameras, &race, &signals);
+        stop_cameras(cameras, n_cameras);
+        save_trace(trace_file);
+        if (race.events != stdout) {
+            fclose(race.events);
         }
+        SDL_DestroyMutex(race.mutex);
+
+        exit(EXIT_SUCCESS);
     }
 
 
@@ -1132,7 +7884,7 @@ main(int argc, char *argv[])
     // NOTE(jason): VSYNC doesn't work within Parallels.  The SDL Renderer
     // info doesn't include it either when requested.
     renderer = SDL_CreateRenderer(window, -1,
-            SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+            SDL_RENDERER_ACCELERATED | (vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
     if (!renderer) {
         debugf("Could not create renderer: %s", SDL_GetError());
         errno_exit("SDL_CreateRenderer");
@@ -1168,94 +7920,116 @@ main(int argc, char *argv[])
 
     SDL_SetEventFilter(sdl_filter, NULL);
 
-    SDL_Surface *sshot = NULL;
-
-    SDL_Texture *texture1 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, cam_width, cam_height);
-    if (texture1) {
-        SDL_QueryTexture(texture1, &pixel_format, NULL, NULL, NULL);
-        debugf("texture1 format: %s", SDL_GetPixelFormatName(pixel_format));
-    } else {
-        debugf("SDL_CreateTexture failed: %s", SDL_GetError());
-        errno_exit("SDL_CreateTexture: texture1");
+    // the capture threads push this for each new frame, without it the
+    // display polls every frame period
+    u32 frame_event = SDL_RegisterEvents(1);
+    if (frame_event == (u32)-1) {
+        SDL_Log("SDL_RegisterEvents failed, polling for frames: %s", SDL_GetError());
+        frame_event = 0;
     }
-
-    SDL_Texture *texture2 = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, cam_width, cam_height);
-    if (texture2) {
-        SDL_QueryTexture(texture2, &pixel_format, NULL, NULL, NULL);
-        debugf("texture2 format: %s", SDL_GetPixelFormatName(pixel_format));
-    } else {
-        debugf("SDL_CreateTexture failed: %s", SDL_GetError());
-        errno_exit("SDL_CreateTexture: texture2");
+    for (int i = 0; i < n_cameras; i++) {
+        atomic_store(&cameras[i].cd.frame_event, frame_event);
     }
 
+    // the overlay layer is put back to the base where the last present drew
+    // and only the rects drawn by either are uploaded
     image *frame_rgba = new_image(frame_width, frame_height, 4);
+    image *overlay_base = new_image_like(frame_rgba);
+    fill_rect(overlay_base, (n_cameras - 1)*320, 480, frame_width - (n_cameras - 1)*320, 240, &WHITE);
+    struct damage drawn = { .all = true };
+    struct damage last_drawn;
+    struct damage upload;
+    frame_rgba->damage = &drawn;
+
+    // the first camera's gray and color views side by side, the others
+    // across the bottom in color
+    for (int i = 0; i < n_cameras; i++) {
+        struct camera *cam = &cameras[i];
+        const u32 cam_width = cam->cd.width;
+        const u32 cam_height = cam->cd.height;
+
+        if (i == 0) {
+            cam->views[OVERLAY_GRAY] = (SDL_Rect){ .x = 0, .y = 0, .w = 640, .h = 480 };
+            cam->views[OVERLAY_COLOR] = (SDL_Rect){ .x = 640, .y = 0, .w = 640, .h = 480 };
+        } else {
+            cam->views[OVERLAY_GRAY] = (SDL_Rect){ .x = (i - 1)*320, .y = 480, .w = 320, .h = 240 };
+            cam->views[OVERLAY_COLOR] = cam->views[OVERLAY_GRAY];
+        }
+
+        cam->gray_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YV12, SDL_TEXTUREACCESS_STREAMING, cam_width, cam_height);
+        if (cam->gray_texture) {
+            SDL_QueryTexture(cam->gray_texture, &pixel_format, NULL, NULL, NULL);
+            debugf("gray texture format: %s", SDL_GetPixelFormatName(pixel_format));
+        } else {
+            debugf("SDL_CreateTexture failed: %s", SDL_GetError());
+            errno_exit("SDL_CreateTexture: gray");
+        }
+
+        // raw camera frames, converted by the renderer
+        cam->color_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_YUY2, SDL_TEXTUREACCESS_STREAMING, cam_width, cam_height);
+        if (cam->color_texture) {
+            SDL_QueryTexture(cam->color_texture, &pixel_format, NULL, NULL, NULL);
+            debugf("color texture format: %s", SDL_GetPixelFormatName(pixel_format));
+        } else {
+            debugf("SDL_CreateTexture failed: %s", SDL_GetError());
+            errno_exit("SDL_CreateTexture: color");
+        }
+
+        cam->gray_chroma = malloc(cam_width/2*cam_height/2);
+        memset(cam->gray_chroma, 0x80, cam_width/2*cam_height/2);
+
+        cam->checkerboard1 = new_image(cam_width, cam_height, 1);
+        cam->checkerboard2 = new_image(cam_width, cam_height, 2);
+        checkerboard_yv12(cam->checkerboard1, 32);
+        y2yuyv(cam->checkerboard1->data, cam->checkerboard2->data, cam->checkerboard1->n_pixels);
+    }
 
-    image *checkerboard1 = new_yv12_image(cam_width, cam_height);
-    image *checkerboard2 = new_image(cam_width, cam_height, 4);
-    checkerboard_yv12(checkerboard1, 32);
-    checkerboard_image(checkerboard2, 32);
+    struct shot_writer shots;
+    init_shot_writer(&shots, cameras, n_cameras, frame_width, frame_height);
+    start_shot_writer(&shots);
 
     bool fullscreen = true;
+    bool show_latency = false;
     bool capture = false;
     bool record = false;
     int record_frame = 0;
 
-    // NOTE(jason): run main loop at 30fps
-    const u64 count_per_s = SDL_GetPerformanceFrequency();
-    assert(count_per_s > 1000);
-    const u64 count_per_ms = count_per_s/1000;
-    assert(count_per_ms > 0);
-    const u64 count_per_frame = (count_per_s/target_fps);
+    // presents are at most target_fps on absolute deadlines, or paced by
+    // the display refresh with -v
+    const u64 frame_period_ns = 1000000000/target_fps;
+    u64 next_present_ns = 0;
 
     bool running = true;
     SDL_Event event;
 
-    u64 start_count = 0;
-    u64 end_count;
-    u64 elapsed_count;
-
+    // frames that took longer than a period from waking to presented
+    u64 over_frame_time = 0;
+    // presents without a new camera frame
+    u64 redundant_presents = 0;
 
-    struct capture_data capture_data = {};
-    capture_data.mutex = SDL_CreateMutex();
-    capture_data.fd = cam_fd;
-    capture_data.buffers = buffers;
-    capture_data.width = cam_width;
-    capture_data.height = cam_height;
-
-    SDL_Thread *capture_thread = SDL_CreateThread(run_capture, "capture", &capture_data);
+    struct trace_ring *display_trace = new_trace_ring("display");
 
+    start_cameras(cameras, n_cameras);
 
     // XXXXXXXXXXXXXXXXXXX Begin Main Loop XXXXXXXXXXXXXXXXXXX
 
     while (running) {
-        // seems like this should switch to using clock_nanosleep for frame timing
-        end_count = SDL_GetPerformanceCounter();
-        elapsed_count = end_count - start_count;
-        if (elapsed_count < count_per_frame) {
-            //debugf("elapsed: %lu, start: %lu, end: %lu", elapsed_count, start_count, end_count);
-            u32 delay = (count_per_frame - elapsed_count)/count_per_ms; 
-            //debugf("delay: %u", delay);
-            if (delay > 1) {
-                // nanosleep?
-                SDL_Delay(delay - 1);
-            }
-
-            //while loop for trimming off the rest of the delay
-            while ((SDL_GetPerformanceCounter() - start_count) < count_per_frame) {
-                // wasting time
-            }
-        } else {
-            debugf("XXX over frame time: %lu", elapsed_count);
+        // sleeps until a capture thread publishes a frame or there's input.
+        // The timeout redraws the latency stats and anything the window
+        // lost.
+        int timeout_ms = !frame_event ? 1000/target_fps : show_latency ? 250 : 1000;
+        bool changed = !SDL_WaitEventTimeout(NULL, timeout_ms);
+        if (!vsync) {
+            sleep_until_ns(next_present_ns);
         }
-
-        end_count = SDL_GetPerformanceCounter();
-
-        // actual start of "frame", seems like this should be end_count above
-        start_count = SDL_GetPerformanceCounter();
-
-        // start frame
+        u64 render_ns = monotonic_ns();
 
         while (SDL_PollEvent(&event)) {
+            if (frame_event && event.type == frame_event) {
+                // the frames are taken below
+                continue;
+            }
+            changed = true;
             if (event.type == SDL_QUIT) {
                 debug("quit");
                 running = false;
@@ -1279,13 +8053,32 @@ main(int argc, char *argv[])
                     case SDLK_n:
                         if (event.key.keysym.mod & KMOD_CTRL) {
                             debug("reset race");
-                            capture_data.reset_race = true;
+                            race_reset(&race);
+                            for (int i = 0; i < n_cameras; i++) {
+                                atomic_store(&cameras[i].cd.reset_race, true);
+                            }
+                        }
+                        break;
+                    case SDLK_d:
+                        for (int i = 0; i < n_cameras; i++) {
+                            atomic_store(&cameras[i].cd.show_mask, !atomic_load(&cameras[i].cd.show_mask));
                         }
                         break;
+                    case SDLK_l:
+                        show_latency = !show_latency;
+                        break;
                     case SDLK_r:
                         record = !record;
                         record_frame = 1;
                         break;
+                    case SDLK_SPACE: // next frame of a single stepped replay
+                        for (int i = 0; i < n_cameras; i++) {
+                            if (cameras[i].source->step) {
+                                cameras[i].source->step(cameras[i].source);
+                                wake_capture(&cameras[i].cd);
+                            }
+                        }
+                        break;
                     case SDLK_q:
                         debug("q quit");
                         running = false;
@@ -1298,32 +8091,105 @@ main(int argc, char *argv[])
 
         if (!running) break;
 
-        clear_image(frame_rgba);
+        // take the newest frames first, nothing is drawn when there are
+        // none and nothing else changed
+        bool acquired[MAX_CAMERAS] = {};
+        bool new_frame = false;
+        for (int i = 0; i < n_cameras; i++) {
+            struct capture_data *cd = &cameras[i].cd;
+            atomic_store(&cd->frame_event_pending, false);
+            acquired[i] = triple_buffer_acquire(&cd->display);
+            new_frame |= acquired[i];
+        }
+        if (!new_frame && !changed) {
+            continue;
+        }
 
-        fill_rect(frame_rgba, 0, 480, frame_width, 240, &WHITE);
+        copy_damage(frame_rgba, overlay_base, &drawn);
+        last_drawn = drawn;
+        drawn = (struct damage){};
 
         if (record) {
             fill_square_center(frame_rgba, 4, 4, 4, &RED);
         }
+        if (record || shots.dropped) {
+            char shots_text[64];
+            snprintf(shots_text, 64, "shots queued %u/%d dropped %lu", shot_queue_depth(&shots),
+                    SHOT_QUEUE_SIZE, shots.dropped);
+            draw_text(frame_rgba, frame_width - 310, 700, 1, &BLACK, shots_text);
+        }
 
-        if (SDL_LockMutex(capture_data.mutex) == 0) {
-            if (capture_data.valid_image) {
-                image *img = capture_data.image1[capture_data.rindex];
-                SDL_UpdateTexture(texture1, NULL, img->data, img->stride);
+        if (show_latency) {
+            draw_trace_summary(frame_rgba, frame_width - 310, 488, &BLACK, over_frame_time,
+                    redundant_presents);
+        }
 
-                img = capture_data.image2[capture_data.rindex];
-                SDL_UpdateTexture(texture2, NULL, img->data, img->stride);
-            } else {
-                SDL_UpdateTexture(texture1, NULL, checkerboard1->data, checkerboard1->stride);
-                SDL_UpdateTexture(texture2, NULL, checkerboard2->data, checkerboard2->stride);
+        // textures keep the last frame until there's a newer one
+        bool uploaded[MAX_CAMERAS] = {};
+        for (int i = 0; i < n_cameras; i++) {
+            struct camera *cam = &cameras[i];
+            struct capture_data *cd = &cam->cd;
+            const int chroma_stride = cd->width/2;
+            const bool valid_image = atomic_load_explicit(&cd->valid_image, memory_order_acquire);
+
+            if (acquired[i] && valid_image) {
+                u64 upload_ns = monotonic_ns();
+                image *img = cd->gray[cd->display.front];
+                SDL_UpdateYUVTexture(cam->gray_texture, NULL, img->data, img->stride,
+                        cam->gray_chroma, chroma_stride, cam->gray_chroma, chroma_stride);
+
+                const u8 *frame = cd->frames[cd->display.front].data;
+                if (frame) {
+                    SDL_UpdateTexture(cam->color_texture, NULL, frame, source_stride(cd->source));
+                } else if (cd->yuyv[cd->display.front]) {
+                    img = cd->yuyv[cd->display.front];
+                    SDL_UpdateTexture(cam->color_texture, NULL, img->data, img->stride);
+                }
+                trace_stage(display_trace, STAGE_UPLOAD, i, cd->frame_sequence[cd->display.front],
+                        cd->frame_base_ns[cd->display.front], upload_ns, monotonic_ns());
+                uploaded[i] = true;
+            } else if (!valid_image) {
+                SDL_UpdateYUVTexture(cam->gray_texture, NULL, cam->checkerboard1->data, cam->checkerboard1->stride,
+                        cam->gray_chroma, chroma_stride, cam->gray_chroma, chroma_stride);
+                SDL_UpdateTexture(cam->color_texture, NULL, cam->checkerboard2->data, cam->checkerboard2->stride);
+            }
+
+            if (valid_image) {
+                draw_overlay(frame_rgba, &cd->overlays[cd->display.front], cam->views,
+                        cd->width, cd->height);
             }
+        }
 
-            SDL_UnlockMutex(capture_data.mutex);
+        // the writer thread composites and saves it, the display only
+        // copies what it's showing
+        if (record || capture) {
+            struct shot *shot = shot_begin(&shots);
+            if (shot) {
+                if (record) {
+                    snprintf(shot->filename, sizeof(shot->filename), "record-%07d.bmp", record_frame);
+                    record_frame++;
+                } else {
+                    snprintf(shot->filename, sizeof(shot->filename), "capture-%ld.bmp", SDL_GetPerformanceCounter());
+                }
+                copy_shot(shot, cameras, n_cameras, frame_rgba);
+                shot_queue(&shots);
+            } else if (capture) {
+                SDL_Log("capture dropped, %d shots already queued", SHOT_QUEUE_SIZE);
+            }
+            capture = false;
         }
 
         // this is like 5-6ms if the texture pixel format doesn't
         // match what is supported by the SDL_Renderer?
-        SDL_UpdateTexture(texture, NULL, frame_rgba->data, frame_rgba->stride);
+        upload = last_drawn;
+        damage_merge(&upload, &drawn);
+        if (upload.all) {
+            SDL_UpdateTexture(texture, NULL, frame_rgba->data, frame_rgba->stride);
+        }
+        for (int i = 0; !upload.all && i < upload.n_rects; i++) {
+            const SDL_Rect *r = &upload.rects[i];
+            SDL_UpdateTexture(texture, r, frame_rgba->data + r->y*frame_rgba->stride + r->x*4, frame_rgba->stride);
+        }
 
         //draw some text stats on screen
 
@@ -1331,79 +8197,59 @@ main(int argc, char *argv[])
         // light in the camera view
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
-        const SDL_Rect cam_dst = {
-            .x = 0,
-            .y = 0,
-            .w = 640,
-            .h = 480 
-        };
-        const SDL_Rect bg_dst = {
-            .x = 640,
-            .y = 0,
-            .w = 640,
-            .h = 480 
-        };
-        SDL_RenderCopy(renderer, texture1, NULL, &cam_dst);
-        SDL_RenderCopy(renderer, texture2, NULL, &bg_dst);
+        for (int i = 0; i < n_cameras; i++) {
+            struct camera *cam = &cameras[i];
+            if (i == 0) {
+                SDL_RenderCopy(renderer, cam->gray_texture, NULL, &cam->views[OVERLAY_GRAY]);
+            }
+            // GREY cameras have no color view
+            SDL_RenderCopy(renderer, cam->cd.pixelformat == V4L2_PIX_FMT_GREY ? cam->gray_texture : cam->color_texture,
+                    NULL, &cam->views[OVERLAY_COLOR]);
+        }
         SDL_RenderCopy(renderer, texture, NULL, NULL);
+        u64 present_ns = monotonic_ns();
         SDL_RenderPresent(renderer);
 
-        // TODO(jason): move all this image writing to a separate thread
-        if (record || capture) {
-            capture = false;
-
-            char filename[256];
-            if (record) {
-                snprintf(filename, 256, "record-%07d.bmp", record_frame); 
-                record_frame++;
-            } else {
-                //snprintf(filename, 256, "capture-%ld.%ld.bmp", (uint64_t)vbuf.timestamp.tv_sec, vbuf.timestamp.tv_usec); 
-                snprintf(filename, 256, "capture-%ld.bmp", SDL_GetPerformanceCounter()); 
-            }
-
-            // this takes 3-5ms, mostly in SDL_RenderReadPixels
-            //u32 sshot_ms = SDL_GetTicks();
-            if (!sshot) {
-                int w, h;
-                SDL_GetRendererOutputSize(renderer, &w, &h);
-                sshot = SDL_CreateRGBSurface(0, w, h, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
-                if (!sshot) {
-                    debugf("Unable to allocate surface from screenshot: %s", SDL_GetError());
-                    errno_exit("SDL_CreateRGBSurface: sshot");
-                }
+        // when each new frame reached the screen, with vsync this includes
+        // waiting for it
+        u64 presented_ns = monotonic_ns();
+        for (int i = 0; i < n_cameras; i++) {
+            struct capture_data *cd = &cameras[i].cd;
+            if (uploaded[i]) {
+                trace_stage(display_trace, STAGE_PRESENT, i, cd->frame_sequence[cd->display.front],
+                        cd->frame_base_ns[cd->display.front], present_ns, presented_ns);
             }
-            SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_ARGB8888, sshot->pixels, sshot->pitch);
-            //debugf("read screen: %d", SDL_GetTicks() - sshot_ms);
-            SDL_SaveBMP(sshot, filename);
-            //debugf("save screenshot: %d", SDL_GetTicks() - sshot_ms);
         }
+
+        if (presented_ns - render_ns > frame_period_ns) {
+            over_frame_time++;
+        }
+        if (!new_frame) {
+            redundant_presents++;
+        }
+        next_present_ns = next_deadline_ns(next_present_ns, present_ns, frame_period_ns);
     }
 
     // XXXXXXXXXXXXXXXXXXX End Main Loop XXXXXXXXXXXXXXXXXXX
 
-    // probably not thread safe?
-    capture_data.running = false;
-
-    if (capture_thread) {
-        int tr;
-        SDL_WaitThread(capture_thread, &tr);
-        debugf("capture thread returned: %d", tr);
-    }
+    stop_cameras(cameras, n_cameras);
 
-    for (unsigned int i = 0; i < n_buffers; i++) {
-        if (munmap(buffers[i].start, buffers[i].length) == -1) {
-            perror("munmap");
-        }
+    if (over_frame_time) {
+        SDL_Log("display loop over frame time %lu times", over_frame_time);
     }
-    free(buffers);
-
-    if (close(cam_fd) == -1) {
-        perror("cam close");
+    if (redundant_presents) {
+        SDL_Log("display presented %lu times without a new frame", redundant_presents);
     }
+    save_trace(trace_file);
 
+    stop_shot_writer(&shots);
     free_image(frame_rgba);
+    free_image(overlay_base);
+    if (race.events) {
+        fclose(race.events);
+    }
+    SDL_DestroyMutex(race.mutex);
 
-    if (sshot) SDL_FreeSurface(sshot);
     // NOTE(jason): SDL_DestroyRenderer frees all textures
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
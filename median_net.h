@@ -0,0 +1,99 @@
+/** \file
+ * Median selection networks for 3x3, 5x5 and 7x7 windows as X-macros.
+ *
+ * MEDIAN_NET_n(CX, MN, MX) expands to the compare-exchanges that leave the
+ * median of v[0] to v[n - 1] in v[n/2].  The caller defines what the
+ * operations are, usually SIMD min/max so one expansion filters 16 or 32
+ * pixels at a time without branches:
+ *
+ *   CX(a, b): v[a] = min(v[a], v[b]), v[b] = max(v[a], v[b])
+ *   MN(a, b): v[a] = min(v[a], v[b]), v[b] isn't used again
+ *   MX(a, b): v[b] = max(v[a], v[b]), v[a] isn't used again
+ *
+ * Generated from Batcher's odd-even merge sort for the next power of 2.
+ * Comparators touching the padding (treated as +inf) are dropped, then
+ * working backwards from v[n/2] only comparators that feed the median are
+ * kept, and the ones where only one output is used become MN or MX.
+ * 9: 24 comparators, 25: 113, 49: 319.
+ */
+#ifndef _median_net_h_
+#define _median_net_h_
+
+#define MEDIAN_NET_9(CX, MN, MX) \
+    CX(0, 1) CX(2, 3) CX(4, 5) CX(6, 7) CX(0, 2) CX(1, 3) CX(4, 6) CX(5, 7) \
+    CX(1, 2) CX(5, 6) CX(0, 4) CX(1, 5) CX(2, 6) MN(3, 7) CX(2, 4) CX(3, 5) \
+    MX(1, 2) CX(3, 4) MN(5, 6) MX(0, 8) MN(4, 8) MX(2, 4) MN(3, 5) MX(3, 4)
+
+#define MEDIAN_NET_25(CX, MN, MX) \
+    CX(0, 1) CX(2, 3) CX(4, 5) CX(6, 7) CX(8, 9) CX(10, 11) CX(12, 13) \
+    CX(14, 15) CX(16, 17) CX(18, 19) CX(20, 21) CX(22, 23) CX(0, 2) CX(1, 3) \
+    CX(4, 6) CX(5, 7) CX(8, 10) CX(9, 11) CX(12, 14) CX(13, 15) CX(16, 18) \
+    CX(17, 19) CX(20, 22) CX(21, 23) CX(1, 2) CX(5, 6) CX(9, 10) CX(13, 14) \
+    CX(17, 18) CX(21, 22) CX(0, 4) CX(1, 5) CX(2, 6) CX(3, 7) CX(8, 12) \
+    CX(9, 13) CX(10, 14) CX(11, 15) CX(16, 20) CX(17, 21) CX(18, 22) \
+    CX(19, 23) CX(2, 4) CX(3, 5) CX(10, 12) CX(11, 13) CX(18, 20) CX(19, 21) \
+    CX(1, 2) CX(3, 4) CX(5, 6) CX(9, 10) CX(11, 12) CX(13, 14) CX(17, 18) \
+    CX(19, 20) CX(21, 22) CX(0, 8) CX(1, 9) CX(2, 10) CX(3, 11) CX(4, 12) \
+    CX(5, 13) CX(6, 14) MN(7, 15) CX(16, 24) CX(4, 8) CX(5, 9) CX(6, 10) \
+    CX(7, 11) CX(20, 24) CX(2, 4) CX(3, 5) CX(6, 8) CX(7, 9) CX(10, 12) \
+    CX(11, 13) CX(18, 20) CX(19, 21) CX(22, 24) CX(1, 2) CX(3, 4) CX(5, 6) \
+    CX(7, 8) CX(9, 10) CX(11, 12) MN(13, 14) CX(17, 18) CX(19, 20) \
+    CX(21, 22) CX(23, 24) MX(0, 16) MX(1, 17) MX(2, 18) MX(3, 19) MX(4, 20) \
+    MX(5, 21) MN(6, 22) MN(7, 23) MN(8, 24) MX(8, 16) MX(9, 17) MN(10, 18) \
+    MN(11, 19) MN(12, 20) MN(13, 21) MX(6, 10) MX(7, 11) MN(12, 16) \
+    MN(13, 17) MX(10, 12) MN(11, 13) MX(11, 12)
+
+#define MEDIAN_NET_49(CX, MN, MX) \
+    CX(0, 1) CX(2, 3) CX(4, 5) CX(6, 7) CX(8, 9) CX(10, 11) CX(12, 13) \
+    CX(14, 15) CX(16, 17) CX(18, 19) CX(20, 21) CX(22, 23) CX(24, 25) \
+    CX(26, 27) CX(28, 29) CX(30, 31) CX(32, 33) CX(34, 35) CX(36, 37) \
+    CX(38, 39) CX(40, 41) CX(42, 43) CX(44, 45) CX(46, 47) CX(0, 2) CX(1, 3) \
+    CX(4, 6) CX(5, 7) CX(8, 10) CX(9, 11) CX(12, 14) CX(13, 15) CX(16, 18) \
+    CX(17, 19) CX(20, 22) CX(21, 23) CX(24, 26) CX(25, 27) CX(28, 30) \
+    CX(29, 31) CX(32, 34) CX(33, 35) CX(36, 38) CX(37, 39) CX(40, 42) \
+    CX(41, 43) CX(44, 46) CX(45, 47) CX(1, 2) CX(5, 6) CX(9, 10) CX(13, 14) \
+    CX(17, 18) CX(21, 22) CX(25, 26) CX(29, 30) CX(33, 34) CX(37, 38) \
+    CX(41, 42) CX(45, 46) CX(0, 4) CX(1, 5) CX(2, 6) CX(3, 7) CX(8, 12) \
+    CX(9, 13) CX(10, 14) CX(11, 15) CX(16, 20) CX(17, 21) CX(18, 22) \
+    CX(19, 23) CX(24, 28) CX(25, 29) CX(26, 30) CX(27, 31) CX(32, 36) \
+    CX(33, 37) CX(34, 38) CX(35, 39) CX(40, 44) CX(41, 45) CX(42, 46) \
+    CX(43, 47) CX(2, 4) CX(3, 5) CX(10, 12) CX(11, 13) CX(18, 20) CX(19, 21) \
+    CX(26, 28) CX(27, 29) CX(34, 36) CX(35, 37) CX(42, 44) CX(43, 45) \
+    CX(1, 2) CX(3, 4) CX(5, 6) CX(9, 10) CX(11, 12) CX(13, 14) CX(17, 18) \
+    CX(19, 20) CX(21, 22) CX(25, 26) CX(27, 28) CX(29, 30) CX(33, 34) \
+    CX(35, 36) CX(37, 38) CX(41, 42) CX(43, 44) CX(45, 46) CX(0, 8) CX(1, 9) \
+    CX(2, 10) CX(3, 11) CX(4, 12) CX(5, 13) CX(6, 14) CX(7, 15) CX(16, 24) \
+    CX(17, 25) CX(18, 26) CX(19, 27) CX(20, 28) CX(21, 29) CX(22, 30) \
+    CX(23, 31) CX(32, 40) CX(33, 41) CX(34, 42) CX(35, 43) CX(36, 44) \
+    CX(37, 45) CX(38, 46) CX(39, 47) CX(4, 8) CX(5, 9) CX(6, 10) CX(7, 11) \
+    CX(20, 24) CX(21, 25) CX(22, 26) CX(23, 27) CX(36, 40) CX(37, 41) \
+    CX(38, 42) CX(39, 43) CX(2, 4) CX(3, 5) CX(6, 8) CX(7, 9) CX(10, 12) \
+    CX(11, 13) CX(18, 20) CX(19, 21) CX(22, 24) CX(23, 25) CX(26, 28) \
+    CX(27, 29) CX(34, 36) CX(35, 37) CX(38, 40) CX(39, 41) CX(42, 44) \
+    CX(43, 45) CX(1, 2) CX(3, 4) CX(5, 6) CX(7, 8) CX(9, 10) CX(11, 12) \
+    CX(13, 14) CX(17, 18) CX(19, 20) CX(21, 22) CX(23, 24) CX(25, 26) \
+    CX(27, 28) CX(29, 30) CX(33, 34) CX(35, 36) CX(37, 38) CX(39, 40) \
+    CX(41, 42) CX(43, 44) CX(45, 46) CX(0, 16) CX(1, 17) CX(2, 18) CX(3, 19) \
+    CX(4, 20) CX(5, 21) CX(6, 22) CX(7, 23) CX(8, 24) CX(9, 25) CX(10, 26) \
+    CX(11, 27) CX(12, 28) CX(13, 29) MN(14, 30) MN(15, 31) CX(32, 48) \
+    CX(8, 16) CX(9, 17) CX(10, 18) CX(11, 19) CX(12, 20) CX(13, 21) \
+    CX(14, 22) CX(15, 23) CX(40, 48) CX(4, 8) CX(5, 9) CX(6, 10) CX(7, 11) \
+    CX(12, 16) CX(13, 17) CX(14, 18) CX(15, 19) CX(20, 24) CX(21, 25) \
+    CX(22, 26) CX(23, 27) CX(36, 40) CX(37, 41) CX(38, 42) CX(39, 43) \
+    CX(44, 48) CX(2, 4) CX(3, 5) CX(6, 8) CX(7, 9) CX(10, 12) CX(11, 13) \
+    CX(14, 16) CX(15, 17) CX(18, 20) CX(19, 21) CX(22, 24) CX(23, 25) \
+    CX(26, 28) MN(27, 29) CX(34, 36) CX(35, 37) CX(38, 40) CX(39, 41) \
+    CX(42, 44) CX(43, 45) CX(46, 48) CX(1, 2) CX(3, 4) CX(5, 6) CX(7, 8) \
+    CX(9, 10) CX(11, 12) CX(13, 14) CX(15, 16) CX(17, 18) CX(19, 20) \
+    CX(21, 22) CX(23, 24) CX(25, 26) MN(27, 28) CX(33, 34) CX(35, 36) \
+    CX(37, 38) CX(39, 40) CX(41, 42) CX(43, 44) CX(45, 46) CX(47, 48) \
+    MX(0, 32) MX(1, 33) MX(2, 34) MX(3, 35) MX(4, 36) MX(5, 37) MX(6, 38) \
+    MX(7, 39) MX(8, 40) MX(9, 41) MX(10, 42) MX(11, 43) MN(12, 44) \
+    MN(13, 45) MN(14, 46) MN(15, 47) MN(16, 48) MX(16, 32) MX(17, 33) \
+    MX(18, 34) MX(19, 35) MN(20, 36) MN(21, 37) MN(22, 38) MN(23, 39) \
+    MN(24, 40) MN(25, 41) MN(26, 42) MN(27, 43) MX(12, 20) MX(13, 21) \
+    MX(14, 22) MX(15, 23) MN(24, 32) MN(25, 33) MN(26, 34) MN(27, 35) \
+    MX(20, 24) MX(21, 25) MN(22, 26) MN(23, 27) MX(22, 24) MN(23, 25) \
+    MX(23, 24)
+
+#endif